@@ -0,0 +1,84 @@
+#!/bin/bash
+
+# per-call overhead of the hooks, for each backend:
+#  * vfs_write: 1-byte writes to /dev/null, every one of them traps
+#    (and is filtered out) while the hooks are armed. Its hook keeps
+#    per-task data (current_data), so it is a kretprobe whatever the
+#    backend: the column tells the hook type actually measured
+#  * __bread_gfp: 1-byte reads of the singlefilefs file, every one
+#    of them is a sb_bread, hooked through the selected backend
+# "disarmed" is the module loaded with no device registered
+#
+# run from the demo folder: bash bench/hooks-overhead.sh [ncalls]
+
+source utils.sh
+
+NCALLS=1000000
+if [ $# -ge 1 ]; then
+	NCALLS=$1
+fi
+
+NBLKS=10
+FILE_SIZE=$((NBLKS * 4096))
+NREADS=$(( (NCALLS + FILE_SIZE - 1) / FILE_SIZE ))
+
+load_module() {
+	cd ..
+	sudo make module-umount 2>/dev/null >>/dev/null
+	sudo make PASSWD=$MODULE_PASSWD MODPARAMS="hook_backend=$1" module-mount 2>/dev/null >>/dev/null
+	cd demo
+}
+
+# elapsed ns of a command
+ns_of() {
+	local start=$(date +%s%N)
+	"$@" 2>/dev/null >>/dev/null
+	local end=$(date +%s%N)
+	echo $((end - start))
+}
+
+bench_vfs_write() {
+	ns_of dd if=/dev/zero of=/dev/null bs=1 count=$NCALLS
+}
+
+bench_bread() {
+	local total=0
+	for i in $(seq $NREADS); do
+		total=$((total + $(ns_of dd if=$MNTPOINT/the-file of=/dev/null bs=1)))
+	done
+
+	echo $total
+}
+
+# $1 setup, $2 hook type of vfs_write, $3 hook type of __bread_gfp
+report() {
+	local setup=$1
+	local wns=$(bench_vfs_write)
+	local rns=$(bench_bread)
+
+	printf "%-10s vfs_write (%-9s) %8d ns/call    __bread_gfp (%-9s) %8d ns/call\n" \
+		$setup $2 $((wns / NCALLS)) $3 $((rns / (NREADS * FILE_SIZE)))
+}
+
+for backend in kprobe fprobe; do
+	load_module $backend
+	prepare_demo $NBLKS >>/dev/null
+
+	if [ $backend == kprobe ]; then
+		do_mount
+		report disarmed none none
+		do_umount
+	fi
+
+	activate_device >>/dev/null
+	do_mount
+	if [ $backend == kprobe ]; then
+		report $backend kretprobe kretprobe
+	else
+		report $backend kretprobe fprobe
+	fi
+	do_umount
+	deactivate_device
+done
+
+sudo make -C .. module-umount 2>/dev/null >>/dev/null
@@ -1,4 +1,9 @@
 #include <linux/cred.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/limits.h>
 
 #ifndef CONFIG_SYSFS
 #include <linux/fs.h>
@@ -6,6 +11,7 @@
 
 #include <passwd.h>
 #include <devices.h>
+#include <snapshot.h>
 #include <activation.h>
 #include <pr-err-failure.h>
 
@@ -14,16 +20,27 @@ static int auth_check(const char* passwd);
 
 /* activate/deactivate snapshot */
 
-static int activate_snapshot(const char* dev_name, const char* passwd) {
+static int activate_snapshot(const char* dev_name, const char* passwd, char* options) {
 	int auth_check_rv = auth_check(passwd);
 	if(auth_check_rv != 0) {
 		return auth_check_rv;
 	}
 
-	return register_device(dev_name);
+	const struct snapshot_options *opts = snapshot_options_share(options);
+	if(IS_ERR(opts)) {
+		return PTR_ERR(opts);
+	}
+
+	int rv = register_device(dev_name, opts);
+
+	//the device has its own reference
+	snapshot_options_put(opts);
+
+	return rv;
 }
 
-static int deactivate_snapshot(const char* dev_name, const char* passwd) {
+static int deactivate_snapshot(
+		const char* dev_name, const char* passwd, char* __always_unused options) {
 	int auth_check_rv = auth_check(passwd);
 	if(auth_check_rv != 0) {
 		return auth_check_rv;
@@ -47,7 +64,10 @@ static int auth_check(const char* passwd) {
 	return 0;
 }
 
-static inline int parse_call_args(char* data, size_t datalen, const char** lhs, const char** rhs) {
+// "dev\rpasswd" or "dev\rpasswd\roptions"
+static inline int parse_call_args(
+		char* data, size_t datalen, 
+		const char** lhs, const char** rhs, char** opts) {
 	if(data[datalen - 1] != 0) {
 		return -EINVAL;
 	}
@@ -66,21 +86,29 @@ static inline int parse_call_args(char* data, size_t datalen, const char** lhs,
 
 	*lhs = first_nowschr;
 	*rhs = separator + 1;
+	*opts = NULL;
+
+	separator = strchr(separator + 1, '\r');
+	if(separator != NULL) {
+		*separator = 0;
+		*opts = separator + 1;
+	}
 
 	return 0; 
 }
 
-typedef int(*wrapped_call_fnt)(const char*, const char*);
+typedef int(*wrapped_call_fnt)(const char*, const char*, char*);
 
 static int call_wrapper(char* data, size_t datalen, wrapped_call_fnt callback) {
 	const char *devn;
 	const char *pwd;
+	char *opts;
 
-	if(parse_call_args(data, datalen, &devn, &pwd) != 0) {
+	if(parse_call_args(data, datalen, &devn, &pwd, &opts) != 0) {
 		return -EINVAL;
 	}
 
-	int retval = callback(devn, pwd);
+	int retval = callback(devn, pwd, opts);
 	if(retval) {
 		return retval;
 	}
@@ -88,6 +116,143 @@ static int call_wrapper(char* data, size_t datalen, wrapped_call_fnt callback) {
 	return datalen;   
 }
 
+/* batches */
+
+// "dev\ndev\n...\rpasswd" or "dev\ndev\n...\rpasswd\roptions": authenticated
+// (and options parsed) once, every device is then resolved by the caller,
+// in its own context (root, cwd, mount namespace), and (un)registered on
+// its own work, in parallel. Empty lines are skipped, statuses are in the
+// order of the non empty ones
+
+#define ACTIVATION_BATCH_MAX_ENTRIES 4096
+
+// every path, plus the "\rpasswd\roptions" tail, which fits a page as a
+// single (de)activation request does
+#define ACTIVATION_BATCH_MAX_DATALEN \
+	((size_t) ACTIVATION_BATCH_MAX_ENTRIES * PATH_MAX + PAGE_SIZE)
+
+// batch_status is a single page: a sysfs batch has no more entries than
+// "index errno" lines of the widest kind fit it, so that none is lost
+#define ACTIVATION_SYSFS_BATCH_MAX_ENTRIES \
+	min_t(size_t, ACTIVATION_BATCH_MAX_ENTRIES, PAGE_SIZE / (sizeof("4095 -4095\n") - 1))
+
+struct batch_entry {
+	struct work_struct work;
+	const char *dev_name;
+	struct device_ref ref;
+	//NULL on deactivation
+	const struct snapshot_options *opts;
+	int status;
+};
+
+static void batch_entry_work(struct work_struct *work) {
+	struct batch_entry *entry = container_of(work, struct batch_entry, work);
+
+	entry->status = entry->opts != NULL ? 
+		register_device_ref(&entry->ref, entry->dev_name, entry->opts) : 
+		unregister_device_ref(&entry->ref);
+
+	put_device_ref(&entry->ref);
+}
+
+static int __run_batch(
+		char* dev_names, const struct snapshot_options *opts, size_t max_entries,
+		int **out_statuses, size_t *out_nr) {
+
+	size_t max_nr = 1;
+	for(const char *c = dev_names; *c != 0; c++) {
+		max_nr += *c == '\n';
+	}
+
+	if(max_nr > max_entries) {
+		return -E2BIG;
+	}
+
+	struct batch_entry *entries = kvcalloc(max_nr, sizeof(struct batch_entry), GFP_KERNEL);
+	if(entries == NULL) {
+		pr_err_failure("kvcalloc");
+		return -ENOMEM;
+	}
+
+	int *statuses = kvcalloc(max_nr, sizeof(int), GFP_KERNEL);
+	if(statuses == NULL) {
+		pr_err_failure("kvcalloc");
+		kvfree(entries);
+		return -ENOMEM;
+	}
+
+	size_t nr = 0;
+	char *dev_name;
+
+	while((dev_name = strsep(&dev_names, "\n")) != NULL) {
+		dev_name = strim(dev_name);
+		if(*dev_name == 0) {
+			continue;
+		}
+
+		struct batch_entry *entry = &entries[nr++];
+		entry->dev_name = dev_name;
+		entry->opts = opts;
+
+		INIT_WORK(&entry->work, batch_entry_work);
+
+		entry->status = resolve_device(dev_name, &entry->ref);
+		if(entry->status != 0) {
+			continue;
+		}
+
+		queue_work(system_unbound_wq, &entry->work);
+	}
+
+	for(size_t i = 0; i < nr; i++) {
+		flush_work(&entries[i].work);
+		statuses[i] = entries[i].status;
+	}
+
+	kvfree(entries);
+
+	*out_statuses = statuses;
+	*out_nr = nr;
+
+	return 0;
+}
+
+// on success, statuses are to be kvfreed by the caller
+static int run_batch(
+		char* data, size_t datalen, bool activate, size_t max_entries,
+		int **out_statuses, size_t *out_nr) {
+
+	const char *devns;
+	const char *pwd;
+	char *options;
+
+	if(parse_call_args(data, datalen, &devns, &pwd, &options) != 0) {
+		return -EINVAL;
+	}
+
+	int rv = auth_check(pwd);
+	if(rv != 0) {
+		return rv;
+	}
+
+	if(!activate) {
+		//our own buffer
+		return __run_batch((char*) devns, NULL, max_entries, out_statuses, out_nr);
+	}
+
+	const struct snapshot_options *opts = snapshot_options_share(options);
+	if(IS_ERR(opts)) {
+		return PTR_ERR(opts);
+	}
+
+	rv = __run_batch((char*) devns, opts, max_entries, out_statuses, out_nr);
+
+	//every device has its own reference, to this single copy
+	snapshot_options_put(opts);
+
+	return rv;
+}
+
 #ifdef CONFIG_SYSFS
 
 static ssize_t __sysfs_call_wrapper(const char* data, size_t datalen, wrapped_call_fnt fn) {
@@ -101,7 +266,8 @@ static ssize_t __sysfs_call_wrapper(const char* data, size_t datalen, wrapped_ca
 
 	ssize_t rv = call_wrapper(buf, datalen, fn);
 
-	kfree(buf);
+	//password and keys
+	kfree_sensitive(buf);
 
 	return rv;
 }
@@ -122,6 +288,84 @@ static ssize_t deactivate_snapshot_sysfs_store(
 	return __sysfs_call_wrapper(data, datalen, deactivate_snapshot);
 }
 
+// the statuses of the last batch, for the process which wrote it only
+static DEFINE_MUTEX(last_batch_lock);
+static pid_t last_batch_tgid;
+static int *last_batch_statuses;
+static size_t last_batch_nr;
+
+static ssize_t __sysfs_batch_call_wrapper(const char* data, size_t datalen, bool activate) {
+	char* buf = kmalloc(sizeof(char) * datalen, GFP_KERNEL);
+	if(buf == NULL) {
+		pr_err_failure("kmalloc");
+		return -ENOMEM;
+	}
+
+	memcpy(buf, data, sizeof(char) * datalen);
+
+	int *statuses;
+	size_t nr;
+
+	ssize_t rv = run_batch(buf, datalen, activate, ACTIVATION_SYSFS_BATCH_MAX_ENTRIES, &statuses, &nr);
+
+	//password and keys
+	kfree_sensitive(buf);
+
+	if(rv != 0) {
+		return rv;
+	}
+
+	mutex_lock(&last_batch_lock);
+
+	kvfree(last_batch_statuses);
+	last_batch_tgid = task_tgid_nr(current);
+	last_batch_statuses = statuses;
+	last_batch_nr = nr;
+
+	mutex_unlock(&last_batch_lock);
+
+	return datalen;
+}
+
+static ssize_t activate_batch_sysfs_store(
+		__always_unused struct kobject*, 
+		__always_unused struct kobj_attribute*, 
+		const char* data, size_t datalen) {
+
+	return __sysfs_batch_call_wrapper(data, datalen, true);
+}
+
+static ssize_t deactivate_batch_sysfs_store(
+		__always_unused struct kobject*, 
+		__always_unused struct kobj_attribute*, 
+		const char* data, size_t datalen) {
+
+	return __sysfs_batch_call_wrapper(data, datalen, false);
+}
+
+// "index errno" lines, failed entries only (up to a page of them)
+static ssize_t batch_status_sysfs_show(
+		__always_unused struct kobject*, 
+		__always_unused struct kobj_attribute*, 
+		char* buf) {
+
+	ssize_t len = 0;
+
+	mutex_lock(&last_batch_lock);
+
+	if(last_batch_statuses != NULL && last_batch_tgid == task_tgid_nr(current)) {
+		for(size_t i = 0; i < last_batch_nr; i++) {
+			if(last_batch_statuses[i] != 0) {
+				len += sysfs_emit_at(buf, len, "%zu %d\n", i, last_batch_statuses[i]);
+			}
+		}
+	}
+
+	mutex_unlock(&last_batch_lock);
+
+	return len;
+}
+
 static const struct kobj_attribute activate_kobj_attribute = (struct kobj_attribute) {
 	.store = activate_snapshot_sysfs_store,
 	.attr = (struct attribute) {
@@ -138,18 +382,117 @@ static const struct kobj_attribute deactivate_kobj_attribute = (struct kobj_attr
 	}
 };
 
+static const struct kobj_attribute activate_batch_kobj_attribute = (struct kobj_attribute) {
+	.store = activate_batch_sysfs_store,
+	.attr = (struct attribute) {
+		.mode = S_IWUSR | S_IWGRP | S_IWOTH,
+		.name = "activate_snapshot_batch",
+	}
+};
+
+static const struct kobj_attribute deactivate_batch_kobj_attribute = (struct kobj_attribute) {
+	.store = deactivate_batch_sysfs_store,
+	.attr = (struct attribute) {
+		.mode = S_IWUSR | S_IWGRP | S_IWOTH,
+		.name = "deactivate_snapshot_batch"
+	}
+};
+
+static const struct kobj_attribute batch_status_kobj_attribute = (struct kobj_attribute) {
+	.show = batch_status_sysfs_show,
+	.attr = (struct attribute) {
+		.mode = S_IRUSR,
+		.name = "batch_status"
+	}
+};
+
+static const struct attribute *activation_attrs[] = {
+	&activate_kobj_attribute.attr,
+	&deactivate_kobj_attribute.attr,
+	&activate_batch_kobj_attribute.attr,
+	&deactivate_batch_kobj_attribute.attr,
+	&batch_status_kobj_attribute.attr,
+	NULL
+};
+
 #else
 
 #define ACTIVATION_CHRDEV_NAME "blkdev-snapshot-activation"
 #define ACTIVATE_CHRDEV_IOCTL_CMD 0
 #define DEACTIVATE_CHRDEV_IOCTL_CMD 1
+#define ACTIVATE_BATCH_CHRDEV_IOCTL_CMD 2
+#define DEACTIVATE_BATCH_CHRDEV_IOCTL_CMD 3
 
 struct activation_ioctl_args {
 	const char* data;
 	size_t datalen;
 };
 
+// the ioctl returns the number of entries, up to nr_statuses statuses are copied
+struct activation_batch_ioctl_args {
+	const char* data;
+	size_t datalen;
+	int *statuses;
+	size_t nr_statuses;
+};
+
+static long activation_chrdev_batch_ioctl(unsigned int cmd, unsigned long arg) {
+	struct activation_batch_ioctl_args args;
+	if(copy_from_user(&args, (void __user*) arg, sizeof(args)) != 0) {
+		return -EFAULT;
+	}
+
+	if(args.datalen == 0) {
+		return -EINVAL;
+	}
+
+	//checked before the password is: bounded by what a batch can hold
+	if(args.datalen > ACTIVATION_BATCH_MAX_DATALEN) {
+		return -E2BIG;
+	}
+
+	char *buf = kvmalloc(sizeof(char) * args.datalen, GFP_KERNEL);
+	if(buf == NULL) {
+		pr_err_failure("kvmalloc");
+		return -ENOMEM;
+	}
+
+	if(copy_from_user(buf, (const char __user*) args.data, args.datalen) != 0) {
+		//a partial copy may hold the password and keys already
+		kvfree_sensitive(buf, args.datalen);
+		return -EFAULT;
+	}
+
+	int *statuses;
+	size_t nr;
+
+	long rv = run_batch(
+			buf, args.datalen, cmd == ACTIVATE_BATCH_CHRDEV_IOCTL_CMD, 
+			ACTIVATION_BATCH_MAX_ENTRIES, &statuses, &nr);
+
+	//password and keys
+	kvfree_sensitive(buf, args.datalen);
+
+	if(rv != 0) {
+		return rv;
+	}
+
+	size_t nr_copied = min(nr, args.nr_statuses);
+	if(copy_to_user((int __user*) args.statuses, statuses, nr_copied * sizeof(int)) != 0) {
+		kvfree(statuses);
+		return -EFAULT;
+	}
+
+	kvfree(statuses);
+
+	return nr;
+}
+
 static long activation_chrdev_ioctl(struct file* f, unsigned int cmd, unsigned long arg) {
+	if(cmd == ACTIVATE_BATCH_CHRDEV_IOCTL_CMD || cmd == DEACTIVATE_BATCH_CHRDEV_IOCTL_CMD) {
+		return activation_chrdev_batch_ioctl(cmd, arg);
+	}
+
 	if(cmd != ACTIVATE_CHRDEV_IOCTL_CMD && cmd != DEACTIVATE_CHRDEV_IOCTL_CMD) {
 		return -EINVAL;
 	}
@@ -175,7 +518,8 @@ static long activation_chrdev_ioctl(struct file* f, unsigned int cmd, unsigned l
 
 	int rv = call_wrapper(buf, user_args->datalen, fun);
 
-	kfree(buf);
+	//password and keys
+	kfree_sensitive(buf);
 
 	return rv;
 }
@@ -199,15 +543,9 @@ int setup_activation_mechanism(void) {
 #ifdef CONFIG_SYSFS
 	struct kobject *this_module_kobj = &THIS_MODULE->mkobj.kobj;
 
-	if((rv = sysfs_create_file(this_module_kobj, &activate_kobj_attribute.attr)) != 0) {
-		pr_err_failure_with_code("sysfs_create_file", rv);
-		destroy_passwd();
-		return rv;
-	}
-
-	if((rv = sysfs_create_file(this_module_kobj, &deactivate_kobj_attribute.attr)) != 0) {
-		pr_err_failure_with_code("sysfs_create_file", rv);
-		sysfs_remove_file(this_module_kobj, &activate_kobj_attribute.attr);
+	//all or none
+	if((rv = sysfs_create_files(this_module_kobj, activation_attrs)) != 0) {
+		pr_err_failure_with_code("sysfs_create_files", rv);
 		destroy_passwd();
 		return rv;
 	}
@@ -234,8 +572,10 @@ void destroy_activation_mechanism(void) {
 #ifdef CONFIG_SYSFS
 	struct kobject *this_module_kobj = &THIS_MODULE->mkobj.kobj;
 
-	sysfs_remove_file(this_module_kobj, &activate_kobj_attribute.attr);
-	sysfs_remove_file(this_module_kobj, &deactivate_kobj_attribute.attr);
+	sysfs_remove_files(this_module_kobj, activation_attrs);
+
+	kvfree(last_batch_statuses);
+	last_batch_statuses = NULL;
 #else
 	unregister_chrdev(activation_chrdev_maj, ACTIVATION_CHRDEV_NAME);
 #endif
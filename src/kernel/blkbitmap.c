@@ -0,0 +1,294 @@
+#include <linux/slab.h>
+#include <linux/xarray.h>
+#include <linux/bitmap.h>
+#include <linux/atomic.h>
+
+#include <blkbitmap.h>
+#include <pr-err-failure.h>
+
+// roaring-style compressed bitmap:
+// the block numbers space is split in chunks of 2^16 blocks, each chunk
+// (a "container") is stored in an xarray, indexed by the upper bits of the
+// block number, and is represented in the cheapest way for its cardinality:
+//  * array: sorted lower 16 bits of the set blocks, up to 4096 of them
+//  * bitmap: plain 8KB dense bitmap, once the array would grow past 8KB
+//  * full: every block of the chunk is set, no memory at all (value entry)
+//
+// membership is exact (no eviction), O(1) for bitmap and full containers,
+// and a binary search over at most 4096 u16 for arrays
+//
+// spatial considerations
+//
+// for 4K fs blocks, a chunk spans 256MB of device storage:
+//  * sparse captures cost 2B per captured block
+//  * dense ones cost at most 8KB per 256MB chunk, 32MB for a whole 1TB device
+//    in the pathological case (e.g. every other block captured),
+//  * fully captured ranges cost nothing
+// any exact set needs ~1 bit per block in the worst case, this is it.
+// Typical workloads, made of runs of contiguous blocks, stay in a few MBs.
+//
+// the bytes held by containers (and the bitmap itself) are added to the
+// counter given at allocation, if any, as they come and go: xarray nodes
+// are not, they are a few hundred bytes per 64 chunks
+
+#define BLKBITMAP_CHUNK_BITS 16
+#define BLKBITMAP_CHUNK_SIZE (1U << BLKBITMAP_CHUNK_BITS)
+#define BLKBITMAP_ARRAY_MAX_CARD 4096
+#define BLKBITMAP_ARRAY_MIN_CAP 8
+
+#define BLKBITMAP_FULL_ENTRY xa_mk_value(0)
+
+enum blkbitmap_container_type {
+	BLKBITMAP_CONTAINER_ARRAY,
+	BLKBITMAP_CONTAINER_BITMAP
+};
+
+struct blkbitmap_container {
+	enum blkbitmap_container_type type;
+	u32 card;
+	u32 cap;
+	union {
+		u16 *array;
+		unsigned long *bits;
+	};
+};
+
+struct blkbitmap {
+	struct xarray containers;
+	atomic_long_t *mem;
+};
+
+static inline void mem_add(struct blkbitmap *bm, long size) {
+	if(bm->mem != NULL) {
+		atomic_long_add(size, bm->mem);
+	}
+}
+
+static inline unsigned long chunk_of(sector_t blknr) {
+	return (unsigned long) (blknr >> BLKBITMAP_CHUNK_BITS);
+}
+
+static inline u16 low_of(sector_t blknr) {
+	return (u16) (blknr & (BLKBITMAP_CHUNK_SIZE - 1));
+}
+
+/**
+ *
+ * containers
+ *
+ */
+
+static struct blkbitmap_container *alloc_container(void) {
+	struct blkbitmap_container *c = kzalloc(sizeof(struct blkbitmap_container), GFP_KERNEL);
+	if(c == NULL) {
+		pr_err_failure("kzalloc");
+		return NULL;
+	}
+
+	c->array = kmalloc_array(BLKBITMAP_ARRAY_MIN_CAP, sizeof(u16), GFP_KERNEL);
+	if(c->array == NULL) {
+		pr_err_failure("kmalloc_array");
+		kfree(c);
+		return NULL;
+	}
+
+	c->type = BLKBITMAP_CONTAINER_ARRAY;
+	c->cap = BLKBITMAP_ARRAY_MIN_CAP;
+
+	return c;
+}
+
+static size_t container_mem(const struct blkbitmap_container *c) {
+	return sizeof(struct blkbitmap_container) + 
+		(c->type == BLKBITMAP_CONTAINER_BITMAP ? 
+			BITS_TO_LONGS(BLKBITMAP_CHUNK_SIZE) * sizeof(unsigned long) : 
+			c->cap * sizeof(u16));
+}
+
+static void free_container(struct blkbitmap *bm, struct blkbitmap_container *c) {
+	mem_add(bm, -(long) container_mem(c));
+
+	if(c->type == BLKBITMAP_CONTAINER_BITMAP) {
+		bitmap_free(c->bits);
+	} else {
+		kfree(c->array);
+	}
+
+	kfree(c);
+}
+
+// index of the first element >= key
+static u32 array_lower_bound(const u16 *array, u32 n, u16 key) {
+	u32 lo = 0;
+	u32 hi = n;
+
+	while(lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if(array[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static bool container_test(const struct blkbitmap_container *c, u16 low) {
+	if(c->type == BLKBITMAP_CONTAINER_BITMAP) {
+		return test_bit(low, c->bits);
+	}
+
+	u32 pos = array_lower_bound(c->array, c->card, low);
+	return pos < c->card && c->array[pos] == low;
+}
+
+static bool container_array_to_bitmap(struct blkbitmap_container *c) {
+	unsigned long *bits = bitmap_zalloc(BLKBITMAP_CHUNK_SIZE, GFP_KERNEL);
+	if(bits == NULL) {
+		pr_err_failure("bitmap_zalloc");
+		return false;
+	}
+
+	for(u32 i = 0; i < c->card; i++) {
+		__set_bit(c->array[i], bits);
+	}
+
+	kfree(c->array);
+
+	c->type = BLKBITMAP_CONTAINER_BITMAP;
+	c->bits = bits;
+	c->cap = 0;
+
+	return true;
+}
+
+// false only on allocation failures
+static bool container_set(struct blkbitmap_container *c, u16 low) {
+	if(c->type == BLKBITMAP_CONTAINER_BITMAP) {
+		if(!__test_and_set_bit(low, c->bits)) {
+			c->card++;
+		}
+
+		return true;
+	}
+
+	u32 pos = array_lower_bound(c->array, c->card, low);
+	if(pos < c->card && c->array[pos] == low) {
+		return true;
+	}
+
+	if(c->card == BLKBITMAP_ARRAY_MAX_CARD) {
+		return container_array_to_bitmap(c) && container_set(c, low);
+	}
+
+	if(c->card == c->cap) {
+		u32 newcap = min_t(u32, c->cap * 2, BLKBITMAP_ARRAY_MAX_CARD);
+		u16 *newarray = krealloc(c->array, sizeof(u16) * newcap, GFP_KERNEL);
+		if(newarray == NULL) {
+			pr_err_failure("krealloc");
+			return false;
+		}
+
+		c->array = newarray;
+		c->cap = newcap;
+	}
+
+	memmove(&c->array[pos + 1], &c->array[pos], sizeof(u16) * (c->card - pos));
+	c->array[pos] = low;
+	c->card++;
+
+	return true;
+}
+
+/**
+ *
+ * bitmap
+ *
+ */
+
+struct blkbitmap* blkbitmap_alloc_and_init(atomic_long_t *mem) {
+	struct blkbitmap *bm = kmalloc(sizeof(struct blkbitmap), GFP_KERNEL);
+	if(bm == NULL) {
+		pr_err_failure("kmalloc");
+		return NULL;
+	}
+
+	xa_init(&bm->containers);
+	bm->mem = mem;
+	mem_add(bm, sizeof(struct blkbitmap));
+
+	return bm;
+}
+
+bool blkbitmap_test(struct blkbitmap *bm, sector_t blknr) {
+	void *entry = xa_load(&bm->containers, chunk_of(blknr));
+
+	if(entry == NULL) {
+		return false;
+	}
+
+	if(entry == BLKBITMAP_FULL_ENTRY) {
+		return true;
+	}
+
+	return container_test((struct blkbitmap_container*) entry, low_of(blknr));
+}
+
+bool blkbitmap_set(struct blkbitmap *bm, sector_t blknr) {
+	unsigned long chunk = chunk_of(blknr);
+	void *entry = xa_load(&bm->containers, chunk);
+
+	if(entry == BLKBITMAP_FULL_ENTRY) {
+		return true;
+	}
+
+	struct blkbitmap_container *c = (struct blkbitmap_container*) entry;
+
+	if(c == NULL) {
+		if((c = alloc_container()) == NULL) {
+			return false;
+		}
+
+		mem_add(bm, container_mem(c));
+
+		void *old = xa_store(&bm->containers, chunk, c, GFP_KERNEL);
+		if(xa_is_err(old)) {
+			pr_err_failure_with_code("xa_store", xa_err(old));
+			free_container(bm, c);
+			return false;
+		}
+	}
+
+	//arrays grow, and turn into bitmaps
+	long mem_before = container_mem(c);
+	bool set = container_set(c, low_of(blknr));
+	mem_add(bm, (long) container_mem(c) - mem_before);
+
+	if(!set) {
+		return false;
+	}
+
+	if(c->card == BLKBITMAP_CHUNK_SIZE) {
+		//replacing an existing entry never allocates
+		xa_store(&bm->containers, chunk, BLKBITMAP_FULL_ENTRY, GFP_KERNEL);
+		free_container(bm, c);
+	}
+
+	return true;
+}
+
+void blkbitmap_cleanup_and_destroy(struct blkbitmap *bm) {
+	unsigned long chunk;
+	void *entry;
+
+	xa_for_each(&bm->containers, chunk, entry) {
+		if(!xa_is_value(entry)) {
+			free_container(bm, (struct blkbitmap_container*) entry);
+		}
+	}
+
+	xa_destroy(&bm->containers);
+	mem_add(bm, -(long) sizeof(struct blkbitmap));
+	kfree(bm);
+}
@@ -1,8 +1,11 @@
 #include <linux/rhashtable.h>
 #include <linux/namei.h>
+#include <linux/hash.h>
+#include <linux/percpu.h>
 
-#include <lru-ng.h>
 #include <devices.h>
+#include <snapshot.h>
+#include <probes.h>
 #include <pr-err-failure.h>
 #include <get-loop-backing-file.h>
 
@@ -13,41 +16,48 @@
  */
 
 // "data" should not be visible at the time of init
-static void __init_object_data(
+static int __init_object_data(
 		struct object_data* data, 
 		const char* original_dev_name, 
-		const char* wqfmt, 
-		const void *wqarg) {
+		const struct snapshot_options *opts) {
 
 	spin_lock_init(&data->general_lock);
-	rwlock_init(&data->wq_destroy_lock);
 
 	data->e = NULL;
 
-	strscpy(data->original_dev_name, original_dev_name, PATH_MAX);
+	data->original_dev_name = name_intern(original_dev_name, GFP_KERNEL);
+	if(IS_ERR(data->original_dev_name)) {
+		return PTR_ERR(data->original_dev_name);
+	}
+
+	//an ordering lane on the module-wide pool, see lanes.h
+	data->lane = lane_alloc(GFP_KERNEL);
+	if(data->lane == NULL) {
+		name_put(data->original_dev_name);
+		return -ENOMEM;
+	}
 
-	data->wq = alloc_ordered_workqueue(wqfmt, WQ_FREEZABLE, wqarg);
+	data->opts = snapshot_options_get(opts);
 	data->wq_is_destroyed = false;
+	return 0;
 }
 
-static void init_object_data_blkdev(
+static int init_object_data_blkdev(
 		struct object_data* data, 
-		dev_t devt, 
-		const char* original_dev_name) {
+		dev_t __always_unused devt, 
+		const char* original_dev_name,
+		const struct snapshot_options *opts) {
 
-	__init_object_data(
-			data, original_dev_name, 
-			"bdsnap-b%d", (void*) (intptr_t) devt);
+	return __init_object_data(data, original_dev_name, opts);
 }
 
-static void init_object_data_loop(
+static int init_object_data_loop(
 		struct object_data* data, 
-		const char* lof, 
-		const char* original_dev_name) {
+		const char* __always_unused lof, 
+		const char* original_dev_name,
+		const struct snapshot_options *opts) {
 
-	__init_object_data(
-			data, original_dev_name, 
-			"bdsnap-l%s", lof);
+	return __init_object_data(data, original_dev_name, opts);
 }
 
 //this is called only once:
@@ -62,29 +72,42 @@ static void init_object_data_loop(
 //data->e will eventually be set to NULL and we got the general_lock.
 //
 //on the contrary, if the umount event count gets the general_lock prior
-//we just wait for all the wqs to finish and nothing more is done 
+//we just wait for all the lanes to finish and nothing more is done 
 //since it already queued the last work that will cleanup the epoch 
 //and they set data->e to NULL (see workfn)
 
 struct waddw_args  {
-	struct workqueue_struct *device_wq;
+	struct lane *device_lane;
 	struct epoch *last_epoch;
 };
 
-#define SET_WADDW_ARGS(_name, _wq, _epoch) \
-	(_name).device_wq = (_wq); \
+#define SET_WADDW_ARGS(_name, _lane, _epoch) \
+	(_name).device_lane = (_lane); \
 	(_name).last_epoch = (_epoch)
 
-#define DEFINE_WADDW_ARGS(_name, _wq, _epoch) \
+#define DEFINE_WADDW_ARGS(_name, _lane, _epoch) \
 	struct waddw_args _name = { \
-		.device_wq = (_wq), \
+		.device_lane = (_lane), \
 		.last_epoch = (_epoch) \
 	}
 
 static void __do_waddw(const struct waddw_args *wargs) {
-	flush_workqueue(wargs->device_wq);
-	destroy_workqueue(wargs->device_wq);
-	destroy_an_epoch(wargs->last_epoch);
+	//captures are taken locklessly (under RCU) once they have seen
+	//!wq_is_destroyed: wait for them and move them to their epoch
+	synchronize_rcu();
+	drain_capture_rings();
+
+	lane_flush(wargs->device_lane);
+
+	if(wargs->last_epoch != NULL) {
+		//no captures can be added anymore, write out the pending ones
+		//now rather than waiting for the batch timer to hit a dead lane
+		flush_epoch_pending_captures(wargs->last_epoch);
+		//last reference, most likely: cleanup is queued on device_lane
+		put_an_epoch(wargs->last_epoch);
+	}
+
+	lane_destroy(wargs->device_lane);
 }
 
 struct waddw_work {
@@ -92,7 +115,7 @@ struct waddw_work {
 	struct work_struct work;
 };
 
-static void wait_and_destroy_device_workqueue(struct work_struct *work) {
+static void wait_and_destroy_device_lane(struct work_struct *work) {
 	struct waddw_work *args = container_of(work, struct waddw_work, work);
 	__do_waddw(&args->waddw_args);
 }
@@ -110,20 +133,22 @@ static void cleanup_object_data(struct object_data* data) {
 	unsigned long cpu_flags_0;
 	spin_lock_irqsave(&data->general_lock, cpu_flags_0);
 
-	unsigned long cpu_flags_1;
-	write_lock_irqsave(&data->wq_destroy_lock, cpu_flags_1);
-
 	data->wq_is_destroyed = true;
 
-	write_unlock_irqrestore(&data->wq_destroy_lock, cpu_flags_1);
-
 	struct epoch *saved_last_epoch = data->e;
 	if(data->e != NULL) {
 		data->e = NULL;
 	}
 
+	//no new epoch from now on, the current one has its own reference
+	snapshot_options_put(data->opts);
+	data->opts = NULL;
+
 	spin_unlock_irqrestore(&data->general_lock, cpu_flags_0);
 
+	//no new epoch can take it anymore, the current one has its own reference
+	name_put(data->original_dev_name);
+
 	bool do_my_work = false;
 
 	struct waddw_worklist_node *wlistnode = kmalloc(sizeof(struct waddw_worklist_node), GFP_ATOMIC);
@@ -141,8 +166,8 @@ static void cleanup_object_data(struct object_data* data) {
 
 	do_my_work = true;
 
-	SET_WADDW_ARGS(wlistnode->wargs->waddw_args, data->wq, saved_last_epoch);
-	INIT_WORK(&wlistnode->wargs->work, wait_and_destroy_device_workqueue);
+	SET_WADDW_ARGS(wlistnode->wargs->waddw_args, data->lane, saved_last_epoch);
+	INIT_WORK(&wlistnode->wargs->work, wait_and_destroy_device_lane);
 	schedule_work(&wlistnode->wargs->work);
 
 __cleanup_object_data_finish0:
@@ -169,9 +194,11 @@ __cleanup_object_data_finish0:
 
 //in process context only
 static void cleanup_object_data_notvisible(struct object_data* data) {
-	DEFINE_WADDW_ARGS(args, data->wq, data->e);
+	DEFINE_WADDW_ARGS(args, data->lane, data->e);
 	__do_waddw(&args);
 	data->wq_is_destroyed = true;
+	snapshot_options_put(data->opts);
+	name_put(data->original_dev_name);
 }
 
 /**
@@ -215,8 +242,8 @@ struct loop_object {
 	struct rhash_head linkage;
 	struct rcu_head rcu;
 
-	char *key;
-	char __key_buf[PATH_MAX];
+	//full path of the image, interned
+	const struct name *key;
 	struct object_data value;
 };
 
@@ -226,14 +253,14 @@ static u32 loop_object_key_hashfn(const void *data, u32 __always_unused len, u32
 
 static u32 loop_object_obj_hashfn(const void *data, u32 __always_unused len, u32 seed) {
 	const struct loop_object *lo = (const struct loop_object*) data;
-	u32 hash = jhash(lo->key, strlen(lo->key), seed);
+	u32 hash = jhash(lo->key->str, lo->key->len, seed);
 
 	return hash;
 }
 
 static int loop_object_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj) {
 	const char *new_key = (const char*) arg->key;
-	int res = strcmp(((const struct loop_object*) obj)->key, new_key);
+	int res = strcmp(((const struct loop_object*) obj)->key->str, new_key);
 
 	return res;
 }
@@ -252,9 +279,83 @@ static struct rhashtable loops_ht;
 static void loops_ht_free_fn(void* ptr, void* __always_unused arg) {
 	struct loop_object *loptr = (struct loop_object*) ptr;
 	cleanup_object_data(&loptr->value);
+	//freed after a grace period as well: lookups may still be comparing it
+	name_put(loptr->key);
 	kfree_rcu(loptr, rcu);
 }
 
+/**
+ *
+ * loop devices bindings rhashtable
+ *
+ * which registered image (if any) a loop device (dev_t) is bound to, so
+ * that probes look loop devices up by an integer key, as block devices,
+ * and not by their backing file name. Bindings are made at activation
+ * time (when activating through the loop device) or by the first lookup
+ * of the loop device, and are tagged with the devices generation they
+ * were resolved at (see devices_changed): a loop device can be bound to
+ * another file only after being unmounted, and mounts bump the generation.
+ * Stale bindings are replaced by the next lookup. A binding is never
+ * followed once stale, so the loop object it points to may be gone
+ *
+ */
+
+struct loop_binding {
+	struct rhash_head linkage;
+	struct rcu_head rcu;
+
+	dev_t key;
+	unsigned long gen;
+	//NULL: the loop device is not bound to a registered image
+	struct loop_object *lo;
+};
+
+static const struct rhashtable_params loop_bindings_ht_params = {
+	.key_len = sizeof(dev_t),
+	.key_offset = offsetof(struct loop_binding, key),
+	.head_offset = offsetof(struct loop_binding, linkage),
+	.automatic_shrinking = true
+};
+
+static struct rhashtable loop_bindings_ht;
+
+static void loop_bindings_ht_free_fn(void* ptr, void* __always_unused arg) {
+	struct loop_binding *b = (struct loop_binding*) ptr;
+	kfree_rcu(b, rcu);
+}
+
+//0 is never current: zeroed cache entries never hit (see devices_changed)
+static atomic_long_t devices_gen = ATOMIC_LONG_INIT(1);
+
+// atomic context allowed, under RCU
+static void bind_loop_device(dev_t devt, struct loop_object *lo, unsigned long gen) {
+	struct loop_binding *b = kmalloc(sizeof(struct loop_binding), GFP_ATOMIC);
+	if(b == NULL) {
+		//next lookup will try again
+		return;
+	}
+
+	b->key = devt;
+	b->gen = gen;
+	b->lo = lo;
+
+	struct loop_binding *old = 
+		rhashtable_lookup_get_insert_fast(&loop_bindings_ht, &b->linkage, loop_bindings_ht_params);
+
+	if(old == NULL) {
+		return;
+	}
+
+	//an older one is replaced, one as new as ours or newer is kept
+	if(!IS_ERR(old) && gen > old->gen && 
+			rhashtable_replace_fast(&loop_bindings_ht, &old->linkage, &b->linkage, loop_bindings_ht_params) == 0) {
+		kfree_rcu(old, rcu);
+		return;
+	}
+
+	kfree(b);
+}
+
 /**
  *
  * common utils
@@ -280,6 +381,28 @@ static char* get_full_path(const char* path, char* out_full_path, size_t len) {
 	return _ptr_in_buf;
 }
 
+//PATH_MAX is needed only while resolving the path, what is kept is as long as the name
+static char *dup_full_path(const char* path) {
+	char *__full_path_buf = (char*) kmalloc(sizeof(char) * PATH_MAX, GFP_KERNEL);
+	if(__full_path_buf == NULL) {
+		pr_err_failure("kmalloc");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	char* full_path = get_full_path(path, __full_path_buf, PATH_MAX);
+	if(!IS_ERR(full_path)) {
+		full_path = kstrdup(full_path, GFP_KERNEL);
+		if(full_path == NULL) {
+			pr_err_failure("kstrdup");
+			full_path = ERR_PTR(-ENOMEM);
+		}
+	}
+
+	kfree(__full_path_buf);
+
+	return full_path;
+}
+
 // IMPORTANT, REFCOUNTING:
 // the output inode (out_inode) is grabbed
 // if retval != 0, inode is not grabbed
@@ -355,55 +478,129 @@ static int get_loop_device_backing_file(dev_t bddevt, char* out_lofname) {
  *
  */
 
-static bool allow_reging_operation = false;
-static DECLARE_RWSEM(allow_reging_operation_sem);
+int resolve_device(const char* path, struct device_ref *out_ref) {
+	struct inode *ino;
+	int err = get_inode_from_cstr_path(path, &ino);
 
-static int __do_device_reging_operation(
-		const char* path, 
-		int (*op_on_loopdev)(const char*, const char*), 
-		int (*op_on_blkdev)(dev_t, const char*)) {
+	if(err != 0) {
+		return err;
+	}
 
-	down_read(&allow_reging_operation_sem);
-	if(!allow_reging_operation) {
-		up_read(&allow_reging_operation_sem);
-		return -EBUSY;
+	if(ino == NULL) {
+		return -ENFILE;
 	}
 
-	struct inode *ino;
-	int err = get_inode_from_cstr_path(path, &ino);
+	char *full_path = NULL;
+
+	if(S_ISBLK(ino->i_mode) && MAJOR(ino->i_rdev) == LOOP_MAJOR) {
+		char loop_backing_path[__MY_LO_NAME_SIZE];
+
+		err = get_loop_device_backing_file(ino->i_rdev, loop_backing_path);
+		if(err == 0) {
+			full_path = dup_full_path(loop_backing_path);
+		}
+	} else if(S_ISREG(ino->i_mode)) {
+		full_path = dup_full_path(path);
+	} else if(!S_ISBLK(ino->i_mode)) {
+		err = -EINVAL;
+	}
+
+	if(err == 0 && IS_ERR(full_path)) {
+		err = PTR_ERR(full_path);
+	}
 
 	if(err != 0) {
-		up_read(&allow_reging_operation_sem);
+		iput(ino);
 		return err;
 	}
 
-	if(ino == NULL) {
+	out_ref->ino = ino;
+	out_ref->full_path = full_path;
+
+	return 0;
+}
+
+void put_device_ref(struct device_ref *ref) {
+	iput(ref->ino);
+	kfree(ref->full_path);
+}
+
+static bool allow_reging_operation = false;
+static DECLARE_RWSEM(allow_reging_operation_sem);
+
+static int __do_device_reging_operation(
+		const struct device_ref *ref, 
+		const char* dev_name,
+		const struct snapshot_options *opts,
+		int (*op_on_loopdev)(const char*, dev_t, const char*, const struct snapshot_options*), 
+		int (*op_on_blkdev)(dev_t, const char*, const struct snapshot_options*)) {
+
+	down_read(&allow_reging_operation_sem);
+	if(!allow_reging_operation) {
 		up_read(&allow_reging_operation_sem);
-		return -ENFILE;
+		return -EBUSY;
 	}
 
+	struct inode *ino = ref->ino;
+	int err;
+
 	if(S_ISBLK(ino->i_mode)) {
 		if(MAJOR(ino->i_rdev) == LOOP_MAJOR) {
-			char loop_backing_path[__MY_LO_NAME_SIZE];
-
-			err = get_loop_device_backing_file(ino->i_rdev, loop_backing_path);
-			if(err == 0) {
-				err = op_on_loopdev(loop_backing_path, path);
-			}
+			err = op_on_loopdev(ref->full_path, ino->i_rdev, dev_name, opts);
 		} else {
-			err = op_on_blkdev(ino->i_rdev, path);
+			err = op_on_blkdev(ino->i_rdev, dev_name, opts);
 		}
-	} else if(S_ISREG(ino->i_mode)) {
-		err = op_on_loopdev(path, path);
 	} else {
-		err = -EINVAL;
+		//its loop devices are bound by their first lookup
+		err = op_on_loopdev(ref->full_path, 0, dev_name, opts);
 	}
 
-	iput(ino);
 	up_read(&allow_reging_operation_sem);
 	return err;
 }
 
+/**
+ *
+ * probes arming
+ *
+ * nothing to snapshot, nothing to probe: probes are armed while
+ * at least one device is registered, so that the whole system
+ * pays nothing for them otherwise
+ *
+ */
+
+static DEFINE_MUTEX(nr_registered_devices_lock);
+static unsigned int nr_registered_devices = 0;
+
+// before a device becomes visible: none of its writes is missed
+static int get_armed_probes(void) {
+	int err = 0;
+
+	mutex_lock(&nr_registered_devices_lock);
+
+	if(nr_registered_devices == 0) {
+		err = arm_probes();
+	}
+
+	if(err == 0) {
+		nr_registered_devices++;
+	}
+
+	mutex_unlock(&nr_registered_devices_lock);
+
+	return err;
+}
+
+static void put_armed_probes(void) {
+	mutex_lock(&nr_registered_devices_lock);
+
+	if(--nr_registered_devices == 0) {
+		disarm_probes();
+	}
+
+	mutex_unlock(&nr_registered_devices_lock);
+}
+
 /**
  *
  * insertion of devices
@@ -415,40 +612,62 @@ static int __do_device_reging_operation(
  *
  */
 
-static int try_to_insert_loop_device(const char* path, const char* original_dev_name) {
+static int try_to_insert_loop_device(
+		const char* full_path, dev_t lodevt, const char* original_dev_name, 
+		const struct snapshot_options *opts) {
 	struct loop_object *new_obj = kzalloc(sizeof(struct loop_object), GFP_KERNEL);
 	if(new_obj == NULL) {
 		pr_err_failure("kzalloc");
 		return -ENOMEM;
 	}
 
-	new_obj->key = get_full_path(path, new_obj->__key_buf, PATH_MAX);
+	new_obj->key = name_intern(full_path, GFP_KERNEL);
 	if(IS_ERR(new_obj->key)) {
+		int err = PTR_ERR(new_obj->key);
 		kfree(new_obj);
-		return PTR_ERR(new_obj->key);
+		return err;
 	}
 
-	init_object_data_loop(&new_obj->value, new_obj->key, original_dev_name);
+	int err = init_object_data_loop(&new_obj->value, new_obj->key->str, original_dev_name, opts);
+	if(err != 0) {
+		name_put(new_obj->key);
+		kfree(new_obj);
+		return err;
+	}
 
 
 	struct loop_object *old_obj = 
-		rhashtable_lookup_get_insert_key(&loops_ht, new_obj->key, &new_obj->linkage, loops_ht_params);
+		rhashtable_lookup_get_insert_key(&loops_ht, new_obj->key->str, &new_obj->linkage, loops_ht_params);
 	
 	if(IS_ERR(old_obj)) {
 		pr_err_failure_with_code("rhashtable_lookup_get_insert_key", PTR_ERR(old_obj));
 		cleanup_object_data_notvisible(&new_obj->value);
+		name_put(new_obj->key);
 		kfree(new_obj);
 		return -EFAULT;
 	} else if(old_obj != NULL) {
 		cleanup_object_data_notvisible(&new_obj->value);
+		name_put(new_obj->key);
 		kfree(new_obj);
 		return -EEXIST;
 	}
 
+	//cached misses of this device are stale
+	devices_changed();
+
+	//activated through the loop device: bound right away
+	if(lodevt != 0) {
+		rcu_read_lock();
+		bind_loop_device(lodevt, new_obj, atomic_long_read(&devices_gen));
+		rcu_read_unlock();
+	}
+
 	return 0;
 }
 
-static int try_to_insert_block_device(dev_t bddevt, const char* original_dev_name) {
+static int try_to_insert_block_device(
+		dev_t bddevt, const char* original_dev_name, 
+		const struct snapshot_options *opts) {
 	struct blkdev_object *new_obj = kzalloc(sizeof(struct blkdev_object), GFP_KERNEL);
 	if(new_obj == NULL) {
 		pr_err_failure("kzalloc");
@@ -457,7 +676,11 @@ static int try_to_insert_block_device(dev_t bddevt, const char* original_dev_nam
 
 	new_obj->key = bddevt;
 
-	init_object_data_blkdev(&new_obj->value, bddevt, original_dev_name);
+	int err = init_object_data_blkdev(&new_obj->value, bddevt, original_dev_name, opts);
+	if(err != 0) {
+		kfree(new_obj);
+		return err;
+	}
 
 	struct blkdev_object *old_obj = 
 		rhashtable_lookup_get_insert_fast(&blkdevs_ht, &new_obj->linkage, blkdevs_ht_params);
@@ -473,14 +696,46 @@ static int try_to_insert_block_device(dev_t bddevt, const char* original_dev_nam
 		return -EEXIST;
 	}
 
+	//cached misses of this device are stale
+	devices_changed();
+
 	return 0;
 }
 
-int register_device(const char* path) {
-	return __do_device_reging_operation(
-			path, 
+int register_device_ref(
+		const struct device_ref *ref, const char* dev_name, 
+		const struct snapshot_options *opts) {
+	int err = get_armed_probes();
+	if(err != 0) {
+		return err;
+	}
+
+	err = __do_device_reging_operation(
+			ref,
+			dev_name, 
+			opts,
 			try_to_insert_loop_device, 
 			try_to_insert_block_device);
+
+	if(err != 0) {
+		put_armed_probes();
+	}
+
+	return err;
+}
+
+int register_device(const char* path, const struct snapshot_options *opts) {
+	struct device_ref ref;
+	int err = resolve_device(path, &ref);
+	if(err != 0) {
+		return err;
+	}
+
+	err = register_device_ref(&ref, path, opts);
+
+	put_device_ref(&ref);
+
+	return err;
 }
 
 /**
@@ -490,28 +745,16 @@ int register_device(const char* path) {
  */
 
 static int try_to_remove_loop_device(
-		const char* path, const char* __always_unused arg) {
-
-	//PATH_MAX is too big for the stack
-	char *__full_path_buf = (char*) kmalloc(sizeof(char) * PATH_MAX, GFP_KERNEL);
-	if(__full_path_buf == NULL) {
-		pr_err_failure("kmalloc");
-		return -ENOMEM;
-	}
-
-	char* full_path = get_full_path(path, __full_path_buf, PATH_MAX);
-	if(IS_ERR(full_path)) {
-		kfree(__full_path_buf);
-		return PTR_ERR(full_path);
-	}
+		const char* full_path, 
+		dev_t __always_unused lodevt,
+		const char* __always_unused arg, 
+		const struct snapshot_options* __always_unused opts) {
 
 	rcu_read_lock();
 
 	struct loop_object *cur_obj = 
 		rhashtable_lookup(&loops_ht, full_path, loops_ht_params);
 
-	kfree(__full_path_buf);
-
 	if(cur_obj == NULL) {
 		rcu_read_unlock();
 		return -ENOKEY;
@@ -519,6 +762,8 @@ static int try_to_remove_loop_device(
 
 	if (rhashtable_remove_fast(&loops_ht, &cur_obj->linkage, loops_ht_params) == 0) {
 		rcu_read_unlock();
+		//before it goes: cached lookups and bindings to it are stale from now on
+		devices_changed();
 		loops_ht_free_fn((void*)cur_obj, NULL);
 	} else {
 		rcu_read_unlock();
@@ -529,7 +774,9 @@ static int try_to_remove_loop_device(
 }
 
 static int try_to_remove_block_device(
-		dev_t bddevt, const char* __always_unused arg) {
+		dev_t bddevt, 
+		const char* __always_unused arg, 
+		const struct snapshot_options* __always_unused opts) {
 
 	rcu_read_lock();
 
@@ -543,6 +790,8 @@ static int try_to_remove_block_device(
 
 	if (rhashtable_remove_fast(&blkdevs_ht, &cur_obj->linkage, blkdevs_ht_params) == 0) {
 		rcu_read_unlock();
+		//before it goes: cached lookups of it are stale from now on
+		devices_changed();
 		blkdevs_ht_free_fn((void*)cur_obj, NULL);
 	} else {
 		rcu_read_unlock();
@@ -552,11 +801,33 @@ static int try_to_remove_block_device(
 	return 0;
 }
 
-int unregister_device(const char* path) {
-	return __do_device_reging_operation(
-			path,
+int unregister_device_ref(const struct device_ref *ref) {
+	int err = __do_device_reging_operation(
+			ref,
+			NULL,
+			NULL,
 			try_to_remove_loop_device,
 			try_to_remove_block_device);
+
+	if(err == 0) {
+		put_armed_probes();
+	}
+
+	return err;
+}
+
+int unregister_device(const char* path) {
+	struct device_ref ref;
+	int err = resolve_device(path, &ref);
+	if(err != 0) {
+		return err;
+	}
+
+	err = unregister_device_ref(&ref);
+
+	put_device_ref(&ref);
+
+	return err;
 }
 
 /**
@@ -595,6 +866,110 @@ struct object_data *get_device_data_always(const struct mountinfo *minfo) {
 	return __do_get_device_data_always(minfo->device.lo_fname, false);
 }
 
+/**
+ *
+ * device lookup cache
+ *
+ * looking a loop device up means copying its backing file name and
+ * hashing it, on every probe hit. Each CPU keeps a small direct-mapped
+ * cache of the last block_device to object_data (or NULL) results,
+ * tagged with the generation they were looked up at: anything that may
+ * change what a block_device maps to bumps the generation (see
+ * devices_changed), so that a hit is a couple of loads and compares.
+ *
+ * Entries of a CPU are only touched by that CPU (preemption disabled),
+ * the only concurrency is an interrupt: writers disable them, readers
+ * check the entry sequence did not move while they were reading it
+ *
+ */
+
+#define DEVICE_CACHE_BITS 3
+
+struct device_cache_entry {
+	unsigned int seq;
+	const struct block_device *bdev;
+	struct object_data *data;
+	unsigned long gen;
+};
+
+struct device_cache {
+	struct device_cache_entry entries[1 << DEVICE_CACHE_BITS];
+};
+
+static DEFINE_PER_CPU(struct device_cache, device_caches);
+
+void devices_changed(void) {
+	atomic_long_inc(&devices_gen);
+}
+
+// loop devices through their binding, if not stale: the backing
+// file name is copied and hashed once per loop device and generation
+static struct object_data *get_device_data_by_bdev(const struct block_device *bdev, unsigned long gen) {
+	dev_t devt = bdev->bd_dev;
+
+	if(MAJOR(devt) != LOOP_MAJOR) {
+		return __do_get_device_data_always(&devt, true);
+	}
+
+	struct loop_binding *b = 
+		rhashtable_lookup(&loop_bindings_ht, &devt, loop_bindings_ht_params);
+
+	if(b != NULL && b->gen == gen) {
+		return b->lo != NULL ? &b->lo->value : NULL;
+	}
+
+	struct mountinfo minfo;
+	from_block_device_to_mountinfo(&minfo, bdev);
+
+	struct loop_object *lo = 
+		rhashtable_lookup(&loops_ht, minfo.device.lo_fname, loops_ht_params);
+
+	bind_loop_device(devt, lo, gen);
+
+	return lo != NULL ? &lo->value : NULL;
+}
+
+struct object_data *get_device_data_cached(const struct block_device *bdev) {
+	struct device_cache *cache = get_cpu_ptr(&device_caches);
+	struct device_cache_entry *ent = &cache->entries[hash_ptr(bdev, DEVICE_CACHE_BITS)];
+
+	//read before looking up: a change in the meantime makes the entry stale
+	unsigned long gen = atomic_long_read(&devices_gen);
+
+	unsigned int seq = READ_ONCE(ent->seq);
+	barrier();
+
+	bool hit = ent->bdev == bdev && ent->gen == gen;
+	struct object_data *data = ent->data;
+
+	barrier();
+
+	if(likely(hit && READ_ONCE(ent->seq) == seq)) {
+		put_cpu_ptr(&device_caches);
+		return data;
+	}
+
+	data = get_device_data_by_bdev(bdev, gen);
+
+	unsigned long flags;
+	local_irq_save(flags);
+
+	WRITE_ONCE(ent->seq, ent->seq + 1);
+	barrier();
+
+	ent->bdev = bdev;
+	ent->data = data;
+	ent->gen = gen;
+
+	barrier();
+	WRITE_ONCE(ent->seq, ent->seq + 1);
+
+	local_irq_restore(flags);
+
+	put_cpu_ptr(&device_caches);
+	return data;
+}
+
 
 /**
  * 
@@ -616,6 +991,13 @@ int setup_devices(void) {
 		return -EINVAL;
 	}
 
+	if(rhashtable_init(&loop_bindings_ht, &loop_bindings_ht_params) != 0) {
+		rhashtable_free_and_destroy(&loops_ht, loops_ht_free_fn, NULL);
+		rhashtable_free_and_destroy(&blkdevs_ht, blkdevs_ht_free_fn, NULL);
+		up_write(&allow_reging_operation_sem);
+		return -EINVAL;
+	}
+
 	allow_reging_operation = true;
 	up_write(&allow_reging_operation_sem);
 
@@ -626,6 +1008,7 @@ void destroy_devices(void) {
 	down_write(&allow_reging_operation_sem);
 	allow_reging_operation = false;
 
+	rhashtable_free_and_destroy(&loop_bindings_ht, loop_bindings_ht_free_fn, NULL);
 	rhashtable_free_and_destroy(&blkdevs_ht, blkdevs_ht_free_fn, NULL);
 	rhashtable_free_and_destroy(&loops_ht, loops_ht_free_fn, NULL);
 
@@ -1,166 +1,86 @@
-#include <linux/kprobes.h>
-#include <linux/hashtable.h>
-#include <linux/spinlock.h>
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
-#include <linux/xxhash.h>
 
 #include <bdsnap/bdsnap.h>
+#include <hooks.h>
 #include <fs-support/singlefilefs.h>
 #include <pr-err-failure.h>
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,5,0)
-#	define my_task_boottime(tsk) ((tsk)->start_boottime)
-#else
-#	define my_task_boottime(tsk) ((tsk)->real_start_time)
-#endif
-
 #define SINGLEFILEFS_MAGIC 0x42424242
 #define SINGLEFILEFS_BLOCK_SIZE 4096
 
-static DEFINE_HASHTABLE(xkpblocks_ht, 18);
-static DEFINE_SPINLOCK(xkpblocks_ht_lock);
-
-struct xkpblocks_key {
-	u64 tid;
-	u64 tstart;
-};
-
-#define DEFINE_XKPBLOCKS_KEY(_name, _tid, _tstart) \
-	struct xkpblocks_key _name = { \
-		.tid = ((u64) _tid), \
-		.tstart = (_tstart) \
-	}
-
-struct xkpblocks_node {
-	struct xkpblocks_key key;
-
-	char block[SINGLEFILEFS_BLOCK_SIZE];
+// state of one singlefilefs write, shared by the probes hit by the writer
+// thread in the meantime. It is the data area of the vfs_write kretprobe
+// instance (preallocated by kprobes), so it is per-thread by construction:
+// no table, no lock, nothing to clean up if the thread goes away.
+//
+// a write reads a few blocks (superblock, data block, inode block), and
+// dirties some of them: each pre-image is copied once per write, at its
+// first bread, into the page of a slot, which is then handed over as it
+// is to bdsnap (no second copy) by write_dirty_buffer. Slots of blocks
+// never dirtied are reused, pages included, by the following reads.
+// Blocks already captured during the epoch are not copied at all
+#define XKPBLOCKS_MAX_BLOCKS 4
+
+struct xkpblocks_slot {
+	//NULL until first used, and once handed over
+	struct page *page;
 	u64 blocknum;
-
-	struct hlist_node node;
-	struct rcu_head rcu;
+	bool has_preimage;
 };
 
-static __always_inline u64 keyhashit(struct xkpblocks_key *key) {
-	return xxh64(key, sizeof(struct xkpblocks_key), 0x123456789a9b9c9d);
-}
-
-static void xkpblocks_rcu_free_fn(struct rcu_head *rcu) {
-	struct xkpblocks_node *n = container_of(rcu, struct xkpblocks_node, rcu);
-	free_pages_exact(n, sizeof(struct xkpblocks_node));
-}
-
-static inline struct xkpblocks_node* search_threadentry(pid_t tid, u64 tstart) {
-	DEFINE_XKPBLOCKS_KEY(key, tid, tstart);
-
-	struct xkpblocks_node *found = NULL;
-	struct xkpblocks_node *cur;
+struct xkpblocks_ctx {
+	struct xkpblocks_slot slots[XKPBLOCKS_MAX_BLOCKS];
+	//next slot to reuse, once they are all taken
+	unsigned int victim;
+};
 
-	hash_for_each_possible_rcu(xkpblocks_ht, cur, node, keyhashit(&key)) {
-		if(cur->key.tid == key.tid && cur->key.tstart == key.tstart) {
-			found = cur;
-			break;
+static struct xkpblocks_slot* find_preimage_slot(struct xkpblocks_ctx *ctx, u64 blocknum) {
+	for(unsigned int i = 0; i < XKPBLOCKS_MAX_BLOCKS; i++) {
+		struct xkpblocks_slot *slot = &ctx->slots[i];
+		if(slot->has_preimage && slot->blocknum == blocknum) {
+			return slot;
 		}
 	}
 
-	return found;
-}
-
-static inline void remove_threadentry(struct xkpblocks_node *thrent) {
-	unsigned long cpu_flags;
-	spin_lock_irqsave(&xkpblocks_ht_lock, cpu_flags);
-	hash_del_rcu(&thrent->node);
-	spin_unlock_irqrestore(&xkpblocks_ht_lock, cpu_flags);
-
-	call_rcu(&thrent->rcu, xkpblocks_rcu_free_fn);
-}
-
-static void cleanup_xkpblocks_ht(void) {
-	size_t bktnr;
-	struct xkpblocks_node *cur;
-	struct hlist_node *tmp;
-
-	spin_lock(&xkpblocks_ht_lock);
-
-	hash_for_each_safe(xkpblocks_ht, bktnr, tmp, cur, node) {
-		hash_del_rcu(&cur->node);
-		call_rcu(&cur->rcu, xkpblocks_rcu_free_fn);
-	}
-
-	spin_unlock(&xkpblocks_ht_lock);
+	return NULL;
 }
 
-static bool __do_taskcheck_on(u64 key_tid, u64 key_tstart) {
-	bool res = false;
-
-	struct task_struct *p;
+// a free slot, preferably with a page already, or else the
+// pre-image of a block read earlier during the write is discarded
+static struct xkpblocks_slot* get_free_slot(struct xkpblocks_ctx *ctx) {
+	struct xkpblocks_slot *free_slot = NULL;
 
-	rcu_read_lock();
+	for(unsigned int i = 0; i < XKPBLOCKS_MAX_BLOCKS; i++) {
+		struct xkpblocks_slot *slot = &ctx->slots[i];
+		if(slot->has_preimage) {
+			continue;
+		}
 
-	struct pid *pid = find_pid_ns(key_tid, &init_pid_ns);
-	p = pid_task(pid, PIDTYPE_PID);
+		if(slot->page != NULL) {
+			return slot;
+		}
 
-	if(p == NULL) {
-		goto ____do_taskcheck_on_finish0;
+		if(free_slot == NULL) {
+			free_slot = slot;
+		}
 	}
 
-	get_task_struct(p);
-	u64 tstart = my_task_boottime(p);
-	int texited = p->exit_state;
-	
-	if(tstart != key_tstart || texited) {
-		goto ____do_taskcheck_on_finish1;
+	if(free_slot == NULL) {
+		free_slot = &ctx->slots[ctx->victim];
+		free_slot->has_preimage = false;
+		ctx->victim = (ctx->victim + 1) % XKPBLOCKS_MAX_BLOCKS;
 	}
 
-	res = true;
-
-____do_taskcheck_on_finish1:
-	put_task_struct(p);
-
-____do_taskcheck_on_finish0:
-	rcu_read_unlock();
-
-	return res;
+	return free_slot;
 }
 
-static struct delayed_work gdwork_taskcheck;
-
-#define schedule_taskcheck_work(_dwork) \
-	do { \
-		if(!schedule_delayed_work((_dwork), msecs_to_jiffies(3600000))) { \
-			pr_err_failure("schedule_delayed_work"); \
-		} \
-	} while(0)
-
-static void periodic_taskcheck_xkpblocks_ht(struct work_struct *work) {
-	static u32 next_bktnr = 0;
-	u32 end = min(next_bktnr + 50, HASH_SIZE(xkpblocks_ht));
-
-	spin_lock(&xkpblocks_ht_lock);
-
-	for (u32 bktnr = next_bktnr; bktnr < end; bktnr++) {
-		struct xkpblocks_node *cur;
-        struct hlist_node *tmp;
+static struct hook hook_vfs_write;
 
-        hlist_for_each_entry_safe(cur, tmp, &xkpblocks_ht[bktnr], node) {
-            if (!__do_taskcheck_on(cur->key.tid, cur->key.tstart)) {
-            	hash_del_rcu(&cur->node);
-            	call_rcu(&cur->rcu, xkpblocks_rcu_free_fn);
-            }
-        }
-    }
-
-    spin_unlock(&xkpblocks_ht_lock);
-
-    if(end < HASH_SIZE(xkpblocks_ht)) {
-    	next_bktnr += end;
-    } else {
-    	next_bktnr = 0;
-    }
-
-    schedule_taskcheck_work(to_delayed_work(work));
+// the context of the singlefilefs write current is in, NULL if none
+static inline struct xkpblocks_ctx* current_write_ctx(void) {
+	return (struct xkpblocks_ctx*) hook_current_data(&hook_vfs_write);
 }
 
 /**
@@ -169,17 +89,17 @@ static void periodic_taskcheck_xkpblocks_ht(struct work_struct *work) {
  *
  */
 
-#define KRP_VFS_WRITE_SYMBOL_NAME "vfs_write"
+#define HOOK_VFS_WRITE_SYMBOL_NAME "vfs_write"
 
 static int vfs_write_entry_handler(
-		__always_unused struct kretprobe_instance *krp_inst, 
-		struct pt_regs* regs) {
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		void *data) {
 
-	struct file *filp = (struct file*) regs->di;
+	struct file *filp = (struct file*) call->args[0];
 	struct address_space *map;
 	struct inode *hostino;
 	struct super_block *sb;
-	struct xkpblocks_node *node;
 
 	if(
 			filp == NULL ||
@@ -188,43 +108,33 @@ static int vfs_write_entry_handler(
 			(sb = hostino->i_sb) == NULL ||
 			sb->s_magic != SINGLEFILEFS_MAGIC ||
 			sb->s_bdev == NULL ||
-			!bdsnap_test_device(sb->s_bdev) || 
-			(node = alloc_pages_exact(sizeof(struct xkpblocks_node), GFP_ATOMIC)) == NULL) {
+			!bdsnap_test_device(sb->s_bdev)) {
 
+		//no instance kept: not a write we care about
 		return 1;
 	}
 
-	INIT_HLIST_NODE(&node->node);
-	node->key.tid = task_pid_nr(current);
-	node->key.tstart = my_task_boottime(current);
+	struct xkpblocks_ctx *ctx = (struct xkpblocks_ctx*) data;
 
-	unsigned long flags;
-	spin_lock_irqsave(&xkpblocks_ht_lock, flags);
-	hash_add_rcu(xkpblocks_ht, &node->node, keyhashit(&node->key));
-	spin_unlock_irqrestore(&xkpblocks_ht_lock, flags);
+	//pages are allocated by the first breads, if any
+	memset(ctx, 0, sizeof(struct xkpblocks_ctx));
 
 	return 0;
 }
 
-static int vfs_write_handler(
-		__always_unused struct kretprobe_instance *krp_inst, 
-		__always_unused struct pt_regs* regs) {
+static void vfs_write_handler(
+		__always_unused struct hook *h, 
+		__always_unused const struct hook_call *call, 
+		void *data) {
 
-	pid_t tid = task_pid_nr(current);
-	u64 tstart = my_task_boottime(current);
+	struct xkpblocks_ctx *ctx = (struct xkpblocks_ctx*) data;
 
-	rcu_read_lock();
-
-	struct xkpblocks_node *cur = search_threadentry(tid, tstart);
-	if(cur == NULL) {
-		rcu_read_unlock();
-		return 0;
+	//read but never dirtied
+	for(unsigned int i = 0; i < XKPBLOCKS_MAX_BLOCKS; i++) {
+		if(ctx->slots[i].page != NULL) {
+			put_page(ctx->slots[i].page);
+		}
 	}
-
-	rcu_read_unlock();
-	remove_threadentry(cur);
-
-	return 0;
 }
 
 /**
@@ -233,31 +143,53 @@ static int vfs_write_handler(
  *
  */
 
-#define KRP_SB_BREAD_SYMBOL_NAME "__bread_gfp"
+#define HOOK_SB_BREAD_SYMBOL_NAME "__bread_gfp"
+
+static void sb_bread_handler(
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		__always_unused void *data) {
 
-static int sb_bread_handler(
-		__always_unused struct kretprobe_instance *krp_inst, 
-		struct pt_regs* regs) {
+	struct xkpblocks_ctx *ctx = current_write_ctx();
+	if(ctx == NULL) {
+		return;
+	}
+
+	struct buffer_head *bh = (struct buffer_head*) call->retval;
+	if(bh == NULL) {
+		return;
+	}
 
-	pid_t tid = task_pid_nr(current);
-	u64 tstart = my_task_boottime(current);
+	//already read during this write: the first copy is the pre-image
+	if(find_preimage_slot(ctx, bh->b_blocknr) != NULL) {
+		return;
+	}
 
+	//hot blocks (e.g. the inode one, rewritten by every append)
+	//are captured once per epoch, no need to copy them again
 	rcu_read_lock();
+	bool needed = bdsnap_block_needs_snapshot(
+			bdsnap_search_device(bh->b_bdev), 
+			bh->b_blocknr);
+	rcu_read_unlock();
 
-	struct xkpblocks_node *threntry = search_threadentry(tid, tstart);
-	if(threntry == NULL) {
-		rcu_read_unlock();
-		return 0;
+	if(!needed) {
+		return;
 	}
 
-	struct buffer_head *bh = (struct buffer_head*) regs_return_value(regs);
+	struct xkpblocks_slot *slot = get_free_slot(ctx);
 
-	memcpy(threntry->block, bh->b_data, bh->b_size);
-	threntry->blocknum = bh->b_blocknr;
-
-	rcu_read_unlock();
+	//first use of the slot, or its page has been handed over already
+	if(slot->page == NULL) {
+		slot->page = alloc_page(GFP_ATOMIC);
+		if(slot->page == NULL) {
+			return;
+		}
+	}
 
-	return 0;
+	memcpy(page_address(slot->page), bh->b_data, bh->b_size);
+	slot->blocknum = bh->b_blocknr;
+	slot->has_preimage = true;
 }
 
 /**
@@ -266,42 +198,48 @@ static int sb_bread_handler(
  *
  */
 
-#define KP_WRITE_DIRTY_BUFFER_SYMBOL_NAME "write_dirty_buffer"
+#define HOOK_WRITE_DIRTY_BUFFER_SYMBOL_NAME "write_dirty_buffer"
 
 static int write_dirty_buffer_pre_handler(
-		__always_unused struct kprobe *kp, 
-		struct pt_regs *regs) {
-
-	pid_t tid = task_pid_nr(current);
-	u64 tstart = my_task_boottime(current);
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		__always_unused void *data) {
 
-	rcu_read_lock();
-
-	struct xkpblocks_node *threntry = search_threadentry(tid, tstart);
-	if(threntry == NULL) {
-		rcu_read_unlock();
+	struct xkpblocks_ctx *ctx = current_write_ctx();
+	if(ctx == NULL) {
 		return 0;
 	}
 
-	struct buffer_head *bh = (struct buffer_head*) regs->di;
+	struct buffer_head *bh = (struct buffer_head*) call->args[0];
 	if(bh->b_bdev == NULL) {
-		rcu_read_unlock();
 		return 0;
 	}
 
 	if(bh->b_size != SINGLEFILEFS_BLOCK_SIZE) {
-		rcu_read_unlock();
-		remove_threadentry(threntry);
 		BUG();
 		return 0; //unreachable code
 	}
 
+	struct xkpblocks_slot *slot = find_preimage_slot(ctx, bh->b_blocknr);
+	if(slot == NULL) {
+		//no pre-image of this block (see sb_bread_handler)
+		return 0;
+	}
+
+	//only this thread touches its own context
+	struct page *block_page = slot->page;
+	slot->page = NULL;
+	slot->has_preimage = false;
+
+	rcu_read_lock();
+
 	void* handle = bdsnap_search_device(
 			bh->b_bdev);
 
-	bdsnap_make_snapshot(
+	bdsnap_make_snapshot_page(
 			handle, 
-			threntry->block, 
+			block_page,
+			0,
 			bh->b_blocknr, 
 			SINGLEFILEFS_BLOCK_SIZE);
 
@@ -312,95 +250,67 @@ static int write_dirty_buffer_pre_handler(
 
 /**
  *
- * kretprobes
- *
- */
-
-static struct kretprobe krp_vfs_write = {
-	.kp.symbol_name = KRP_VFS_WRITE_SYMBOL_NAME,
-	.entry_handler = vfs_write_entry_handler,
-	.handler = vfs_write_handler,
-	.maxactive = -1
-};
-
-static struct kretprobe krp_sb_bread = {
-	.kp.symbol_name = KRP_SB_BREAD_SYMBOL_NAME,
-	.handler = sb_bread_handler,
-	.maxactive = -1
-};
-
-/**
+ * hooks
  *
- * kprobes
+ * vfs_write owns the context: it must be looked up by the other
+ * hooks, hence it is always a kretprobe (see hooks.h). The other
+ * ones follow the hook_backend module parameter
  *
  */
 
-static struct kprobe kp_write_dirty_buffer = {
-	.symbol_name = KP_WRITE_DIRTY_BUFFER_SYMBOL_NAME,
-	.pre_handler = write_dirty_buffer_pre_handler
+static struct hook hook_vfs_write = {
+	.symbol = HOOK_VFS_WRITE_SYMBOL_NAME,
+	.entry = vfs_write_entry_handler,
+	.exit = vfs_write_handler,
+	.data_size = sizeof(struct xkpblocks_ctx),
+	.current_data = true
 };
 
-/**
- *
- * which kretprobes to register
- *
- */
-
-static struct kretprobe *krps_to_register[] = {
-	&krp_vfs_write,
-	&krp_sb_bread
+static struct hook hook_sb_bread = {
+	.symbol = HOOK_SB_BREAD_SYMBOL_NAME,
+	.exit = sb_bread_handler
 };
 
-static const size_t num_krps_to_register = 
-	sizeof(krps_to_register) / sizeof(struct kretprobe*);
-
-
-/**
- *
- * which kprobes to register
- *
- */
+static struct hook hook_write_dirty_buffer = {
+	.symbol = HOOK_WRITE_DIRTY_BUFFER_SYMBOL_NAME,
+	.entry = write_dirty_buffer_pre_handler
+};
 
-static struct kprobe *kps_to_register[] = {
-	&kp_write_dirty_buffer
+static struct hook *hooks_to_register[] = {
+	&hook_vfs_write,
+	&hook_sb_bread,
+	&hook_write_dirty_buffer
 };
 
-static const size_t num_kps_to_register = 
-	sizeof(kps_to_register) / sizeof(struct kprobe*);
+static const size_t num_hooks_to_register = 
+	sizeof(hooks_to_register) / sizeof(struct hook*);
 
 /**
  *
  * register/unregister fs-specific support
  *
+ * hooks are registered disarmed, they are armed only
+ * while there is some device to snapshot (see devices.c)
+ *
  */
 
 int register_fssupport_singlefilefs(void) {
-	int krp_res = register_kretprobes(krps_to_register, num_krps_to_register);
-	if(krp_res != 0) {
-		pr_err_failure_with_code("register_kretprobes", krp_res);
-		return krp_res;
-	}
-
-	int kp_res = register_kprobes(kps_to_register, num_kps_to_register);
-	if(kp_res != 0) {
-		pr_err_failure_with_code("register_kprobes", kp_res);
-		unregister_kretprobes(krps_to_register, num_krps_to_register);
-		return kp_res;
+	int err = register_hooks(hooks_to_register, num_hooks_to_register);
+	if(err != 0) {
+		pr_err_failure_with_code("register_hooks", err);
 	}
 
-	INIT_DELAYED_WORK(&gdwork_taskcheck, periodic_taskcheck_xkpblocks_ht);
-	schedule_taskcheck_work(&gdwork_taskcheck);
-
-	return 0;
+	return err;
 }
 
 void unregister_fssupport_singlefilefs(void) {
-	unregister_kretprobes(krps_to_register, num_krps_to_register);
-	unregister_kprobes(kps_to_register, num_kps_to_register);
+	unregister_hooks(hooks_to_register, num_hooks_to_register);
+}
 
-	if(!cancel_delayed_work_sync(&gdwork_taskcheck)) {
-		pr_err_failure("cancel_delayed_work_sync");
-	}
+void disarm_fssupport_singlefilefs(void) {
+	disarm_hooks(hooks_to_register, num_hooks_to_register);
+}
 
-	cleanup_xkpblocks_ht();
+int arm_fssupport_singlefilefs(void) {
+	return arm_hooks(hooks_to_register, num_hooks_to_register);
 }
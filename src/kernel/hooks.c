@@ -0,0 +1,353 @@
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kprobes.h>
+#include <linux/ptrace.h>
+#include <linux/string.h>
+#include <linux/wait_bit.h>
+
+#ifdef CONFIG_KRETPROBE_ON_RETHOOK
+#include <linux/rethook.h>
+#endif
+
+#include <hooks.h>
+#include <pr-err-failure.h>
+
+static char *hook_backend = "kprobe";
+module_param(hook_backend, charp, 0444);
+MODULE_PARM_DESC(hook_backend, "kprobe (default) or fprobe");
+
+static enum hook_backend selected_backend(void) {
+	if(strcmp(hook_backend, "fprobe") == 0) {
+#ifdef HOOKS_HAVE_FPROBE
+		return HOOK_BACKEND_FPROBE;
+#else
+		pr_warn("%s: fprobe not available, falling back to kprobe\n",
+				module_name(THIS_MODULE));
+#endif
+	} else if(strcmp(hook_backend, "kprobe") != 0) {
+		pr_warn("%s: unknown hook_backend \"%s\", falling back to kprobe\n",
+				module_name(THIS_MODULE), hook_backend);
+	}
+
+	return HOOK_BACKEND_KPROBE;
+}
+
+/**
+ *
+ * kprobe backend
+ *
+ * a plain kprobe when there is nothing to do at exit,
+ * a kretprobe otherwise
+ *
+ */
+
+static inline bool hook_needs_kretprobe(const struct hook *h) {
+	return h->exit != NULL || h->data_size > 0 || h->current_data;
+}
+
+static void hook_call_from_regs(struct hook_call *call, struct pt_regs *regs) {
+	for(unsigned int i = 0; i < HOOK_MAX_ARGS; i++) {
+		call->args[i] = regs_get_kernel_argument(regs, i);
+	}
+
+	call->retval = 0;
+}
+
+static int hook_kp_pre_handler(struct kprobe *kp, struct pt_regs *regs) {
+	struct hook *h = container_of(kp, struct hook, kp);
+	struct hook_call call;
+
+	if(h->entry != NULL) {
+		hook_call_from_regs(&call, regs);
+		h->entry(h, &call, NULL);
+	}
+
+	return 0;
+}
+
+// calls kept by the entry are counted until their exit, see unregister_hooks
+static int hook_krp_entry_handler(struct kretprobe_instance *ri, struct pt_regs *regs) {
+	struct hook *h = container_of(get_kretprobe(ri), struct hook, krp);
+	struct hook_call call;
+
+	hook_call_from_regs(&call, regs);
+
+	int rv = h->entry(h, &call, ri->data);
+	if(rv == 0 && h->exit != NULL) {
+		atomic_inc(&h->nr_pending);
+	}
+
+	return rv;
+}
+
+static int hook_krp_handler(struct kretprobe_instance *ri, struct pt_regs *regs) {
+	struct hook *h = container_of(get_kretprobe(ri), struct hook, krp);
+	struct hook_call call = { .retval = regs_return_value(regs) };
+
+	h->exit(h, &call, ri->data);
+
+	if(h->entry != NULL && atomic_dec_and_test(&h->nr_pending)) {
+		wake_up_var(&h->nr_pending);
+	}
+
+	return 0;
+}
+
+static int register_hook_kprobe(struct hook *h) {
+	int err;
+
+	if(!hook_needs_kretprobe(h)) {
+		memset(&h->kp, 0, sizeof(h->kp));
+		h->kp.symbol_name = h->symbol;
+		h->kp.pre_handler = hook_kp_pre_handler;
+		h->kp.flags = KPROBE_FLAG_DISABLED;
+
+		if((err = register_kprobe(&h->kp)) != 0) {
+			pr_err_failure_with_code("register_kprobe", err);
+		}
+
+		return err;
+	}
+
+	memset(&h->krp, 0, sizeof(h->krp));
+	h->krp.kp.symbol_name = h->symbol;
+	h->krp.kp.flags = KPROBE_FLAG_DISABLED;
+	h->krp.entry_handler = h->entry != NULL ? hook_krp_entry_handler : NULL;
+	h->krp.handler = h->exit != NULL ? hook_krp_handler : NULL;
+	h->krp.data_size = h->data_size;
+	h->krp.maxactive = -1;
+
+	if((err = register_kretprobe(&h->krp)) != 0) {
+		pr_err_failure_with_code("register_kretprobe", err);
+	}
+
+	return err;
+}
+
+/**
+ *
+ * fprobe backend
+ *
+ * ftrace based: no breakpoint, no single stepping, the exit is
+ * caught through the function graph return hook. Handlers are used
+ * as of 6.5 (see hooks.h) and got an ftrace_regs instead of a pt_regs since 6.14
+ *
+ */
+
+#ifdef HOOKS_HAVE_FPROBE
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+#	define HOOK_FPROBE_REGS struct ftrace_regs
+#	define hook_fprobe_arg(regs, n) ftrace_regs_get_argument(regs, n)
+#	define hook_fprobe_retval(regs) ftrace_regs_get_return_value(regs)
+#else
+#	define HOOK_FPROBE_REGS struct pt_regs
+#	define hook_fprobe_arg(regs, n) regs_get_kernel_argument(regs, n)
+#	define hook_fprobe_retval(regs) regs_return_value(regs)
+#endif
+
+static int hook_fp_entry_handler(
+		struct fprobe *fp,
+		__always_unused unsigned long entry_ip,
+		__always_unused unsigned long ret_ip,
+		HOOK_FPROBE_REGS *regs,
+		void *data) {
+
+	struct hook *h = container_of(fp, struct hook, fp);
+	struct hook_call call = { .retval = 0 };
+
+	if(h->entry == NULL) {
+		return 0;
+	}
+
+	for(unsigned int i = 0; i < HOOK_MAX_ARGS; i++) {
+		call.args[i] = hook_fprobe_arg(regs, i);
+	}
+
+	//non zero: no exit handler for this call
+	return h->entry(h, &call, data);
+}
+
+static void hook_fp_exit_handler(
+		struct fprobe *fp,
+		__always_unused unsigned long entry_ip,
+		__always_unused unsigned long ret_ip,
+		HOOK_FPROBE_REGS *regs,
+		void *data) {
+
+	struct hook *h = container_of(fp, struct hook, fp);
+	struct hook_call call = { .retval = hook_fprobe_retval(regs) };
+
+	h->exit(h, &call, data);
+}
+
+static int register_hook_fprobe(struct hook *h) {
+	memset(&h->fp, 0, sizeof(h->fp));
+	h->fp.entry_handler = hook_fp_entry_handler;
+	h->fp.exit_handler = h->exit != NULL ? hook_fp_exit_handler : NULL;
+	h->fp.entry_data_size = h->data_size;
+	h->fp.flags = FPROBE_FL_DISABLED;
+
+	int err = register_fprobe(&h->fp, h->symbol, NULL);
+	if(err != 0) {
+		pr_err_failure_with_code("register_fprobe", err);
+	}
+
+	return err;
+}
+
+#endif
+
+/**
+ *
+ * whatever the backend
+ *
+ */
+
+static int register_hook(struct hook *h, enum hook_backend backend) {
+	//kretprobe instances are the only per-call data we can look up
+	h->backend = h->current_data ? HOOK_BACKEND_KPROBE : backend;
+	atomic_set(&h->nr_pending, 0);
+
+#ifdef HOOKS_HAVE_FPROBE
+	if(h->backend == HOOK_BACKEND_FPROBE) {
+		return register_hook_fprobe(h);
+	}
+#endif
+
+	return register_hook_kprobe(h);
+}
+
+static void unregister_hook(struct hook *h) {
+#ifdef HOOKS_HAVE_FPROBE
+	if(h->backend == HOOK_BACKEND_FPROBE) {
+		unregister_fprobe(&h->fp);
+		return;
+	}
+#endif
+
+	if(hook_needs_kretprobe(h)) {
+		unregister_kretprobe(&h->krp);
+	} else {
+		unregister_kprobe(&h->kp);
+	}
+}
+
+static int arm_hook(struct hook *h) {
+	int err;
+
+#ifdef HOOKS_HAVE_FPROBE
+	if(h->backend == HOOK_BACKEND_FPROBE) {
+		enable_fprobe(&h->fp);
+		return 0;
+	}
+#endif
+
+	if(hook_needs_kretprobe(h)) {
+		if((err = enable_kretprobe(&h->krp)) != 0) {
+			pr_err_failure_with_code("enable_kretprobe", err);
+		}
+	} else if((err = enable_kprobe(&h->kp)) != 0) {
+		pr_err_failure_with_code("enable_kprobe", err);
+	}
+
+	return err;
+}
+
+static void disarm_hook(struct hook *h) {
+#ifdef HOOKS_HAVE_FPROBE
+	if(h->backend == HOOK_BACKEND_FPROBE) {
+		disable_fprobe(&h->fp);
+		return;
+	}
+#endif
+
+	if(hook_needs_kretprobe(h)) {
+		disable_kretprobe(&h->krp);
+	} else {
+		disable_kprobe(&h->kp);
+	}
+}
+
+int register_hooks(struct hook **hooks, size_t n) {
+	enum hook_backend backend = selected_backend();
+
+	for(size_t i = 0; i < n; i++) {
+		int err = register_hook(hooks[i], backend);
+		if(err != 0) {
+			unregister_hooks(hooks, i);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+// process context, may sleep: the exits of the calls still pending
+// once unregistered would never run, and their data (and whatever it
+// holds, e.g. pages) would be lost. Disarmed kretprobes still run the
+// exits of calls already in, so they are waited for. Disarmed fprobes
+// skip them: there is nothing to wait for, fprobes must not hold data
+// needing an exit (hooks with current_data are never fprobes)
+void unregister_hooks(struct hook **hooks, size_t n) {
+	disarm_hooks(hooks, n);
+
+	for(size_t i = 0; i < n; i++) {
+		struct hook *h = hooks[i];
+
+		if(h->backend == HOOK_BACKEND_KPROBE) {
+			wait_var_event(&h->nr_pending, atomic_read(&h->nr_pending) == 0);
+		}
+	}
+
+	for(size_t i = 0; i < n; i++) {
+		unregister_hook(hooks[i]);
+	}
+}
+
+void disarm_hooks(struct hook **hooks, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		disarm_hook(hooks[i]);
+	}
+}
+
+int arm_hooks(struct hook **hooks, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		int err = arm_hook(hooks[i]);
+		if(err != 0) {
+			//disarming a disarmed hook is fine
+			disarm_hooks(hooks, n);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+void* hook_current_data(const struct hook *h) {
+	struct llist_node *node;
+
+#ifdef CONFIG_KRETPROBE_ON_RETHOOK
+
+	llist_for_each(node, current->rethooks.first) {
+		struct rethook_node *rhn = container_of(node, struct rethook_node, llist);
+
+		if(rhn->rethook->data == &h->krp) {
+			return container_of(rhn, struct kretprobe_instance, node)->data;
+		}
+	}
+
+#else
+
+	llist_for_each(node, current->kretprobe_instances.first) {
+		struct kretprobe_instance *ri = container_of(node, struct kretprobe_instance, llist);
+
+		if(get_kretprobe(ri) == &h->krp) {
+			return ri->data;
+		}
+	}
+
+#endif
+
+	return NULL;
+}
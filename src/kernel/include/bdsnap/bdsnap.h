@@ -11,6 +11,8 @@
 #error it's time to upgrade, don't you think? (unknown struct block_device)
 #endif
 
+struct page;
+
 /**
  * exported to the fs snapshot implementor, 
  * all meant to be run in interrupt context
@@ -40,7 +42,8 @@ void* bdsnap_search_device(
  * @blocknr: the block number
  * @blocksize: the size of the block
  *
- * Returns true if we could schedule the deferred work, false otherwise.
+ * Returns true if we could schedule the deferred work, or if the block
+ * has already been captured during the epoch, false otherwise.
  * This can happen because in between bdsnap_search_device and bdsnap_make_snapshot
  * the user may have requested a deactivation for the bdev you searched for
  * (the deferred work wq is in draining and will be destroyed).
@@ -53,6 +56,40 @@ bool bdsnap_make_snapshot(
 		void* handle, const char* block, 
 		sector_t blocknr, u64 blocksize);
 
+/**
+ * bdsnap_make_snapshot_page - same as bdsnap_make_snapshot, without copying the block
+ * @handle: the valid handle retrieved via bdsnap_search_device
+ * @page: the (lowmem) page, or head page of a folio, the block is in
+ * @offset: where the block starts within page
+ * @blocknr: the block number
+ * @blocksize: the size of the block, offset + blocksize must fit in page
+ *
+ * The caller reference to page is handed over in any case: it is put
+ * once the block is written out, or right away if false is returned.
+ * The content of the block must not change after this call.
+ *
+ * IMPORTANT NOTE: same RCU rules as bdsnap_make_snapshot
+ */
+bool bdsnap_make_snapshot_page(
+		void* handle, struct page *page, unsigned int offset,
+		sector_t blocknr, u64 blocksize);
+
+/**
+ * bdsnap_block_needs_snapshot - tell blocks already covered, before copying them
+ * @handle: the valid handle retrieved via bdsnap_search_device
+ * @blocknr: the block number
+ *
+ * Returns false if the block has already been captured during the current
+ * epoch (or its capture is in flight), or if there is no epoch at all: there
+ * is no need to keep its content. True otherwise, also when it can't tell.
+ * Lock-free, cheap enough to be asked before every block copy. The answer
+ * is only a hint, bdsnap_make_snapshot drops covered blocks by itself.
+ *
+ * IMPORTANT NOTE: same RCU rules as bdsnap_make_snapshot
+ */
+bool bdsnap_block_needs_snapshot(
+		void* handle, sector_t blocknr);
+
 /**
  * bdsnap_test_device - speculatively lookup a registered device
  * @bdev: the block device to search for
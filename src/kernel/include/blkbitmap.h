@@ -0,0 +1,15 @@
+#ifndef BLKBITMAP_H
+#define BLKBITMAP_H
+
+#include <linux/types.h>
+#include <linux/atomic.h>
+
+struct blkbitmap; //opaque ptr
+
+//mem, if not NULL, follows the bytes held by the bitmap
+struct blkbitmap* blkbitmap_alloc_and_init(atomic_long_t *mem);
+bool blkbitmap_test(struct blkbitmap *bm, sector_t blknr);
+bool blkbitmap_set(struct blkbitmap *bm, sector_t blknr);
+void blkbitmap_cleanup_and_destroy(struct blkbitmap *bm);
+
+#endif
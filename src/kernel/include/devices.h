@@ -2,44 +2,119 @@
 #define DEVICES_H
 
 #include <linux/spinlock.h>
-#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/path.h>
+#include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/llist.h>
+#include <linux/atomic.h>
+#include <linux/kref.h>
 
 #include <mounts.h>
-#include <lru-ng.h>
+#include <blkbitmap.h>
+#include <snapblocks-index.h>
+#include <snapshot.h>
+#include <lanes.h>
+#include <names.h>
 
 #define MNT_FMT_DATE_LEN sizeof("-9999-12-31_23:59:59")
 
+#define EPOCH_SHARD_NAME_LEN sizeof("snapblocks.999.idx")
+
+struct epoch;
+
+// the blocks of an epoch are hashed (by block number) onto its shards,
+// each one appends to its own snapblocks segment on its own lane, so
+// shards of a device are written out in parallel. Everything here is
+// used by the shard lane only: no locking
+struct epoch_shard {
+	struct epoch *e;
+	struct lane *lane;
+	//not the device lane: destroyed with the epoch
+	bool own_lane;
+	char snapblocks_name[EPOCH_SHARD_NAME_LEN];
+	char snapidx_name[EPOCH_SHARD_NAME_LEN];
+
+	struct blkbitmap *captured_blocks;
+	struct snapshot_compressor *compressor;
+	struct snapshot_dedup *dedup;
+	struct snapshot_encryptor *encryptor;
+
+	//kept open for the whole epoch, revalidated before each batch
+	struct file *snapblocks_filp;
+	struct file *snapblocks_dio_filp;
+	struct snapidx *snapblocks_idx;
+
+	//captured blocks waiting to be written out in batch
+	struct llist_head pending_captures;
+	atomic_t nr_pending_captures;
+	struct lane_delayed_work pending_captures_work;
+};
+
+// refcounted: the device (while the epoch is the current one) holds
+// a reference, and so does every capture not written out yet.
+// The last put queues the cleanup on the device lane, memory is
+// freed after a grace period, so that it can be looked up under RCU
 struct epoch {
+	struct kref refs;
+	bool ended;
 	int n_currently_mounted;
 	char first_mount_date[MNT_FMT_DATE_LEN + 1];
+	//refused captures (memory budget, allocations) and dropped
+	//batches, the count the snapdir tells so far, see snapshot.c
+	atomic_t nr_lost_captures;
+	int nr_lost_marked;
+	const struct name *original_dev_name;
+	struct lane *lane;
+	//a reference to the options of the device
+	const struct snapshot_options *opts;
+
+	//shared by the shards
+	struct mutex shared_lock;
 	struct path *path_snapdir;
-	struct lru_ng *cached_blocks;
+	//what the capture side can tell as covered, see snapshot.c
+	struct snapshot_claims __rcu *claims;
+
+	//queued on the device lane once the last reference is gone
+	struct lane_work cleanup_work;
+	struct rcu_head rcu;
+
+	unsigned int nr_shards;
+	struct epoch_shard shards[];
 };
 
-static inline void destroy_an_epoch(struct epoch* epoch) {
-	if(epoch != NULL) {
-		if(epoch->path_snapdir != NULL) {
-			path_put(epoch->path_snapdir);
-		}
+//all in snapshot.c
+void epoch_pending_captures_work(struct lane_work *work);
+void drain_epoch_pending_captures(struct epoch_shard *shard);
+//every shard, from now on: the epoch ended
+void expedite_epoch_pending_captures(struct epoch *epoch);
+//process context only, captures of every shard are written out
+void flush_epoch_pending_captures(struct epoch *epoch);
+//process context only, on the device lane: the snapdir tells the losses
+void mark_epoch_losses(struct epoch *epoch);
 
-		if(epoch->cached_blocks != NULL) {
-			lru_ng_cleanup_and_destroy(epoch->cached_blocks);
-		}
+struct object_data;
 
-		kfree(epoch);
-	}
-}
+//all in mounts.c, get and put are atomic context safe
+struct epoch* alloc_an_epoch(const struct object_data *data, gfp_t gfp);
+bool get_an_epoch(struct epoch *epoch);
+void put_an_epoch(struct epoch *epoch);
 
-// - the wq_destroy_lock can be held by the thread which execution path falls in
-//   either the first or the second point (see above) or by the fs-implementor kprobe,
-//   where the lock is taken prior the queue_work.
+// one per registered device, tens of thousands of them may be: kept
+// compact, the name is interned and the options (key included) are
+// shared by the devices of an activation. The capture path reads e and
+// wq_is_destroyed locklessly, the rest is used under general_lock
+// (mounts, umounts and cleanup only): 40 bytes on 64 bits (without
+// spinlock debugging), within a single cache line
 struct object_data {
-	bool wq_is_destroyed ____cacheline_aligned;
-	spinlock_t general_lock ____cacheline_aligned;
-	rwlock_t wq_destroy_lock ____cacheline_aligned;
-	struct workqueue_struct *wq ____cacheline_aligned;
 	struct epoch *e;
-	char original_dev_name[PATH_MAX];
+	//ordered deferred work of the device (batches, epoch cleanups)
+	struct lane *lane;
+	const struct name *original_dev_name;
+	//a reference, see snapshot_options_share
+	const struct snapshot_options *opts;
+	spinlock_t general_lock;
+	bool wq_is_destroyed;
 };
 
 /**
@@ -47,14 +122,38 @@ struct object_data {
  */
 int setup_devices(void);
 void destroy_devices(void);
-int register_device(const char*);
+//the options are shared ones (see snapshot_options_share), the device takes a reference
+int register_device(const char*, const struct snapshot_options*);
 int unregister_device(const char*);
 
+// a device path resolved in the context (root, cwd, mount namespace)
+// of the caller, so that it can be (un)registered from another one,
+// e.g. a work: the inode is grabbed, full_path is the full path of
+// the image (of the backing file for loop devices), NULL for block devices
+struct device_ref {
+	struct inode *ino;
+	char *full_path;
+};
+
+int resolve_device(const char*, struct device_ref*);
+void put_device_ref(struct device_ref*);
+int register_device_ref(const struct device_ref*, const char*, const struct snapshot_options*);
+int unregister_device_ref(const struct device_ref*);
+
 // --> !!wrap with rcu_read_lock/rcu_read_unlock!!
 //"always" does not consider 
 //device mounting status, only if it is recorded or not
 //internal usage, fs snap implementor should not use this
 struct object_data *get_device_data_always(const struct mountinfo*);
 
+// --> !!wrap with rcu_read_lock/rcu_read_unlock!!
+//same as get_device_data_always, through a per-CPU cache,
+//atomic context safe
+struct object_data *get_device_data_cached(const struct block_device *bdev);
+
+//whatever a block_device maps to may have changed
+//(registrations, mounts), atomic context safe
+void devices_changed(void);
+
 
 #endif
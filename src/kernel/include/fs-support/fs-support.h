@@ -5,17 +5,22 @@
 
 #include <fs-support/singlefilefs.h>
 
+// probes are registered disarmed, arm and disarm do not register anything
 struct fssupport_struct {
 	const char* name;
 	int (*regi)(void);
 	void (*unregi)(void);
+	int (*arm)(void);
+	void (*disarm)(void);
 };
 
 static struct fssupport_struct supported_fs[] = {
 	{ 
 		"singlefilefs", 
 		register_fssupport_singlefilefs, 
-		unregister_fssupport_singlefilefs 
+		unregister_fssupport_singlefilefs,
+		arm_fssupport_singlefilefs,
+		disarm_fssupport_singlefilefs
 	}
 };
 
@@ -46,4 +51,28 @@ static void destroy_fssupport(void) {
 	}
 }
 
+static void disarm_fssupport(void) {
+	for(size_t i = 0; i < num_supp_fs; i++) {
+		supported_fs[i].disarm();
+	}
+}
+
+static int arm_fssupport(void) {
+	for(size_t i = 0; i < num_supp_fs; i++) {
+		int err = supported_fs[i].arm();
+		if(err != 0) {
+			pr_err("%s: unable to arm probes of filesystem named \"%s\" (idx = %ld).\n"
+					"Its armfn failed with code: %d\n", 
+					module_name(THIS_MODULE), supported_fs[i].name, i, err);
+			for(size_t j = 0; j < i; j++) {
+				supported_fs[j].disarm();
+			}
+
+			return err;
+		}
+	}
+
+	return 0;
+}
+
 #endif
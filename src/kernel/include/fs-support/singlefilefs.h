@@ -3,5 +3,7 @@
 
 int register_fssupport_singlefilefs(void);
 void unregister_fssupport_singlefilefs(void);
+int arm_fssupport_singlefilefs(void);
+void disarm_fssupport_singlefilefs(void);
 
 #endif
@@ -0,0 +1,75 @@
+#ifndef HOOKS_H
+#define HOOKS_H
+
+#include <linux/version.h>
+#include <linux/atomic.h>
+#include <linux/kprobes.h>
+
+// handlers with per-call data, an int returning entry (to skip the
+// exit) and the return address are there since 6.5: fprobes of older
+// kernels (5.18+) are not used
+#if IS_ENABLED(CONFIG_FPROBE) && LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+#include <linux/fprobe.h>
+#	define HOOKS_HAVE_FPROBE
+#endif
+
+// entry and exit hooks on kernel functions, whatever the backend:
+//  * kprobe: a kprobe (entry only) or a kretprobe, works everywhere
+//  * fprobe: ftrace based entry/exit hooks, cheaper per hit
+// the backend is chosen at load time (hook_backend module parameter),
+// kprobe is used whenever fprobe is not available
+
+#define HOOK_MAX_ARGS 4
+
+// what handlers see of the hooked call:
+// arguments at entry, return value at exit
+struct hook_call {
+	unsigned long args[HOOK_MAX_ARGS];
+	unsigned long retval;
+};
+
+enum hook_backend {
+	HOOK_BACKEND_KPROBE,
+	HOOK_BACKEND_FPROBE
+};
+
+struct hook {
+	const char *symbol;
+
+	// both optional, entry returns 0 to keep the call (exit is run,
+	// data is kept meanwhile), anything else to forget about it
+	int (*entry)(struct hook *h, const struct hook_call *call, void *data);
+	void (*exit)(struct hook *h, const struct hook_call *call, void *data);
+
+	// per call, from entry to exit
+	size_t data_size;
+
+	// data of the pending calls of current can be looked up (see
+	// hook_current_data): always registered as a kretprobe
+	bool current_data;
+
+	// private
+	enum hook_backend backend;
+	atomic_t nr_pending;
+	union {
+		struct kprobe kp;
+		struct kretprobe krp;
+#ifdef HOOKS_HAVE_FPROBE
+		struct fprobe fp;
+#endif
+	};
+};
+
+// hooks are registered disarmed, process context only. Unregistering
+// waits for the kept calls still in to reach their exit (kprobe backend)
+int register_hooks(struct hook **hooks, size_t n);
+void unregister_hooks(struct hook **hooks, size_t n);
+int arm_hooks(struct hook **hooks, size_t n);
+void disarm_hooks(struct hook **hooks, size_t n);
+
+// data of the innermost pending call of h (a current_data hook) made
+// by current, NULL if none. The pending calls of a task are on a list
+// only that task touches: no lock, no hashing, just a short walk
+void* hook_current_data(const struct hook *h);
+
+#endif
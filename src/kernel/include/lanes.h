@@ -0,0 +1,56 @@
+#ifndef LANES_H
+#define LANES_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/timer.h>
+
+// ordering lanes: serialized queues of works run by a module-wide pool
+// of workers (sized to the CPUs), what an ordered workqueue per device
+// used to be. Works of a lane run one at a time, in queuing order, busy
+// lanes take turns on the pool one work at a time. An idle lane is just
+// its (small) struct, no worker, no rescuer
+
+struct lane; //opaque ptr
+
+struct lane_work {
+	struct list_head entry;
+	void (*func)(struct lane_work *work);
+	struct lane *lane;
+};
+
+struct lane_delayed_work {
+	struct lane_work work;
+	struct timer_list timer;
+};
+
+void init_lane_work(struct lane_work *work, void (*func)(struct lane_work*));
+void init_lane_delayed_work(struct lane_delayed_work *dwork, void (*func)(struct lane_work*));
+
+static inline struct lane_delayed_work *to_lane_delayed_work(struct lane_work *work) {
+	return container_of(work, struct lane_delayed_work, work);
+}
+
+// process context only
+int setup_lanes(void);
+void destroy_lanes(void);
+
+struct lane *lane_alloc(gfp_t gfp);
+// waits for every work (and every work they queue) to be done: nothing
+// must be queued from elsewhere meanwhile, process context only
+void lane_destroy(struct lane *lane);
+
+// same semantics as their workqueue counterparts, a work is bound to
+// the lane it is first queued on. Atomic context safe
+bool lane_queue_work(struct lane *lane, struct lane_work *work);
+bool lane_queue_delayed_work(struct lane *lane, struct lane_delayed_work *dwork, unsigned long delay);
+void lane_mod_delayed_work(struct lane *lane, struct lane_delayed_work *dwork, unsigned long delay);
+
+// process context only, may be called from a work of the same lane
+// (it is not running then, lanes are serialized) but not by the work itself
+bool lane_cancel_delayed_work_sync(struct lane_delayed_work *dwork);
+void lane_flush_delayed_work(struct lane_delayed_work *dwork);
+// until the lane is idle
+void lane_flush(struct lane *lane);
+
+#endif
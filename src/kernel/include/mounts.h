@@ -35,4 +35,8 @@ static inline void from_block_device_to_mountinfo(
 int setup_mounts(void);
 void destroy_mounts(void);
 
+// process context only, see arm_probes
+int arm_mounts(void);
+void disarm_mounts(void);
+
 #endif
@@ -0,0 +1,36 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <linux/types.h>
+#include <linux/rhashtable-types.h>
+#include <linux/refcount.h>
+#include <linux/rcupdate.h>
+
+// interned device names: registered images, original device names and
+// epochs share a single refcounted copy of each name, just as long as
+// the name, rather than a PATH_MAX buffer each
+struct name {
+	struct rhash_head linkage;
+	struct rcu_head rcu;
+	refcount_t refs;
+	u32 len;
+	char str[];
+};
+
+// process context only
+int setup_names(void);
+void destroy_names(void);
+
+// a reference to the (possibly already existing) name equal to str
+const struct name *name_intern(const char *str, gfp_t gfp);
+
+// atomic context safe, memory is freed after a grace period: a name
+// reached through an object looked up under RCU can still be read
+static inline const struct name *name_get(const struct name *n) {
+	refcount_inc(&((struct name*) n)->refs);
+	return n;
+}
+
+void name_put(const struct name *n);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// every probe (mounts and fs-specific ones) is registered disarmed:
+// they are armed with the first registered device and disarmed after
+// the last one is gone (see devices.c), process context only
+int arm_probes(void);
+void disarm_probes(void);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef SNAPBLOCKS_INDEX_H
+#define SNAPBLOCKS_INDEX_H
+
+#include <linux/fs.h>
+
+#define SNAPIDX_FILE_NAME "snapblocks.idx"
+
+struct snapidx; //opaque ptr
+
+// takes ownership of filp (fput on snapidx_close)
+struct snapidx* snapidx_open(struct file *filp);
+void snapidx_close(struct snapidx *idx);
+
+// the index file itself, still owned by the index
+struct file* snapidx_file(const struct snapidx *idx);
+
+// drops every entry, as if the index were just created
+bool snapidx_reset(struct snapidx *idx);
+
+// 1 if found (and *out_off is set), 0 if not found, < 0 on I/O errors
+int snapidx_lookup(struct snapidx *idx, u64 blknr, u64 *out_off);
+
+// records that blknr lives at snapblocks offset off and that every
+// record of the snapblocks file up to covered_end is now indexed
+bool snapidx_insert(struct snapidx *idx, u64 blknr, u64 off, u64 covered_end);
+
+// walks every indexed block, stops early (returning false) if fn does
+bool snapidx_for_each(struct snapidx *idx, bool (*fn)(u64 blknr, u64 off, void *arg), void *arg);
+
+// snapblocks offset up to which the index is known to be in sync
+u64 snapidx_covered(const struct snapidx *idx);
+bool snapidx_set_covered(struct snapidx *idx, u64 covered_end);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <linux/types.h>
+#include <linux/string.h>
+
+int setup_snapshot(void);
+void destroy_snapshot(void);
+
+// process context only, captures taken so far reach their epoch
+void drain_capture_rings(void);
+
+enum snapshot_compression {
+	SNAPSHOT_COMPRESSION_NONE,
+	SNAPSHOT_COMPRESSION_LZ4,
+	SNAPSHOT_COMPRESSION_ZSTD
+};
+
+enum snapshot_checksum {
+	SNAPSHOT_CHECKSUM_NONE,
+	SNAPSHOT_CHECKSUM_CRC32C
+};
+
+enum snapshot_encryption {
+	SNAPSHOT_ENCRYPTION_NONE,
+	SNAPSHOT_ENCRYPTION_AES_GCM
+};
+
+// AES-256, AES-192 and AES-128 keys
+#define SNAPSHOT_MAX_KEY_SIZE 32
+
+#define SNAPBLOCKS_FILE_NAME "snapblocks"
+// in the snapdir of an epoch missing blocks, holds how many
+#define SNAPSHOT_INCOMPLETE_FILE_NAME "incomplete"
+
+// snapblocks segments (and lanes) of an epoch
+#define SNAPSHOT_MAX_LANES 64
+
+// given at activation time, level 0 is the algorithm default.
+// Devices and epochs hold shared ones, see snapshot_options_share
+struct snapshot_options {
+	enum snapshot_compression compression;
+	int compression_level;
+	enum snapshot_checksum checksum;
+	enum snapshot_encryption encryption;
+	unsigned int key_size;
+	u8 key[SNAPSHOT_MAX_KEY_SIZE];
+	unsigned int nr_lanes;
+};
+
+// one read-only refcounted copy per activation (a single device or a
+// batch), shared by its devices and their epochs: a single copy of the
+// key, wiped along with the last reference (or on failures).
+// options is a comma separated key=value list (e.g. "compress=zstd,csum=none"),
+// modified in place (key values are wiped), NULL means defaults.
+// The caller holds a reference on success
+const struct snapshot_options *snapshot_options_share(char *options);
+
+// atomic context safe
+const struct snapshot_options *snapshot_options_get(const struct snapshot_options *opts);
+void snapshot_options_put(const struct snapshot_options *opts);
+
+struct snapshot_compressor; //opaque ptr
+void snapshot_compressor_destroy(struct snapshot_compressor *c);
+
+struct snapshot_dedup; //opaque ptr
+void snapshot_dedup_destroy(struct snapshot_dedup *dd);
+
+struct snapshot_encryptor; //opaque ptr
+void snapshot_encryptor_destroy(struct snapshot_encryptor *c);
+
+struct snapshot_claims; //opaque ptr
+void snapshot_claims_destroy(struct snapshot_claims *cl);
+
+#endif
@@ -0,0 +1,247 @@
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait_bit.h>
+#include <linux/cpumask.h>
+
+#include <lanes.h>
+#include <pr-err-failure.h>
+
+// a lane is a list of works and a "turn" on the pool: the turn is queued
+// whenever the lane gets a work, it runs the first one and, if there are
+// more, queues itself again, behind the turns of the other busy lanes.
+// A work_struct never runs on two workers at once, so neither do two
+// works of the same lane
+struct lane {
+	spinlock_t lock;
+	struct list_head works;
+	//being run, if any
+	struct lane_work *running;
+	struct work_struct turn;
+};
+
+static struct workqueue_struct *lanes_pool;
+
+static void lane_turn(struct work_struct *turn) {
+	struct lane *lane = container_of(turn, struct lane, turn);
+
+	spin_lock_irq(&lane->lock);
+
+	struct lane_work *work =
+		list_first_entry_or_null(&lane->works, struct lane_work, entry);
+
+	if(work == NULL) {
+		spin_unlock_irq(&lane->lock);
+		return;
+	}
+
+	list_del_init(&work->entry);
+	lane->running = work;
+
+	spin_unlock_irq(&lane->lock);
+
+	//may free the work itself: not touched anymore
+	work->func(work);
+
+	spin_lock_irq(&lane->lock);
+
+	lane->running = NULL;
+	if(!list_empty(&lane->works)) {
+		queue_work(lanes_pool, &lane->turn);
+	}
+
+	spin_unlock_irq(&lane->lock);
+
+	//lane_destroy flushes the turn, the lane is still there
+	wake_up_var(lane);
+}
+
+static bool lane_is_idle(struct lane *lane) {
+	spin_lock_irq(&lane->lock);
+	bool idle = list_empty(&lane->works) && lane->running == NULL;
+	spin_unlock_irq(&lane->lock);
+
+	return idle;
+}
+
+static bool lane_work_is_busy(struct lane *lane, struct lane_work *work) {
+	spin_lock_irq(&lane->lock);
+	bool busy = !list_empty(&work->entry) || lane->running == work;
+	spin_unlock_irq(&lane->lock);
+
+	return busy;
+}
+
+/**
+ *
+ * works
+ *
+ */
+
+void init_lane_work(struct lane_work *work, void (*func)(struct lane_work*)) {
+	INIT_LIST_HEAD(&work->entry);
+	work->func = func;
+	work->lane = NULL;
+}
+
+static void lane_delayed_work_timer_fn(struct timer_list *timer) {
+	struct lane_delayed_work *dwork =
+		container_of(timer, struct lane_delayed_work, timer);
+
+	lane_queue_work(dwork->work.lane, &dwork->work);
+}
+
+void init_lane_delayed_work(struct lane_delayed_work *dwork, void (*func)(struct lane_work*)) {
+	init_lane_work(&dwork->work, func);
+	timer_setup(&dwork->timer, lane_delayed_work_timer_fn, 0);
+}
+
+//lane lock held
+static bool __lane_queue_work(struct lane *lane, struct lane_work *work) {
+	if(!list_empty(&work->entry)) {
+		return false;
+	}
+
+	work->lane = lane;
+	list_add_tail(&work->entry, &lane->works);
+	queue_work(lanes_pool, &lane->turn);
+
+	return true;
+}
+
+bool lane_queue_work(struct lane *lane, struct lane_work *work) {
+	unsigned long flags;
+	spin_lock_irqsave(&lane->lock, flags);
+
+	bool queued = __lane_queue_work(lane, work);
+
+	spin_unlock_irqrestore(&lane->lock, flags);
+	return queued;
+}
+
+//lane lock held, timer not pending
+static bool __lane_queue_delayed_work(
+		struct lane *lane, struct lane_delayed_work *dwork, unsigned long delay) {
+
+	if(delay == 0) {
+		return __lane_queue_work(lane, &dwork->work);
+	}
+
+	if(!list_empty(&dwork->work.entry)) {
+		return false;
+	}
+
+	dwork->work.lane = lane;
+	dwork->timer.expires = jiffies + delay;
+	add_timer(&dwork->timer);
+
+	return true;
+}
+
+bool lane_queue_delayed_work(struct lane *lane, struct lane_delayed_work *dwork, unsigned long delay) {
+	unsigned long flags;
+	spin_lock_irqsave(&lane->lock, flags);
+
+	bool queued =
+		!timer_pending(&dwork->timer) &&
+		__lane_queue_delayed_work(lane, dwork, delay);
+
+	spin_unlock_irqrestore(&lane->lock, flags);
+	return queued;
+}
+
+// a work already queued stays queued: it never runs later than asked
+void lane_mod_delayed_work(struct lane *lane, struct lane_delayed_work *dwork, unsigned long delay) {
+	unsigned long flags;
+	spin_lock_irqsave(&lane->lock, flags);
+
+	//a timer already firing finds the work queued, or queues it once more
+	timer_delete(&dwork->timer);
+	__lane_queue_delayed_work(lane, dwork, delay);
+
+	spin_unlock_irqrestore(&lane->lock, flags);
+}
+
+bool lane_cancel_delayed_work_sync(struct lane_delayed_work *dwork) {
+	bool was_pending = timer_delete_sync(&dwork->timer);
+
+	//bound before its timer is armed
+	struct lane *lane = dwork->work.lane;
+	if(lane == NULL) {
+		return was_pending;
+	}
+
+	spin_lock_irq(&lane->lock);
+
+	if(!list_empty(&dwork->work.entry)) {
+		list_del_init(&dwork->work.entry);
+		was_pending = true;
+	}
+
+	spin_unlock_irq(&lane->lock);
+
+	wait_var_event(lane, READ_ONCE(lane->running) != &dwork->work);
+	return was_pending;
+}
+
+void lane_flush_delayed_work(struct lane_delayed_work *dwork) {
+	struct lane *lane = dwork->work.lane;
+	if(lane == NULL) {
+		return;
+	}
+
+	//due now
+	if(timer_delete_sync(&dwork->timer)) {
+		lane_queue_work(lane, &dwork->work);
+	}
+
+	wait_var_event(lane, !lane_work_is_busy(lane, &dwork->work));
+}
+
+/**
+ *
+ * lanes
+ *
+ */
+
+struct lane *lane_alloc(gfp_t gfp) {
+	struct lane *lane = kmalloc(sizeof(struct lane), gfp);
+	if(lane == NULL) {
+		pr_err_failure("kmalloc");
+		return NULL;
+	}
+
+	spin_lock_init(&lane->lock);
+	INIT_LIST_HEAD(&lane->works);
+	lane->running = NULL;
+	INIT_WORK(&lane->turn, lane_turn);
+
+	return lane;
+}
+
+void lane_flush(struct lane *lane) {
+	wait_var_event(lane, lane_is_idle(lane));
+}
+
+void lane_destroy(struct lane *lane) {
+	lane_flush(lane);
+
+	//a turn may still be queued (or finishing), it finds nothing to do
+	flush_work(&lane->turn);
+	kfree(lane);
+}
+
+int setup_lanes(void) {
+	//turns of different lanes run in parallel, up to one per CPU
+	lanes_pool = alloc_workqueue("bdsnap-lanes", WQ_UNBOUND | WQ_FREEZABLE, num_possible_cpus());
+	if(lanes_pool == NULL) {
+		pr_err_failure("alloc_workqueue");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void destroy_lanes(void) {
+	destroy_workqueue(lanes_pool);
+}
@@ -1,184 +0,0 @@
-#include <linux/version.h>
-#include <linux/slab.h>
-#include <linux/vmalloc.h>
-
-#include <lru-ng.h>
-#include <pr-err-failure.h>
-
-typedef bool (*llru_op_fpt)(struct list_lru*, struct list_head*);
-
-//this is because of introduction of NUMA-aware list_lru in v6.8.0
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,8,0)
-llru_op_fpt llru_add = list_lru_add_obj;
-llru_op_fpt llru_del = list_lru_del_obj;
-#elif KERNEL_VERSION(3,12,0) <= LINUX_VERSION_CODE && LINUX_VERSION_CODE < KERNEL_VERSION(6,8,0)
-llru_op_fpt llru_add = list_lru_add;
-llru_op_fpt llru_del = list_lru_del;
-#else
-#	error unsupported kernel version (missing list_lru_add, list_lru_del)
-#endif
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
-
-#	define LIST_LRU_WALK_CB_ARGS \
-		struct list_head *item, \
-		__always_unused struct list_lru_one *l, \
-		__maybe_unused void *args
-
-#elif KERNEL_VERSION(4,0,0) <= LINUX_VERSION_CODE && LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
-
-#	define LIST_LRU_WALK_CB_ARGS \
-		struct list_head *item, \
-		__always_unused struct list_lru_one *l, \
-		__always_unused spinlock_t *s, \
-		__maybe_unused void *args
-
-#elif KERNEL_VERSION(3,12,0) <= LINUX_VERSION_CODE && LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-
-#	define LIST_LRU_WALK_CB_ARGS \
-		struct list_head *item, \
-		__always_unused spinlock_t *s, \
-		__maybe_unused void *args
-
-#else
-#	error unsupported kernel version (missing typedef list_lru_walk_cb)
-#endif
-
-// spatial considerations
-//
-// for each device, struct lru_ng will occupy:
-// approx 2-3MB of memory
-struct lru_ng {
-	struct list_lru llru;
-	DECLARE_HASHTABLE(hasht, LRU_NG__HT_BUCKET_BITS);
-};
-
-// each struct lru_node takes 40B which is created once a block is snapshotted
-// even if the LRU cache is full, for 18 bits hashtable: 
-// approx 11MB for each device
-//
-// Considering that normally a block is 4096 B, 2^18 lru_nodes will
-// gurantee a large LRU cache with O(1) access which spans 1GB of device storage
-// 
-// Considering that more than 1 device can be registered, to reach 1 GB of total
-// memory used by the blkdev_snapshot module it will take 100 registered devices (LRUs are full)
-struct lru_node {
-	struct hlist_node hnode;
-	struct list_head lru;
-	sector_t blknr;
-};
-
-static inline bool lru_ng_init(struct lru_ng* lru) {
-	hash_init(lru->hasht);
-	return list_lru_init(&lru->llru) == 0;
-}
-
-struct lru_ng *lru_ng_alloc_and_init(void) {
-	struct lru_ng *lru;
-
-	const char *allokname;
-	size_t alloksize = sizeof(struct lru_ng);
-
-	if(alloksize > PAGE_SIZE) {
-		lru = vmalloc(alloksize);
-		allokname = "vmalloc";
-	} else {
-		lru = kmalloc(sizeof(struct lru_ng), GFP_KERNEL);
-		allokname = "kmalloc";
-	}
-
-	if(lru == NULL) {
-		pr_err_failure(allokname);
-		return NULL;
-	}
-
-	if(!lru_ng_init(lru)) {
-		pr_err_failure("lru_ng_init");
-		kfree(lru);
-		return NULL;
-	}
-
-	return lru;
-}
-
-static enum lru_status evict_cb(LIST_LRU_WALK_CB_ARGS) {
-	struct lru_node *node = 
-		container_of(item, struct lru_node, lru);
-
-	list_del_init(&node->lru);
-	hash_del(&node->hnode);
-	kfree(node);
-
-	return LRU_REMOVED;
-}
-
-static inline void enforce_lru_size_limit(struct list_lru * lru) {
-	if (list_lru_count(lru) <= LRU_NG__LRU_MAX_ENTRIES) {
-		return;
-	}
-
-	list_lru_walk(lru, evict_cb, NULL, 1);
-}
-
-bool lru_ng_add(struct lru_ng * lru, sector_t key) {
-	struct lru_node *node = kzalloc(sizeof(struct lru_node), GFP_KERNEL);
-	if(node == NULL) {
-		pr_err_failure("kmalloc");
-		return false;
-	}
-
-	INIT_HLIST_NODE(&node->hnode);
-	hash_add(lru->hasht, &node->hnode, key);
-
-	INIT_LIST_HEAD(&node->lru);
-	node->blknr = key;
-
-	if(!llru_add(&lru->llru, &node->lru)) {
-		pr_err_failure("llru_add");
-		hash_del(&node->hnode);
-		kfree(node);
-		return false;
-	}
-
-	enforce_lru_size_limit(&lru->llru);
-
-	return true;
-}
-
-bool lru_ng_lookup(struct lru_ng * lru, sector_t key) {
-	struct lru_node *node;
-
-	hash_for_each_possible(lru->hasht, node, hnode, key) {
-		if(node->blknr == key) {
-			if(!llru_del(&lru->llru, &node->lru)) {
-				pr_err_failure("llru_del");
-				return false;
-			}
-
-			if(!llru_add(&lru->llru, &node->lru)) {
-				pr_err_failure("llru_add");
-				return false;
-			}
-
-			return true;
-		}
-	}
-
-	return false;
-}
-
-static inline void lru_ng_cleanup(struct lru_ng* lru) {
-	list_lru_walk(&lru->llru, evict_cb, NULL, ULONG_MAX);
-	list_lru_destroy(&lru->llru);
-}
-
-void lru_ng_cleanup_and_destroy(struct lru_ng* lru) {
-	lru_ng_cleanup(lru);
-
-	size_t alloksize = sizeof(struct lru_ng);
-	if(alloksize > PAGE_SIZE) {
-		vfree(lru);
-	} else {
-		kfree(lru);
-	}
-}
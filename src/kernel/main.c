@@ -1,6 +1,10 @@
 #include <activation.h>
 #include <devices.h>
+#include <lanes.h>
+#include <names.h>
 #include <mounts.h>
+#include <snapshot.h>
+#include <probes.h>
 #include <fs-support/fs-support.h>
 #include <pr-err-failure.h>
 
@@ -52,14 +56,38 @@ int __init init_blkdev_snapshot_module(void) {
 
 	START_SETUP_BLOCK;
 
+	_SETUP(snapshot) {
+		pr_err_setup(snapshot);
+		END_SETUP_BLOCK;
+	}
+
+	_SETUP(lanes) {
+		pr_err_setup(lanes);
+		destroy_snapshot();
+		END_SETUP_BLOCK;
+	}
+
+	_SETUP(names) {
+		pr_err_setup(names);
+		destroy_lanes();
+		destroy_snapshot();
+		END_SETUP_BLOCK;
+	}
+
 	_SETUP(devices) {
 		pr_err_setup(devices);
+		destroy_names();
+		destroy_lanes();
+		destroy_snapshot();
 		END_SETUP_BLOCK;
 	}
 
 	_SETUP(fssupport) {
 		pr_err_setup(fssupport);
 		destroy_devices();
+		destroy_names();
+		destroy_lanes();
+		destroy_snapshot();
 		END_SETUP_BLOCK;
 	}
 
@@ -67,6 +95,9 @@ int __init init_blkdev_snapshot_module(void) {
 		pr_err_setup(epoch_mgmt);
 		destroy_fssupport();
 		destroy_devices();
+		destroy_names();
+		destroy_lanes();
+		destroy_snapshot();
 		END_SETUP_BLOCK;
 	}
 
@@ -75,6 +106,9 @@ int __init init_blkdev_snapshot_module(void) {
 		destroy_mounts();
 		destroy_fssupport();
 		destroy_devices();
+		destroy_names();
+		destroy_lanes();
+		destroy_snapshot();
 		END_SETUP_BLOCK;
 	}
 
@@ -92,6 +126,28 @@ void __exit exit_blkdev_snapshot_module(void) {
 	destroy_mounts();
 	destroy_fssupport();
 	destroy_devices();
+	destroy_names();
+	destroy_lanes();
+	destroy_snapshot();
+}
+
+int arm_probes(void) {
+	int err = arm_mounts();
+	if(err != 0) {
+		return err;
+	}
+
+	if((err = arm_fssupport()) != 0) {
+		disarm_mounts();
+		return err;
+	}
+
+	return 0;
+}
+
+void disarm_probes(void) {
+	disarm_fssupport();
+	disarm_mounts();
 }
 
 module_init(init_blkdev_snapshot_module);
@@ -1,12 +1,12 @@
 #include <linux/version.h>
-#include <linux/kprobes.h>
 #include <linux/time.h>
 #include <linux/timekeeping.h>
 #include <uapi/linux/mount.h>
 
 #include <mounts.h>
 #include <devices.h>
-#include <lru-ng.h>
+#include <hooks.h>
+#include <pr-err-failure.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
 #error your version is not compat (reason: kretprobes hooked funcs)
@@ -14,31 +14,171 @@
 
 /**
  *
- * mount events counting
+ * epoch lifetime
  *
  */
 
-struct finish_epoch_work {
-	struct work_struct work;
-	struct epoch *ended_epoch;
-};
+static void cleanup_epoch_shard(struct epoch_shard *shard) {
+	//a batch timer may still be armed, its captures are already gone
+	lane_cancel_delayed_work_sync(&shard->pending_captures_work);
+	drain_epoch_pending_captures(shard);
+
+	if(shard->own_lane) {
+		lane_destroy(shard->lane);
+	}
+
+	snapidx_close(shard->snapblocks_idx);
+
+	if(shard->snapblocks_dio_filp != NULL) {
+		fput(shard->snapblocks_dio_filp);
+	}
+
+	if(shard->snapblocks_filp != NULL) {
+		fput(shard->snapblocks_filp);
+	}
+
+	if(shard->captured_blocks != NULL) {
+		blkbitmap_cleanup_and_destroy(shard->captured_blocks);
+	}
+
+	if(shard->compressor != NULL) {
+		snapshot_compressor_destroy(shard->compressor);
+	}
+
+	if(shard->dedup != NULL) {
+		snapshot_dedup_destroy(shard->dedup);
+	}
+
+	if(shard->encryptor != NULL) {
+		snapshot_encryptor_destroy(shard->encryptor);
+	}
+}
+
+//process context, on the device lane: nothing can reference the epoch anymore
+static void cleanup_epoch_work(struct lane_work *work) {
+	struct epoch *epoch = container_of(work, struct epoch, cleanup_work);
+
+	for(unsigned int i = 0; i < epoch->nr_shards; i++) {
+		cleanup_epoch_shard(&epoch->shards[i]);
+	}
 
-static void cleanup_epoch_work(struct work_struct *work) {
-	struct finish_epoch_work *few = 
-		container_of(work, struct finish_epoch_work, work);
+	//the count is final now
+	mark_epoch_losses(epoch);
 
-	destroy_an_epoch(few->ended_epoch);
-	kfree(few);
+	if(epoch->path_snapdir != NULL) {
+		path_put(epoch->path_snapdir);
+	}
+
+	struct snapshot_claims *claims = rcu_dereference_protected(epoch->claims, true);
+	if(claims != NULL) {
+		snapshot_claims_destroy(claims);
+	}
+
+	snapshot_options_put(epoch->opts);
+
+	int nr_lost = atomic_read(&epoch->nr_lost_captures);
+	if(nr_lost != 0) {
+		pr_warn("%s: snapshot %s%s misses %d blocks (memory budget exhausted or out of memory)\n", 
+				module_name(THIS_MODULE), epoch->original_dev_name->str, epoch->first_mount_date, nr_lost);
+	}
+
+	name_put(epoch->original_dev_name);
+	kfree_rcu(epoch, rcu);
 }
 
+static void release_an_epoch(struct kref *refs) {
+	struct epoch *epoch = container_of(refs, struct epoch, refs);
+
+	//ordered lane: runs after any batch already queued for shards on
+	//the device lane, the others are waited for by the cleanup itself
+	init_lane_work(&epoch->cleanup_work, cleanup_epoch_work);
+	lane_queue_work(epoch->lane, &epoch->cleanup_work);
+}
+
+// a single shard writes the plain snapblocks file (and index), more
+// shards write segments, "snapblocks.<n>" (and "snapblocks.<n>.idx")
+static void init_epoch_shard(struct epoch *epoch, unsigned int n, gfp_t gfp) {
+	struct epoch_shard *shard = &epoch->shards[n];
+
+	shard->e = epoch;
+
+	if(epoch->nr_shards == 1) {
+		strscpy(shard->snapblocks_name, SNAPBLOCKS_FILE_NAME, EPOCH_SHARD_NAME_LEN);
+		strscpy(shard->snapidx_name, SNAPIDX_FILE_NAME, EPOCH_SHARD_NAME_LEN);
+	} else {
+		snprintf(shard->snapblocks_name, EPOCH_SHARD_NAME_LEN, SNAPBLOCKS_FILE_NAME ".%u", n);
+		snprintf(shard->snapidx_name, EPOCH_SHARD_NAME_LEN, SNAPBLOCKS_FILE_NAME ".%u.idx", n);
+	}
+
+	//the first one on the device lane, a shard without a lane of its
+	//own too: still ordered, just not in parallel with the first one
+	shard->lane = n > 0 ? lane_alloc(gfp) : NULL;
+	shard->own_lane = shard->lane != NULL;
+	if(!shard->own_lane) {
+		shard->lane = epoch->lane;
+	}
+
+	init_llist_head(&shard->pending_captures);
+	atomic_set(&shard->nr_pending_captures, 0);
+	init_lane_delayed_work(&shard->pending_captures_work, epoch_pending_captures_work);
+}
+
+struct epoch* alloc_an_epoch(const struct object_data *data, gfp_t gfp) {
+	unsigned int nr_shards = clamp_t(unsigned int, data->opts->nr_lanes, 1, SNAPSHOT_MAX_LANES);
+
+	struct epoch *epoch = kzalloc(struct_size(epoch, shards, nr_shards), gfp);
+	if(epoch == NULL) {
+		return NULL;
+	}
+
+	//shared with the device, the epoch may outlive it
+	epoch->original_dev_name = name_get(data->original_dev_name);
+
+	kref_init(&epoch->refs);
+	atomic_set(&epoch->nr_lost_captures, 0);
+	epoch->lane = data->lane;
+	epoch->opts = snapshot_options_get(data->opts);
+	mutex_init(&epoch->shared_lock);
+
+	epoch->nr_shards = nr_shards;
+	for(unsigned int i = 0; i < nr_shards; i++) {
+		init_epoch_shard(epoch, i, gfp);
+	}
+
+	return epoch;
+}
+
+//fails if the epoch is already going away
+bool get_an_epoch(struct epoch *epoch) {
+	return kref_get_unless_zero(&epoch->refs);
+}
+
+void put_an_epoch(struct epoch *epoch) {
+	kref_put(&epoch->refs, release_an_epoch);
+}
+
+/**
+ *
+ * mount events counting
+ *
+ */
+
 //remember: general_lock is taken
 static void __epoch_event_cb_count_mount(
 		struct epoch** epoch, 
-		bool __always_unused wq_is_destroyed) {
+		bool wq_is_destroyed) {
+
+	struct object_data *data = 
+		container_of(epoch, struct object_data, e);
+
+	//being unregistered: its name and options are gone already
+	if(*epoch == NULL && wq_is_destroyed) {
+		return;
+	}
 
 	if(
 			*epoch == NULL && 
-			(*epoch = kzalloc(sizeof(struct epoch), GFP_ATOMIC)) == NULL) {
+			(*epoch = alloc_an_epoch(data, GFP_ATOMIC)) == NULL) {
 
 		return;
 	}
@@ -82,25 +222,18 @@ static void __epoch_event_cb_count_umount(
 		//this is a bug (?)
 		(*epoch)->n_currently_mounted = 0;
 	} else if((*epoch)->n_currently_mounted == 0) {
-		struct object_data *data = 
-			container_of(epoch, struct object_data, e);
-
 		//we hold the general lock, at this time the wq is destroyed or not
 		//but nothing can happen while we have the lock
 		if(!wq_is_destroyed) {
 			struct epoch* saved_epoch = *epoch;
 			*epoch = NULL;
 
-			struct finish_epoch_work *few = (struct finish_epoch_work*) 
-				kmalloc(sizeof(struct finish_epoch_work), GFP_ATOMIC);
-
-			if(few != NULL) {
-				few->ended_epoch = saved_epoch;
+			//no batch timer of an ended epoch must outlive the lane:
+			//pending captures are written out right away from now on
+			expedite_epoch_pending_captures(saved_epoch);
 
-				INIT_WORK(&few->work, cleanup_epoch_work);
-
-				queue_work(data->wq, &few->work);
-			}
+			//pending captures keep it alive until they are written out
+			put_an_epoch(saved_epoch);
 		}
 	}
 }
@@ -156,7 +289,7 @@ static inline struct block_device *get_bdev_from_path(const struct path *path) {
  *
  */
 
-#define KRP_NEW_MOUNT_SYMBOL_NAME "do_move_mount"
+#define HOOK_NEW_MOUNT_SYMBOL_NAME "do_move_mount"
 
 static inline bool is_root(const struct path *path) {
 	char* buf = kmalloc(PATH_MAX, GFP_ATOMIC);
@@ -171,8 +304,15 @@ static inline bool is_root(const struct path *path) {
 	return ok;
 }
 
-static int new_mount_entry_handler(struct kretprobe_instance* krp_inst, struct pt_regs* regs) {
-	struct path *old_path = (struct path *) regs->di;
+static int new_mount_entry_handler(
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		void *data) {
+
+	struct path *old_path = (struct path *) call->args[0];
+
+	//e.g. a loop device bound to another file since its last mount
+	devices_changed();
 
 	if(old_path == 	NULL) {
 		return 1;
@@ -184,19 +324,22 @@ static int new_mount_entry_handler(struct kretprobe_instance* krp_inst, struct p
 		return 1;
 	}
 
-	struct mountinfo *minfo = (struct mountinfo*) krp_inst->data;
+	struct mountinfo *minfo = (struct mountinfo*) data;
 	from_block_device_to_mountinfo(minfo, bdev);
 
 	return 0;
 }
 
-static int mount_handler(struct kretprobe_instance* krp_inst, struct pt_regs* regs) {
-	if(regs_return_value(regs) != 0) {
-		return 0;
+static void mount_handler(
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		void *data) {
+
+	if(call->retval != 0) {
+		return;
 	}
 
-	epoch_count_mount((struct mountinfo*) krp_inst->data);
-	return 0;
+	epoch_count_mount((struct mountinfo*) data);
 }
 
 /*
@@ -206,11 +349,18 @@ static int mount_handler(struct kretprobe_instance* krp_inst, struct pt_regs* re
  *
  */
 
-#define KRP_OLD_MOUNT_SYMBOL_NAME "path_mount"
+#define HOOK_OLD_MOUNT_SYMBOL_NAME "path_mount"
+
+static int old_mount_entry_handler(
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		void *data) {
 
-static int old_mount_entry_handler(struct kretprobe_instance* krp_inst, struct pt_regs* regs) {
-	struct path *path = (struct path*) regs->si;
-	unsigned long flags = regs->r10;
+	//path_mount(dev_name, path, type_page, flags, data_page)
+	struct path *path = (struct path*) call->args[1];
+	unsigned long flags = call->args[3];
+
+	devices_changed();
 
 	bool is_new_mount = 
 		!((flags & (MS_REMOUNT | MS_BIND)) == (MS_REMOUNT | MS_BIND)) &&
@@ -228,7 +378,7 @@ static int old_mount_entry_handler(struct kretprobe_instance* krp_inst, struct p
 		return 1;
 	}
 
-	struct mountinfo *minfo = (struct mountinfo*) krp_inst->data;
+	struct mountinfo *minfo = (struct mountinfo*) data;
 	from_block_device_to_mountinfo(minfo, bdev);
 
 	return 0;
@@ -241,7 +391,7 @@ static int old_mount_entry_handler(struct kretprobe_instance* krp_inst, struct p
  *
  */
 
-#define KRP_UMOUNT_SYMBOL_NAME "path_umount"
+#define HOOK_UMOUNT_SYMBOL_NAME "path_umount"
 
 static inline bool path_starts_with(const char* s, const struct path *path) {
 	char* buf = kmalloc(PATH_MAX, GFP_ATOMIC);
@@ -257,8 +407,14 @@ static inline bool path_starts_with(const char* s, const struct path *path) {
 	return ok;
 }
 
-static int umount_entry_handler(struct kretprobe_instance* krp_inst, struct pt_regs* regs) {
-	struct path *path = (struct path*) regs->di;
+static int umount_entry_handler(
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		void *data) {
+
+	struct path *path = (struct path*) call->args[0];
+
+	devices_changed();
 
 	if(path == NULL || path_starts_with("/run/systemd", path)) {
 		return 1;
@@ -269,75 +425,84 @@ static int umount_entry_handler(struct kretprobe_instance* krp_inst, struct pt_r
 		return 1;
 	}
 
-	struct mountinfo *minfo = (struct mountinfo*) krp_inst->data;
+	struct mountinfo *minfo = (struct mountinfo*) data;
 	from_block_device_to_mountinfo(minfo, bdev);
 
 	return 0;
 }
 
-static int umount_handler(struct kretprobe_instance* krp_inst, struct pt_regs* regs) {
-	if(regs_return_value(regs) != 0) {
-		return 0;
+static void umount_handler(
+		__always_unused struct hook *h, 
+		const struct hook_call *call, 
+		void *data) {
+
+	if(call->retval != 0) {
+		return;
 	}
 
-	epoch_count_umount((struct mountinfo*) krp_inst->data);
-	return 0;
+	epoch_count_umount((struct mountinfo*) data);
 }
 
 /* 
  *
- * kretprobes 
+ * hooks 
  *
- * either one of krp_new_mount or krp_old_mount will be probed
+ * either one of hook_new_mount or hook_old_mount will be hit
  * according to the userspace mount utility (or whatever is
  * responsible to initiate mount operation via some kernel 
  * system calls)
  *
  */
 
-static struct kretprobe krp_new_mount = {
-	.entry_handler = new_mount_entry_handler,
-	.handler = mount_handler,
-	.kp.symbol_name = KRP_NEW_MOUNT_SYMBOL_NAME,
-	.maxactive = -1,
+static struct hook hook_new_mount = {
+	.symbol = HOOK_NEW_MOUNT_SYMBOL_NAME,
+	.entry = new_mount_entry_handler,
+	.exit = mount_handler,
 	.data_size = sizeof(struct mountinfo)
 };
 
-static struct kretprobe krp_old_mount = {
-	.entry_handler = old_mount_entry_handler,
-	.handler = mount_handler,
-	.kp.symbol_name = KRP_OLD_MOUNT_SYMBOL_NAME,
-	.maxactive = -1,
+static struct hook hook_old_mount = {
+	.symbol = HOOK_OLD_MOUNT_SYMBOL_NAME,
+	.entry = old_mount_entry_handler,
+	.exit = mount_handler,
 	.data_size = sizeof(struct mountinfo)
 };
 
-static struct kretprobe krp_umount = {
-	.entry_handler = umount_entry_handler,
-	.handler = umount_handler,
-	.kp.symbol_name = KRP_UMOUNT_SYMBOL_NAME,
-	.maxactive = -1,
+static struct hook hook_umount = {
+	.symbol = HOOK_UMOUNT_SYMBOL_NAME,
+	.entry = umount_entry_handler,
+	.exit = umount_handler,
 	.data_size = sizeof(struct mountinfo)
 };
 
 /*
  *
- * which kretprobes to register and setup/destroy funcs
+ * which hooks to register and setup/destroy funcs
  *
  */
 
-static struct kretprobe *krps_to_register[] = {
-	&krp_new_mount,
-	&krp_old_mount,
-	&krp_umount
+static struct hook *hooks_to_register[] = {
+	&hook_new_mount,
+	&hook_old_mount,
+	&hook_umount
 };
 
-static const size_t num_krps_to_register = 
-	sizeof(krps_to_register) / sizeof(struct kretprobe*);
+static const size_t num_hooks_to_register = 
+	sizeof(hooks_to_register) / sizeof(struct hook*);
 
+// registered disarmed, see arm_mounts
 int setup_mounts(void) {
-	return register_kretprobes(krps_to_register, num_krps_to_register);
+	return register_hooks(hooks_to_register, num_hooks_to_register);
 }
 
 void destroy_mounts(void) {
-	unregister_kretprobes(krps_to_register, num_krps_to_register);
+	unregister_hooks(hooks_to_register, num_hooks_to_register);
+}
+
+void disarm_mounts(void) {
+	disarm_hooks(hooks_to_register, num_hooks_to_register);
+}
+
+int arm_mounts(void) {
+	return arm_hooks(hooks_to_register, num_hooks_to_register);
 }
@@ -0,0 +1,109 @@
+#include <linux/rhashtable.h>
+#include <linux/spinlock.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
+#include <linux/overflow.h>
+
+#include <names.h>
+#include <pr-err-failure.h>
+
+static u32 name_key_hashfn(const void *data, u32 __always_unused len, u32 seed) {
+	return jhash(data, strlen((const char*) data), seed);
+}
+
+static u32 name_obj_hashfn(const void *data, u32 __always_unused len, u32 seed) {
+	const struct name *n = (const struct name*) data;
+	return jhash(n->str, n->len, seed);
+}
+
+static int name_obj_cmpfn(struct rhashtable_compare_arg *arg, const void *obj) {
+	return strcmp(((const struct name*) obj)->str, (const char*) arg->key);
+}
+
+static const struct rhashtable_params names_ht_params = {
+	.key_offset = offsetof(struct name, str),
+	.head_offset = offsetof(struct name, linkage),
+	.hashfn = name_key_hashfn,
+	.obj_hashfn = name_obj_hashfn,
+	.obj_cmpfn = name_obj_cmpfn,
+	.automatic_shrinking = true
+};
+
+static struct rhashtable names_ht;
+
+//insertions and removals only: a name in the table has refs > 0
+//whenever this is not held
+static DEFINE_SPINLOCK(names_lock);
+
+const struct name *name_intern(const char *str, gfp_t gfp) {
+	rcu_read_lock();
+
+	struct name *n = rhashtable_lookup(&names_ht, str, names_ht_params);
+	if(n != NULL && refcount_inc_not_zero(&n->refs)) {
+		rcu_read_unlock();
+		return n;
+	}
+
+	rcu_read_unlock();
+
+	size_t len = strlen(str);
+
+	struct name *new_name = kmalloc(struct_size(new_name, str, len + 1), gfp);
+	if(new_name == NULL) {
+		pr_err_failure("kmalloc");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	refcount_set(&new_name->refs, 1);
+	new_name->len = len;
+	memcpy(new_name->str, str, len + 1);
+
+	unsigned long flags;
+	spin_lock_irqsave(&names_lock, flags);
+
+	n = rhashtable_lookup_get_insert_key(&names_ht, new_name->str, &new_name->linkage, names_ht_params);
+	if(IS_ERR(n)) {
+		spin_unlock_irqrestore(&names_lock, flags);
+		pr_err_failure_with_code("rhashtable_lookup_get_insert_key", PTR_ERR(n));
+		kfree(new_name);
+		return ERR_CAST(n);
+	} else if(n != NULL) {
+		//interned meanwhile
+		refcount_inc(&n->refs);
+		spin_unlock_irqrestore(&names_lock, flags);
+		kfree(new_name);
+		return n;
+	}
+
+	spin_unlock_irqrestore(&names_lock, flags);
+	return new_name;
+}
+
+void name_put(const struct name *cn) {
+	struct name *n = (struct name*) cn;
+
+	unsigned long flags;
+	if(!refcount_dec_and_lock_irqsave(&n->refs, &names_lock, &flags)) {
+		return;
+	}
+
+	rhashtable_remove_fast(&names_ht, &n->linkage, names_ht_params);
+	spin_unlock_irqrestore(&names_lock, flags);
+
+	kfree_rcu(n, rcu);
+}
+
+int setup_names(void) {
+	int err = rhashtable_init(&names_ht, &names_ht_params);
+	if(err != 0) {
+		pr_err_failure_with_code("rhashtable_init", err);
+		return err;
+	}
+
+	return 0;
+}
+
+//every name has been put by now
+void destroy_names(void) {
+	rhashtable_destroy(&names_ht);
+}
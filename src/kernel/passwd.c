@@ -11,34 +11,22 @@ static struct crypto_shash *sha256_shash;
 static char *auth_passwd;
 extern char* activation_ct_passwd;
 
+//sha256(data || salt), no allocation: the descriptor is on the stack
+//and the salt is hashed right after the data, not appended to a copy
 static int hash_sha256(const char* data, size_t datalen, char* output) {
-	size_t size = sizeof(struct shash_desc) + crypto_shash_descsize(sha256_shash);
-
-	struct shash_desc *desc = kmalloc(size, GFP_KERNEL);
-	if (desc == NULL) {
-		pr_err_failure("kmalloc");
-		return -ENOMEM;
-	}
-	
+	SHASH_DESC_ON_STACK(desc, sha256_shash);
 	desc->tfm = sha256_shash;
 
-	size_t datasize = sizeof(char) * strlen(data);
-	size_t saltsize = sizeof(auth_passwd_salt);
-
-	char* data_with_salt = kmalloc(datasize + saltsize, GFP_KERNEL);
-	if(data_with_salt == NULL) {
-		pr_err_failure("kmalloc");
-		kfree(desc);
-		return -ENOMEM;
+	int rv = crypto_shash_init(desc);
+	if(rv == 0) {
+		rv = crypto_shash_update(desc, data, sizeof(char) * datalen);
 	}
 
-	memcpy(data_with_salt, data, datasize);
-	memcpy(data_with_salt + datasize, auth_passwd_salt, saltsize);
-
-	int rv = crypto_shash_digest(desc, data_with_salt, datasize + saltsize, output);
+	if(rv == 0) {
+		rv = crypto_shash_finup(desc, auth_passwd_salt, sizeof(auth_passwd_salt), output);
+	}
 
-	kfree(desc);
-	kfree(data_with_salt);
+	shash_desc_zero(desc);
 
 	return rv;
 }
@@ -0,0 +1,458 @@
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/file.h>
+
+#include <snapblocks-index.h>
+#include <pr-err-failure.h>
+
+/**
+ *
+ * on-disk layout
+ *
+ * the index is a linear hashing table (Litwin) stored in a sparse sidecar
+ * file next to snapblocks: page 0 is the header, page 1 + b is bucket b,
+ * overflow pages are allocated far away from bucket pages so that buckets
+ * can keep growing one at a time without ever relocating anything.
+ *
+ * lookup costs one page read (plus overflow pages, rare with the load
+ * factor we keep), insertion one page write plus the header write.
+ *
+ */
+
+#define SNAPIDX_MAGIC 0x5ade5aad5abe1d70
+#define SNAPIDX_VERSION 1
+
+#define SNAPIDX_PAGE_SIZE 4096
+#define SNAPIDX_INITIAL_BUCKETS 16
+#define SNAPIDX_OVF_BASE_PAGE (1ULL << 24)
+
+// a bucket is split as soon as the average bucket load goes past this,
+// unsplit buckets will be at most ~100% full on average this way
+#define SNAPIDX_SPLIT_LOAD_PCT 50
+
+// set while a split is rewriting buckets, if we find it set on open then
+// the module (or the machine) died in the middle: index gets rebuilt
+#define SNAPIDX_F_SPLITTING 0x1
+
+struct snapidx_hdr {
+	u64 magic;
+	u64 version;
+	u64 nbuckets0;
+	u64 level;
+	u64 split;
+	u64 nentries;
+	u64 covered_off;
+	u64 ovf_next;
+	u64 ovf_free;
+	u64 flags;
+} __packed;
+
+struct snapidx_entry {
+	u64 blknr;
+	u64 off;
+} __packed;
+
+#define SNAPIDX_PAGE_HDR_SIZE (2 * sizeof(u64))
+#define SNAPIDX_ENTRIES_PER_PAGE \
+	((SNAPIDX_PAGE_SIZE - SNAPIDX_PAGE_HDR_SIZE) / sizeof(struct snapidx_entry))
+
+struct snapidx_page {
+	u32 nents;
+	u32 __unused;
+	u64 next; // absolute page number of the next overflow page, 0 if none
+	struct snapidx_entry ents[SNAPIDX_ENTRIES_PER_PAGE];
+} __packed;
+
+static_assert(sizeof(struct snapidx_page) == SNAPIDX_PAGE_SIZE);
+
+struct snapidx {
+	struct file *filp;
+	struct snapidx_hdr hdr;
+	struct snapidx_page *pg;
+};
+
+/**
+ *
+ * page I/O
+ *
+ */
+
+static inline loff_t idx_page_pos(u64 pgnr) {
+	return (loff_t) (pgnr * SNAPIDX_PAGE_SIZE);
+}
+
+// pages that were never written (holes or past EOF) read back as empty buckets
+static bool read_idx_page(struct file *filp, u64 pgnr, struct snapidx_page *pg) {
+	loff_t pos = idx_page_pos(pgnr);
+	ssize_t rd = kernel_read(filp, pg, SNAPIDX_PAGE_SIZE, &pos);
+
+	if(rd < 0) {
+		pr_err_failure_with_code("kernel_read", rd);
+		return false;
+	}
+
+	if(rd < SNAPIDX_PAGE_SIZE) {
+		memset(((char*) pg) + rd, 0, SNAPIDX_PAGE_SIZE - rd);
+	}
+
+	if(pg->nents > SNAPIDX_ENTRIES_PER_PAGE) {
+		pr_err("%s: snapblocks index page %llu is corrupted\n",
+				module_name(THIS_MODULE), pgnr);
+		return false;
+	}
+
+	return true;
+}
+
+static bool write_idx_bytes(struct file *filp, const void *buf, size_t len, loff_t pos) {
+	ssize_t wrote = kernel_write(filp, buf, len, &pos);
+	if(wrote != (ssize_t) len) {
+		pr_err_failure_with_code("kernel_write", wrote);
+		return false;
+	}
+
+	return true;
+}
+
+static inline bool write_idx_page(struct file *filp, u64 pgnr, const struct snapidx_page *pg) {
+	return write_idx_bytes(filp, pg, SNAPIDX_PAGE_SIZE, idx_page_pos(pgnr));
+}
+
+static inline bool write_idx_hdr(struct snapidx *idx) {
+	return write_idx_bytes(idx->filp, &idx->hdr, sizeof(struct snapidx_hdr), 0);
+}
+
+/**
+ *
+ * overflow pages mgmt
+ *
+ */
+
+// freed overflow pages are chained via their "next" field
+static bool alloc_ovf_page(struct snapidx *idx, u64 *out_pgnr) {
+	if(idx->hdr.ovf_free == 0) {
+		*out_pgnr = SNAPIDX_OVF_BASE_PAGE + idx->hdr.ovf_next++;
+		return true;
+	}
+
+	u64 pghdr[2];
+	loff_t pos = idx_page_pos(idx->hdr.ovf_free);
+	ssize_t rd = kernel_read(idx->filp, pghdr, sizeof(pghdr), &pos);
+	if(rd != sizeof(pghdr)) {
+		pr_err_failure_with_code("kernel_read", rd);
+		return false;
+	}
+
+	*out_pgnr = idx->hdr.ovf_free;
+	idx->hdr.ovf_free = pghdr[1];
+
+	return true;
+}
+
+static bool free_ovf_page(struct snapidx *idx, u64 pgnr) {
+	u64 pghdr[2] = { 0, idx->hdr.ovf_free };
+
+	if(!write_idx_bytes(idx->filp, pghdr, sizeof(pghdr), idx_page_pos(pgnr))) {
+		return false;
+	}
+
+	idx->hdr.ovf_free = pgnr;
+	return true;
+}
+
+/**
+ *
+ * linear hashing
+ *
+ */
+
+static inline u64 nbuckets_low(const struct snapidx_hdr *hdr) {
+	return hdr->nbuckets0 << hdr->level;
+}
+
+static inline u64 bucket_of(const struct snapidx_hdr *hdr, u64 blknr) {
+	u64 h = hash_64(blknr, 32);
+	u64 b = h % nbuckets_low(hdr);
+
+	if(b < hdr->split) {
+		b = h % (nbuckets_low(hdr) << 1);
+	}
+
+	return b;
+}
+
+static inline u64 bucket_page(u64 bucket) {
+	return 1 + bucket;
+}
+
+static bool append_to_bucket(struct snapidx *idx, u64 bucket, const struct snapidx_entry *ent) {
+	struct snapidx_page *pg = idx->pg;
+	u64 pgnr = bucket_page(bucket);
+
+	for(;;) {
+		if(!read_idx_page(idx->filp, pgnr, pg)) {
+			return false;
+		}
+
+		if(pg->nents < SNAPIDX_ENTRIES_PER_PAGE) {
+			pg->ents[pg->nents++] = *ent;
+			return write_idx_page(idx->filp, pgnr, pg);
+		}
+
+		if(pg->next == 0) {
+			break;
+		}
+
+		pgnr = pg->next;
+	}
+
+	u64 new_pgnr;
+	if(!alloc_ovf_page(idx, &new_pgnr)) {
+		return false;
+	}
+
+	pg->next = new_pgnr;
+	if(!write_idx_page(idx->filp, pgnr, pg)) {
+		return false;
+	}
+
+	memset(pg, 0, SNAPIDX_PAGE_SIZE);
+	pg->nents = 1;
+	pg->ents[0] = *ent;
+
+	return write_idx_page(idx->filp, new_pgnr, pg);
+}
+
+static inline bool needs_split(const struct snapidx_hdr *hdr) {
+	u64 nbuckets = nbuckets_low(hdr) + hdr->split;
+	return hdr->nentries * 100 > nbuckets * SNAPIDX_ENTRIES_PER_PAGE * SNAPIDX_SPLIT_LOAD_PCT;
+}
+
+// moves roughly half of the entries of bucket "split" to the
+// new bucket "split + nbuckets_low", then advances split pointer
+static bool split_one_bucket(struct snapidx *idx) {
+	bool rv = false;
+	struct snapidx_page *pg = idx->pg;
+	struct snapidx_entry *ents = NULL;
+	size_t nents = 0;
+
+	idx->hdr.flags |= SNAPIDX_F_SPLITTING;
+	if(!write_idx_hdr(idx)) {
+		return false;
+	}
+
+	u64 from = idx->hdr.split;
+	u64 pgnr = bucket_page(from);
+
+	while(pgnr != 0) {
+		if(!read_idx_page(idx->filp, pgnr, pg)) {
+			goto __split_one_bucket_finish0;
+		}
+
+		struct snapidx_entry *newents = krealloc(ents,
+				sizeof(struct snapidx_entry) * (nents + pg->nents), GFP_KERNEL);
+		if(newents == NULL && nents + pg->nents > 0) {
+			pr_err_failure("krealloc");
+			goto __split_one_bucket_finish0;
+		}
+
+		ents = newents;
+		memcpy(ents + nents, pg->ents, sizeof(struct snapidx_entry) * pg->nents);
+		nents += pg->nents;
+
+		u64 next = pg->next;
+		if(pgnr != bucket_page(from) && !free_ovf_page(idx, pgnr)) {
+			goto __split_one_bucket_finish0;
+		}
+
+		pgnr = next;
+	}
+
+	memset(pg, 0, SNAPIDX_PAGE_SIZE);
+	if(!write_idx_page(idx->filp, bucket_page(from), pg)) {
+		goto __split_one_bucket_finish0;
+	}
+
+	if(++idx->hdr.split == nbuckets_low(&idx->hdr)) {
+		idx->hdr.split = 0;
+		idx->hdr.level++;
+	}
+
+	for(size_t i = 0; i < nents; i++) {
+		if(!append_to_bucket(idx, bucket_of(&idx->hdr, ents[i].blknr), &ents[i])) {
+			goto __split_one_bucket_finish0;
+		}
+	}
+
+	idx->hdr.flags &= ~SNAPIDX_F_SPLITTING;
+	rv = true;
+
+__split_one_bucket_finish0:
+	kfree(ents);
+	return rv;
+}
+
+/**
+ *
+ * open/close
+ *
+ */
+
+static bool init_fresh_index(struct snapidx *idx) {
+	int err = vfs_truncate(&idx->filp->f_path, 0);
+	if(err != 0) {
+		pr_err_failure_with_code("vfs_truncate", err);
+		return false;
+	}
+
+	memset(&idx->hdr, 0, sizeof(struct snapidx_hdr));
+	idx->hdr.magic = SNAPIDX_MAGIC;
+	idx->hdr.version = SNAPIDX_VERSION;
+	idx->hdr.nbuckets0 = SNAPIDX_INITIAL_BUCKETS;
+
+	return write_idx_hdr(idx);
+}
+
+struct snapidx* snapidx_open(struct file *filp) {
+	struct snapidx *idx = kzalloc(sizeof(struct snapidx), GFP_KERNEL);
+	if(idx == NULL) {
+		pr_err_failure("kzalloc");
+		fput(filp);
+		return NULL;
+	}
+
+	idx->filp = filp;
+
+	idx->pg = kmalloc(SNAPIDX_PAGE_SIZE, GFP_KERNEL);
+	if(idx->pg == NULL) {
+		pr_err_failure("kmalloc");
+		snapidx_close(idx);
+		return NULL;
+	}
+
+	loff_t pos = 0;
+	ssize_t rd = kernel_read(filp, &idx->hdr, sizeof(struct snapidx_hdr), &pos);
+
+	bool usable =
+		rd == sizeof(struct snapidx_hdr) &&
+		idx->hdr.magic == SNAPIDX_MAGIC &&
+		idx->hdr.version == SNAPIDX_VERSION &&
+		idx->hdr.nbuckets0 != 0 &&
+		!(idx->hdr.flags & SNAPIDX_F_SPLITTING);
+
+	if(!usable) {
+		if(rd != 0) {
+			pr_warn("%s: snapblocks index is unusable, rebuilding it...\n",
+					module_name(THIS_MODULE));
+		}
+
+		if(!init_fresh_index(idx)) {
+			snapidx_close(idx);
+			return NULL;
+		}
+	}
+
+	return idx;
+}
+
+void snapidx_close(struct snapidx *idx) {
+	if(idx != NULL) {
+		fput(idx->filp);
+		kfree(idx->pg);
+		kfree(idx);
+	}
+}
+
+struct file* snapidx_file(const struct snapidx *idx) {
+	return idx->filp;
+}
+
+bool snapidx_reset(struct snapidx *idx) {
+	return init_fresh_index(idx);
+}
+
+/**
+ *
+ * lookup and insertion
+ *
+ */
+
+int snapidx_lookup(struct snapidx *idx, u64 blknr, u64 *out_off) {
+	struct snapidx_page *pg = idx->pg;
+	u64 pgnr = bucket_page(bucket_of(&idx->hdr, blknr));
+
+	while(pgnr != 0) {
+		if(!read_idx_page(idx->filp, pgnr, pg)) {
+			return -EIO;
+		}
+
+		for(u32 i = 0; i < pg->nents; i++) {
+			if(pg->ents[i].blknr == blknr) {
+				*out_off = pg->ents[i].off;
+				return 1;
+			}
+		}
+
+		pgnr = pg->next;
+	}
+
+	return 0;
+}
+
+bool snapidx_insert(struct snapidx *idx, u64 blknr, u64 off, u64 covered_end) {
+	struct snapidx_entry ent = {
+		.blknr = blknr,
+		.off = off
+	};
+
+	if(!append_to_bucket(idx, bucket_of(&idx->hdr, blknr), &ent)) {
+		return false;
+	}
+
+	idx->hdr.nentries++;
+	idx->hdr.covered_off = covered_end;
+
+	if(needs_split(&idx->hdr) && !split_one_bucket(idx)) {
+		return false;
+	}
+
+	return write_idx_hdr(idx);
+}
+
+bool snapidx_for_each(struct snapidx *idx, bool (*fn)(u64 blknr, u64 off, void *arg), void *arg) {
+	struct snapidx_page *pg = idx->pg;
+	u64 nbuckets = nbuckets_low(&idx->hdr) + idx->hdr.split;
+
+	for(u64 b = 0; b < nbuckets; b++) {
+		u64 pgnr = bucket_page(b);
+
+		while(pgnr != 0) {
+			if(!read_idx_page(idx->filp, pgnr, pg)) {
+				return false;
+			}
+
+			for(u32 i = 0; i < pg->nents; i++) {
+				if(!fn(pg->ents[i].blknr, pg->ents[i].off, arg)) {
+					return false;
+				}
+			}
+
+			pgnr = pg->next;
+		}
+	}
+
+	return true;
+}
+
+u64 snapidx_covered(const struct snapidx *idx) {
+	return idx->hdr.covered_off;
+}
+
+bool snapidx_set_covered(struct snapidx *idx, u64 covered_end) {
+	if(idx->hdr.covered_off == covered_end) {
+		return true;
+	}
+
+	idx->hdr.covered_off = covered_end;
+	return write_idx_hdr(idx);
+}
@@ -1,6 +1,27 @@
 #include <linux/version.h>
 #include <linux/namei.h>
 #include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/fadvise.h>
+#include <linux/llist.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/delay.h>
+#include <linux/lz4.h>
+#include <linux/zstd.h>
+#include <linux/xxhash.h>
+#include <linux/hash.h>
+#include <linux/rhashtable.h>
+#include <linux/shrinker.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/crc32c.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <crypto/aead.h>
+#include <asm/local.h>
 
 #if KERNEL_VERSION(5,12,0) <= LINUX_VERSION_CODE && LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
 #include <linux/mount.h>
@@ -9,6 +30,9 @@
 #include <bdsnap/bdsnap.h>
 
 #include <devices.h>
+#include <snapshot.h>
+#include <snapblocks-index.h>
+#include <blkbitmap.h>
 #include <pr-err-failure.h>
 
 /**
@@ -229,20 +253,6 @@ static bool ensure_path_snapdir_ok(struct path **path_snapdir, const char* devna
 	}
 }
 
-/**
- *
- * initiating lru
- *
- */
-
-static inline bool ensure_cached_blocks_lru_ok(struct lru_ng **lru) {
-	if(unlikely(*lru == NULL)) {
-		return (*lru = lru_ng_alloc_and_init()) != NULL;
-	}
-
-	return true;
-}
-
 /**
  *
  * snapblock file mgmt
@@ -256,8 +266,23 @@ static inline bool ensure_cached_blocks_lru_ok(struct lru_ng **lru) {
 // simple integrity checksums or whatever you want
 enum snapblock_payload_type : u64 {
 	SNAPBLOCK_PAYLOAD_TYPE_RAW,
+	SNAPBLOCK_PAYLOAD_TYPE_LZ4,
+	SNAPBLOCK_PAYLOAD_TYPE_ZSTD,
+	SNAPBLOCK_PAYLOAD_TYPE_ZERO,
+	SNAPBLOCK_PAYLOAD_TYPE_REF,
 };
 
+// orthogonal to the type: the payload is followed by a checksum of the
+// payload, last field of the extended header (struct snapblock_csum_exthdr)
+#define SNAPBLOCK_PAYLOAD_FLAG_CRC32C (1ULL << 63)
+
+// orthogonal to the type too: the payload is the AES-GCM ciphertext of
+// the payload of that type (struct snapblock_aead_exthdr)
+#define SNAPBLOCK_PAYLOAD_FLAG_AES_GCM (1ULL << 62)
+
+#define SNAPBLOCK_PAYLOAD_TYPE_MASK \
+	(~(SNAPBLOCK_PAYLOAD_FLAG_CRC32C | SNAPBLOCK_PAYLOAD_FLAG_AES_GCM))
+
 // this is the mandatory header, self-explainatory
 //trying to have a 64-bit word memalign
 struct snapblock_file_hdr {
@@ -268,18 +293,123 @@ struct snapblock_file_hdr {
 	u64 payld_off;
 } __packed;
 
-#define DEFINE_SNAPBLOCK_FILE_HDR( \
+#define SET_SNAPBLOCK_FILE_HDR( \
 		_mand_hdr_name, \
 		__block_num, \
 		__payload_size) \
 		\
-	struct snapblock_file_hdr _mand_hdr_name; \
 	(_mand_hdr_name).magic = SNAPBLOCK_MAGIC; \
 	(_mand_hdr_name).blknr = (__block_num); \
 	(_mand_hdr_name).payldsiz = (__payload_size); \
 	(_mand_hdr_name).payld_type = SNAPBLOCK_PAYLOAD_TYPE_RAW; \
 	(_mand_hdr_name).payld_off = sizeof(struct snapblock_file_hdr)
 
+#define DEFINE_SNAPBLOCK_FILE_HDR( \
+		_mand_hdr_name, \
+		__block_num, \
+		__payload_size) \
+		\
+	struct snapblock_file_hdr _mand_hdr_name; \
+	SET_SNAPBLOCK_FILE_HDR(_mand_hdr_name, __block_num, __payload_size)
+
+// extended header of compressed payloads (LZ4 block format, zstd frame,
+// payldsiz is the compressed size) and of zero blocks (no payload at all)
+struct snapblock_rawsiz_exthdr {
+	u64 rawsiz;
+} __packed;
+
+// extended header of blocks whose content is the payload of an earlier
+// record of the same snapblocks file, which header is at ref_off
+// (absolute). No payload, the referenced record is never a reference
+struct snapblock_ref_exthdr {
+	u64 rawsiz;
+	u64 ref_off;
+} __packed;
+
+// CRC-32C (Castagnoli) of the payload as stored (e.g. compressed)
+struct snapblock_csum_exthdr {
+	u32 crc32c;
+	u32 reserved;
+} __packed;
+
+#define SNAPBLOCK_AEAD_IV_SIZE 12
+#define SNAPBLOCK_AEAD_TAG_SIZE 16
+
+// after the extended header of the type (if any), before the checksum.
+// The associated data is struct snapblock_aead_aad
+struct snapblock_aead_exthdr {
+	u8 iv[SNAPBLOCK_AEAD_IV_SIZE];
+	u8 tag[SNAPBLOCK_AEAD_TAG_SIZE];
+	u32 reserved;
+} __packed;
+
+// a ciphertext cannot be moved to another block or be reinterpreted
+struct snapblock_aead_aad {
+	u64 blknr;
+	u64 payld_type;
+} __packed;
+
+#define SNAPBLOCK_MAX_EXTHDR_SIZE \
+	(sizeof(struct snapblock_ref_exthdr) + \
+	 sizeof(struct snapblock_aead_exthdr) + \
+	 sizeof(struct snapblock_csum_exthdr))
+
+// extended header size is implied by the payload type,
+// v2 header pages have no room for anything else
+static inline size_t snapblock_exthdr_size(const struct snapblock_file_hdr *hdr) {
+	size_t size = 0;
+
+	switch(hdr->payld_type & SNAPBLOCK_PAYLOAD_TYPE_MASK) {
+		case SNAPBLOCK_PAYLOAD_TYPE_LZ4:
+		case SNAPBLOCK_PAYLOAD_TYPE_ZSTD:
+		case SNAPBLOCK_PAYLOAD_TYPE_ZERO:
+			size = sizeof(struct snapblock_rawsiz_exthdr);
+			break;
+		case SNAPBLOCK_PAYLOAD_TYPE_REF:
+			size = sizeof(struct snapblock_ref_exthdr);
+			break;
+		default:
+			break;
+	}
+
+	if(hdr->payld_type & SNAPBLOCK_PAYLOAD_FLAG_AES_GCM) {
+		size += sizeof(struct snapblock_aead_exthdr);
+	}
+
+	if(hdr->payld_type & SNAPBLOCK_PAYLOAD_FLAG_CRC32C) {
+		size += sizeof(struct snapblock_csum_exthdr);
+	}
+
+	return size;
+}
+
+// v2 format: records are written in groups, each group starts on a 4K
+// boundary with a header page (page header followed by packed record
+// headers, mandatory + extended), then payloads follow, each one on a 4K
+// boundary too (zero padded): the file can be written bypassing the page
+// cache. Payloads smaller than 4K (compressed ones, blocks of small block
+// fs) are packed one after the other after the aligned ones instead, the
+// group is zero padded up to the next 4K boundary.
+// payld_off is still relative to the record header, so it points
+// past the header page. Zeros where a header is expected are padding
+// (the file was not 4K aligned when the group was appended).
+// Both formats can coexist in the same file.
+#define SNAPBLOCKS_V2_MAGIC 0x5ade5aad5abe5af2
+#define SNAPBLOCKS_V2_ALIGN 4096
+
+struct snapblocks_v2_page_hdr {
+	u64 magic;
+	u64 nhdrs;
+} __packed;
+
+#define SNAPBLOCKS_FORMAT_V1 1
+#define SNAPBLOCKS_FORMAT_V2 2
+
+static unsigned int snapblocks_format = SNAPBLOCKS_FORMAT_V2;
+module_param(snapblocks_format, uint, 0644);
+MODULE_PARM_DESC(snapblocks_format, 
+		"format of the records appended to snapblocks: 1 (packed) or 2 (page-aligned payloads)");
+
 static inline bool read_snapblock_mandatory_header(
 		struct file *filp, 
 		struct snapblock_file_hdr *out_hdr,
@@ -301,12 +431,15 @@ static inline bool read_snapblock_mandatory_header(
 	return true;
 }
 
-static bool create_snapblocks_file(struct file **out_filp, const struct path *path_snapdir) {
+static bool create_snapdir_file(
+		const char *name, int flags,
+		struct file **out_filp, const struct path *path_snapdir) {
+
 	struct inode *par_ino = d_inode(path_snapdir->dentry);
 
 	inode_lock(par_ino);
 
-	struct dentry *d_new = new_dentry("snapblocks", path_snapdir->dentry, path_snapdir->mnt);
+	struct dentry *d_new = new_dentry(name, path_snapdir->dentry, path_snapdir->mnt);
 
 	if(IS_ERR(d_new)) {
 		pr_err_failure_with_code("new_dentry", PTR_ERR(d_new));
@@ -335,12 +468,12 @@ static bool create_snapblocks_file(struct file **out_filp, const struct path *pa
 	}
 
 	//no need to path_get or anything here
-	struct path path_new_snapblock = {
+	struct path path_new_file = {
 		.dentry = d_new,
 		.mnt = path_snapdir->mnt
 	};
 
-	*out_filp = dentry_open(&path_new_snapblock, O_RDWR | O_APPEND, current->cred);
+	*out_filp = dentry_open(&path_new_file, flags, current->cred);
 
 	dput(d_new);
 
@@ -353,77 +486,372 @@ static bool create_snapblocks_file(struct file **out_filp, const struct path *pa
 }
 
 // these are just the arguments passed to the write routine
-// for snapblocks, not the file content itself
+// for snapblocks, not the file content itself.
+// ref_rec >= 0: reference to an earlier record of the same write,
+// its offset is only known to the write routine, which fills ref_off
+// of the (struct snapblock_ref_exthdr) extended header
 struct write_snapblock_args {
 	const struct snapblock_file_hdr* mandatory_hdr;
 	const void* extended_hdr;
 	size_t extended_hdr_size;
 	const void* payload;
 	size_t payload_size;
+	ssize_t ref_rec;
 };
 
-#define DEFINE_WRITE_SNAPBLOCK_ARGS( \
+#define SET_WRITE_SNAPBLOCK_ARGS( \
 		_args_name, \
 		__mand_hdr, \
 		__payload, \
 		__payload_size) \
 		\
-	struct write_snapblock_args _args_name; \
 	(_args_name).mandatory_hdr = (__mand_hdr); \
 	(_args_name).extended_hdr = NULL; \
 	(_args_name).extended_hdr_size = 0; \
 	(_args_name).payload = ((const void*)(__payload)); \
-	(_args_name).payload_size = (__payload_size)
+	(_args_name).payload_size = (__payload_size); \
+	(_args_name).ref_rec = -1
 
-static bool write_snapblock(struct file *filp, const struct write_snapblock_args *wargs) {
-	size_t wrote;
-	bool rv = false;
+#define DEFINE_WRITE_SNAPBLOCK_ARGS( \
+		_args_name, \
+		__mand_hdr, \
+		__payload, \
+		__payload_size) \
+		\
+	struct write_snapblock_args _args_name; \
+	SET_WRITE_SNAPBLOCK_ARGS(_args_name, __mand_hdr, __payload, __payload_size)
+
+static inline size_t snapblock_record_size(const struct write_snapblock_args *wargs) {
+	return sizeof(struct snapblock_file_hdr) + wargs->extended_hdr_size + wargs->payload_size;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+#	define MY_ITER_SOURCE ITER_SOURCE
+#else
+#	define MY_ITER_SOURCE WRITE
+#endif
+
+// mandatory header, extended header, payload
+#define SNAPBLOCK_MAX_KVECS_PER_RECORD 3
 
-	size_t mandatory_hdr_size = sizeof(struct snapblock_file_hdr);
+// v2: header page (at most one per record), payload, padding
+#define SNAPBLOCK_MAX_BVECS_PER_RECORD 3
 
-	wrote = kernel_write(
-			filp, wargs->mandatory_hdr, mandatory_hdr_size, NULL);
-	if(wrote != mandatory_hdr_size) {
-		pr_err_failure_with_code("kernel_write", wrote);
-		goto __write_snapblock_finish0;
+// v2: header page (at most one per record) and page for packed payloads
+// (at most one per record, packed payloads are smaller than a page)
+#define SNAPBLOCK_MAX_V2_PAGES_PER_RECORD 2
+
+static ssize_t snapblocks_iter_write(struct file *filp, struct iov_iter *iter, loff_t *pos) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+	file_start_write(filp);
+#endif
+
+	ssize_t wrote = vfs_iter_write(filp, iter, pos, 0);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,7,0)
+	file_end_write(filp);
+#endif
+
+	return wrote;
+}
+
+// a torn record in the middle would make the rest of snapblocks unreadable
+static void snapblocks_undo_write(struct file *filp, loff_t start) {
+	int err = vfs_truncate(&filp->f_path, start);
+	if(err != 0) {
+		pr_err_failure_with_code("vfs_truncate", err);
 	}
+}
 
-	if(wargs->extended_hdr != NULL && wargs->extended_hdr_size > 0) {
+// v1: all of the records go to the file with one single vectored write,
+// kv must have room for SNAPBLOCK_MAX_KVECS_PER_RECORD * nrecs kvecs.
+// On short writes the file is truncated back to where it was.
+// rec_offs gets where each record header landed
+static bool write_snapblocks(
+		struct file *filp, 
+		const struct write_snapblock_args *wargs, 
+		size_t nrecs, 
+		struct kvec *kv,
+		u64 *rec_offs) {
 
-		wrote = kernel_write(
-				filp, wargs->extended_hdr, wargs->extended_hdr_size, NULL);
-		if(wrote != wargs->extended_hdr_size) {
-			pr_err_failure_with_code("kernel_write", wrote);
-			goto __write_snapblock_finish0;
+	size_t nkv = 0;
+	size_t total = 0;
+
+	loff_t start = i_size_read(file_inode(filp));
+
+	for(size_t i = 0; i < nrecs; i++) {
+		rec_offs[i] = start + total;
+
+		kv[nkv].iov_base = (void*) wargs[i].mandatory_hdr;
+		kv[nkv++].iov_len = sizeof(struct snapblock_file_hdr);
+
+		if(wargs[i].extended_hdr != NULL && wargs[i].extended_hdr_size > 0) {
+			kv[nkv].iov_base = (void*) wargs[i].extended_hdr;
+			kv[nkv++].iov_len = wargs[i].extended_hdr_size;
+
+			if(wargs[i].ref_rec >= 0) {
+				((struct snapblock_ref_exthdr*) kv[nkv - 1].iov_base)->ref_off = 
+					rec_offs[wargs[i].ref_rec];
+			}
+		}
+
+		if(wargs[i].payload_size > 0) {
+			kv[nkv].iov_base = (void*) wargs[i].payload;
+			kv[nkv++].iov_len = wargs[i].payload_size;
 		}
+
+		total += snapblock_record_size(&wargs[i]);
 	}
 
-	wrote = kernel_write(
-			filp, wargs->payload, wargs->payload_size, NULL);
-	if(wrote != wargs->payload_size) {
-		pr_err_failure_with_code("kernel_write", wrote);
-		goto __write_snapblock_finish0;
+	struct iov_iter iter;
+	iov_iter_kvec(&iter, MY_ITER_SOURCE, kv, nkv, total);
+
+	loff_t pos = start;
+	ssize_t wrote = snapblocks_iter_write(filp, &iter, &pos);
+
+	if(likely(wrote == (ssize_t) total)) {
+		return true;
 	}
 
-	rv = true;
+	pr_err_failure_with_code("vfs_iter_write", wrote);
 
-__write_snapblock_finish0:
-	return rv;
+	if(wrote > 0) {
+		snapblocks_undo_write(filp, start);
+	}
+
+	return false;
 }
 
-static bool file_lookup(u64 blknr, struct file *filp) {
-	struct snapblock_file_hdr blk_header;
-	loff_t foff = 0;
+static inline void set_v2_bvec(struct bio_vec *bv, const void *buf, size_t len) {
+	bv->bv_page = virt_to_page(buf);
+	bv->bv_offset = offset_in_page(buf);
+	bv->bv_len = len;
+}
 
-	while(read_snapblock_mandatory_header(filp, &blk_header, foff)) {
-		if(blk_header.blknr == blknr) {
-			return true;
+static inline bool v2_payload_is_packed(const struct write_snapblock_args *wargs) {
+	return wargs->payload_size < SNAPBLOCKS_V2_ALIGN;
+}
+
+static struct page *alloc_v2_page(struct page **pages, size_t *npages, struct bio_vec *bv) {
+	struct page *page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if(page == NULL) {
+		pr_err_failure("alloc_page");
+		return NULL;
+	}
+
+	pages[(*npages)++] = page;
+
+	bv->bv_page = page;
+	bv->bv_offset = 0;
+	bv->bv_len = SNAPBLOCKS_V2_ALIGN;
+
+	return page;
+}
+
+// lays the records out in v2 groups starting at gstart, header pages and
+// pages for packed payloads are allocated here (pages, at most
+// SNAPBLOCK_MAX_V2_PAGES_PER_RECORD * nrecs of them) and freed by the caller
+static ssize_t layout_snapblocks_v2(
+		loff_t gstart,
+		const struct write_snapblock_args *wargs, 
+		size_t nrecs, 
+		struct bio_vec *bv,
+		size_t *out_nbv,
+		struct page **pages,
+		u64 *rec_offs) {
+
+	size_t nbv = 0;
+	size_t npages = 0;
+	loff_t off = gstart;
+	size_t i = 0;
+
+	while(i < nrecs) {
+		struct page *hpage = alloc_v2_page(pages, &npages, &bv[nbv++]);
+		if(hpage == NULL) {
+			return -ENOMEM;
+		}
+
+		char *hbuf = page_address(hpage);
+		struct snapblocks_v2_page_hdr *phdr = (struct snapblocks_v2_page_hdr*) hbuf;
+		size_t used = sizeof(struct snapblocks_v2_page_hdr);
+		loff_t poff = off + SNAPBLOCKS_V2_ALIGN;
+		size_t j = i;
+
+		phdr->magic = SNAPBLOCKS_V2_MAGIC;
+		phdr->nhdrs = 0;
+
+		//headers, and aligned payloads right after the header page
+		for(; j < nrecs; j++) {
+			size_t hsize = sizeof(struct snapblock_file_hdr) + wargs[j].extended_hdr_size;
+			if(used + hsize > SNAPBLOCKS_V2_ALIGN) {
+				break;
+			}
+
+			struct snapblock_file_hdr *hdr = (struct snapblock_file_hdr*) (hbuf + used);
+			memcpy(hdr, wargs[j].mandatory_hdr, sizeof(struct snapblock_file_hdr));
+
+			rec_offs[j] = off + used;
+
+			if(wargs[j].extended_hdr_size > 0) {
+				void *ehdr = hbuf + used + sizeof(struct snapblock_file_hdr);
+				memcpy(ehdr, wargs[j].extended_hdr, wargs[j].extended_hdr_size);
+
+				if(wargs[j].ref_rec >= 0) {
+					((struct snapblock_ref_exthdr*) ehdr)->ref_off = rec_offs[wargs[j].ref_rec];
+				}
+			}
+
+			used += hsize;
+			phdr->nhdrs++;
+
+			if(v2_payload_is_packed(&wargs[j])) {
+				continue;
+			}
+
+			hdr->payld_off = poff - rec_offs[j];
+
+			set_v2_bvec(&bv[nbv++], wargs[j].payload, wargs[j].payload_size);
+
+			size_t padded = round_up(wargs[j].payload_size, SNAPBLOCKS_V2_ALIGN);
+			if(padded > wargs[j].payload_size) {
+				bv[nbv].bv_page = ZERO_PAGE(0);
+				bv[nbv].bv_offset = 0;
+				bv[nbv++].bv_len = padded - wargs[j].payload_size;
+			}
+
+			poff += padded;
+		}
+
+		//then packed payloads, copied into zeroed pages
+		char *pbuf = NULL;
+		size_t packed = 0;
+
+		for(; i < j; i++) {
+			if(!v2_payload_is_packed(&wargs[i])) {
+				continue;
+			}
+
+			struct snapblock_file_hdr *hdr = (struct snapblock_file_hdr*) (hbuf + (rec_offs[i] - off));
+			hdr->payld_off = poff + packed - rec_offs[i];
+
+			const char *src = wargs[i].payload;
+			size_t left = wargs[i].payload_size;
+
+			while(left > 0) {
+				size_t pgoff = packed % SNAPBLOCKS_V2_ALIGN;
+
+				if(pgoff == 0) {
+					struct page *ppage = alloc_v2_page(pages, &npages, &bv[nbv++]);
+					if(ppage == NULL) {
+						return -ENOMEM;
+					}
+
+					pbuf = page_address(ppage);
+				}
+
+				size_t chunk = min_t(size_t, left, SNAPBLOCKS_V2_ALIGN - pgoff);
+				memcpy(pbuf + pgoff, src, chunk);
+
+				src += chunk;
+				left -= chunk;
+				packed += chunk;
+			}
 		}
 
-		foff += blk_header.payld_off + blk_header.payldsiz;
+		off = poff + round_up(packed, SNAPBLOCKS_V2_ALIGN);
 	}
 
-	return false;
+	*out_nbv = nbv;
+	return off - gstart;
+}
+
+// v2: same as v1, but through O_DIRECT (dio_filp) when possible: the page
+// cache is not polluted by snapblocks. Otherwise buffered, and the written
+// range is dropped from the page cache as soon as it hits the disk
+static bool write_snapblocks_v2(
+		struct file *filp, 
+		struct file **dio_filp, 
+		const struct write_snapblock_args *wargs, 
+		size_t nrecs, 
+		struct bio_vec *bv,
+		struct page **pages,
+		u64 *rec_offs) {
+
+	bool rv = false;
+	loff_t start = i_size_read(file_inode(filp));
+	loff_t gstart = round_up(start, SNAPBLOCKS_V2_ALIGN);
+	size_t maxpages = SNAPBLOCK_MAX_V2_PAGES_PER_RECORD * nrecs;
+
+	memset(pages, 0, sizeof(struct page*) * maxpages);
+
+	size_t nbv;
+	ssize_t total = layout_snapblocks_v2(gstart, wargs, nrecs, bv, &nbv, pages, rec_offs);
+	if(total < 0) {
+		goto __write_snapblocks_v2_finish0;
+	}
+
+	ssize_t wrote;
+
+	if(gstart > start) {
+		//buffered, zero page is enough: less than 4K
+		loff_t pos = start;
+		wrote = kernel_write(filp, page_address(ZERO_PAGE(0)), gstart - start, &pos);
+		if(wrote != gstart - start) {
+			pr_err_failure_with_code("kernel_write", wrote);
+			goto __write_snapblocks_v2_finish1;
+		}
+	}
+
+	struct iov_iter iter;
+	loff_t pos = gstart;
+	wrote = -EINVAL;
+
+	if(*dio_filp != NULL) {
+		iov_iter_bvec(&iter, MY_ITER_SOURCE, bv, nbv, total);
+		wrote = snapblocks_iter_write(*dio_filp, &iter, &pos);
+
+		if(wrote == -EINVAL) {
+			//alignment constraints of the underlying device are stricter
+			//than ours (e.g. odd block sizes), no point in trying again
+			pr_warn("%s: O_DIRECT write refused, snapblocks goes through the page cache\n",
+					module_name(THIS_MODULE));
+
+			fput(*dio_filp);
+			*dio_filp = NULL;
+		}
+	}
+
+	if(*dio_filp == NULL && wrote < 0) {
+		pos = gstart;
+		iov_iter_bvec(&iter, MY_ITER_SOURCE, bv, nbv, total);
+		wrote = snapblocks_iter_write(filp, &iter, &pos);
+
+		if(wrote == total) {
+			int err = vfs_fadvise(filp, gstart, total, POSIX_FADV_DONTNEED);
+			if(err != 0) {
+				pr_err_failure_with_code("vfs_fadvise", err);
+			}
+		}
+	}
+
+	if(likely(wrote == total)) {
+		rv = true;
+		goto __write_snapblocks_v2_finish0;
+	}
+
+	pr_err_failure_with_code("vfs_iter_write", wrote);
+
+__write_snapblocks_v2_finish1:
+	if(i_size_read(file_inode(filp)) > start) {
+		snapblocks_undo_write(filp, start);
+	}
+
+__write_snapblocks_v2_finish0:
+	for(size_t i = 0; i < maxpages && pages[i] != NULL; i++) {
+		__free_page(pages[i]);
+	}
+
+	return rv;
 }
 
 /**
@@ -432,204 +860,2620 @@ static bool file_lookup(u64 blknr, struct file *filp) {
  *
  */
 
-static bool ensure_snapblocks_file_ok(const struct path *path_snapdir, struct file **out_filp) {
-	struct path path_snapblocks;
+static bool ensure_snapdir_file_ok(
+		const struct path *path_snapdir, const char *name, 
+		int flags, struct file **out_filp) {
 
-	if(vfs_path_lookup(path_snapdir->dentry, path_snapdir->mnt, "snapblocks", 0, &path_snapblocks) == 0) {
-		if(!d_is_file(path_snapblocks.dentry)) {
+	struct path path_file;
+
+	if(vfs_path_lookup(path_snapdir->dentry, path_snapdir->mnt, name, 0, &path_file) == 0) {
+		if(!d_is_file(path_file.dentry)) {
 			pr_err("%s: **PAY ATTENTION HERE**\n"
-					"found existing object, \"snapblocks\", "
+					"found existing object, \"%s\", "
 					"expecting it to be a regular file, but it is not.\n"
 					"This is a human-made mistake.\n"
 					"Manual intervention is required:\n"
-					"issuing \"rm snapblocks [...whatever rmflags needed here...]\" "
+					"issuing \"rm %s [...whatever rmflags needed here...]\" "
 					"(from cwd of containing dir)\n"
 					"should be enough to allow auto fixing\n",
-					module_name(THIS_MODULE));
+					module_name(THIS_MODULE), name, name);
+			path_put(&path_file);
 			return false;
 		}
 
-		*out_filp = dentry_open(&path_snapblocks, O_RDWR | O_APPEND, current->cred);
-		path_put(&path_snapblocks);
+		*out_filp = dentry_open(&path_file, flags, current->cred);
+		path_put(&path_file);
+
+		if(IS_ERR(*out_filp)) {
+			pr_err_failure_with_code("dentry_open", PTR_ERR(*out_filp));
+			return false;
+		}
 
 		return true;
 	}
 
-	return create_snapblocks_file(out_filp, path_snapdir);
+	return create_snapdir_file(name, flags, out_filp, path_snapdir);
 }
-/**
- *
- * snapshot deferred work
- *
- */
 
-struct make_snapshot_work {
-	sector_t block_nr;
-	u64 blocksize;
-	char* block;
-	struct path **path_snapdir;
-	struct lru_ng **cached_blocks;
-	char original_dev_name[PATH_MAX];
-	char first_mount_date[MNT_FMT_DATE_LEN + 1];
-	struct work_struct work;
-};
+// cheap check for a file opened once and kept open: still linked
+// and still in the (current) snapdir, which may have been rebuilt
+static inline bool snapdir_file_is_live(const struct file *filp, const struct path *path_snapdir) {
+	struct dentry *dent = filp->f_path.dentry;
 
-static void make_snapshot(struct work_struct *work) {
-	struct make_snapshot_work *msw_args =
-		container_of(work, struct make_snapshot_work, work);
+	return 
+		d_inode(dent)->i_nlink > 0 &&
+		!d_unhashed(dent) &&
+		READ_ONCE(dent->d_parent) == path_snapdir->dentry;
+}
 
-	if(!ensure_cached_blocks_lru_ok(
-				msw_args->cached_blocks)) {
-		goto __make_snapshot_finish0;
-	}
+// *filp is kept open across batches, *reopened tells the caller
+// that everything derived from the previous file is stale.
+// *dio_filp is the same file opened with O_DIRECT, for v2 records,
+// it stays NULL if the filesystem does not support it
+static bool ensure_snapblocks_file_ok(
+		const struct path *path_snapdir, const char *name,
+		struct file **filp, struct file **dio_filp, 
+		bool *reopened) {
 
-	if(lru_ng_lookup(
-				*msw_args->cached_blocks, 
-				msw_args->block_nr)) {
-		goto __make_snapshot_finish0;
-	}
+	*reopened = false;
 
-	if(!ensure_path_snapdir_ok(
-				msw_args->path_snapdir, 
-				msw_args->original_dev_name, 
-				msw_args->first_mount_date)) {
-		goto __make_snapshot_finish0;
-	}
+	if(likely(*filp != NULL)) {
+		if(likely(snapdir_file_is_live(*filp, path_snapdir))) {
+			return true;
+		}
 
-	struct file *snapblocks_filp;
-	if(!ensure_snapblocks_file_ok(
-				*msw_args->path_snapdir,
-				&snapblocks_filp)) {
-		goto __make_snapshot_finish0;
-	}
+		pr_warn("%s: existing snapblocks file is broken, reopening it...\n",
+				module_name(THIS_MODULE));
 
-	if(file_lookup(
-				msw_args->block_nr, 
-				snapblocks_filp))  {
-		goto __make_snapshot_finish2;
+		fput(*filp);
+		*filp = NULL;
 	}
 
-	DEFINE_SNAPBLOCK_FILE_HDR(file_hdr, 
-			msw_args->block_nr, 
-			msw_args->blocksize);
+	if(*dio_filp != NULL) {
+		fput(*dio_filp);
+		*dio_filp = NULL;
+	}
 
-	DEFINE_WRITE_SNAPBLOCK_ARGS(wargs, 
-			&file_hdr, 
-			msw_args->block, 
-			msw_args->blocksize);
+	if(!ensure_snapdir_file_ok(
+				path_snapdir, name, O_RDWR | O_APPEND | O_LARGEFILE, filp)) {
+		*filp = NULL;
+		return false;
+	}
 
-	if(write_snapblock(
-				snapblocks_filp, 
-				&wargs) != 0) {
-		goto __make_snapshot_finish1;
+	*dio_filp = dentry_open(&(*filp)->f_path, O_WRONLY | O_DIRECT | O_LARGEFILE, current_cred());
+	if(IS_ERR(*dio_filp)) {
+		pr_info("%s: no O_DIRECT for snapblocks (%ld), using the page cache\n",
+				module_name(THIS_MODULE), PTR_ERR(*dio_filp));
+		*dio_filp = NULL;
 	}
 
-__make_snapshot_finish2:
-	lru_ng_add(*msw_args->cached_blocks, msw_args->block_nr);
-__make_snapshot_finish1:
-	fput(snapblocks_filp);
-__make_snapshot_finish0:
-	kfree(msw_args->block);
-	kfree(msw_args);
+	*reopened = true;
+	return true;
 }
 
 /**
  *
- * deferred work caller
+ * snapblocks index
  *
  */
 
-static bool queue_snapshot_work(
-		struct object_data *obj, const char* blk, 
-		sector_t blknr, unsigned blksize) {
+// records whose header is at hdr_off, resume_off is where to
+// restart scanning from if this is the last one indexed
+static inline bool catch_up_record(
+		struct snapidx *idx, u64 blknr, loff_t hdr_off, loff_t resume_off) {
 
-	if(obj->e == NULL) {
-		//should never happen, but who knows...
+	u64 unused_off;
+	int found = snapidx_lookup(idx, blknr, &unused_off);
+	if(found < 0) {
 		return false;
 	}
 
-	struct make_snapshot_work *msw = 
-		 kmalloc(sizeof(struct make_snapshot_work), GFP_ATOMIC);
-	if(msw == NULL) {
-		return false;
+	return found != 0 || snapidx_insert(idx, blknr, hdr_off, resume_off);
+}
+
+// a whole v2 group starting at foff, false on I/O errors only:
+// *out_end is left untouched if the group is torn or broken
+static bool catch_up_v2_group(
+		struct snapidx *idx, struct file *snapblocks_filp, 
+		char *pgbuf, loff_t foff, loff_t fsize, loff_t *out_end) {
+
+	loff_t pos = foff;
+	if(kernel_read(snapblocks_filp, pgbuf, SNAPBLOCKS_V2_ALIGN, &pos) != SNAPBLOCKS_V2_ALIGN) {
+		return true;
 	}
 
-	msw->block = kmalloc(sizeof(char) * blksize, GFP_ATOMIC);
-	if(msw->block == NULL) {
-		kfree(msw);
-		return false;
+	struct snapblocks_v2_page_hdr *phdr = (struct snapblocks_v2_page_hdr*) pgbuf;
+	loff_t gend = foff + SNAPBLOCKS_V2_ALIGN;
+	size_t used = sizeof(struct snapblocks_v2_page_hdr);
+
+	//validate the whole group first, it is indexed only if complete
+	for(u64 i = 0; i < phdr->nhdrs; i++) {
+		struct snapblock_file_hdr *hdr = (struct snapblock_file_hdr*) (pgbuf + used);
+		if(used + sizeof(struct snapblock_file_hdr) > SNAPBLOCKS_V2_ALIGN || hdr->magic != SNAPBLOCK_MAGIC) {
+			return true;
+		}
+
+		gend = max_t(loff_t, gend, 
+				round_up(foff + used + hdr->payld_off + hdr->payldsiz, SNAPBLOCKS_V2_ALIGN));
+		used += sizeof(struct snapblock_file_hdr) + snapblock_exthdr_size(hdr);
+	}
+
+	if(gend > fsize) {
+		return true;
 	}
 
-	INIT_WORK(&msw->work, make_snapshot);
-	msw->block_nr = blknr;
-	msw->blocksize = blksize;
-	msw->path_snapdir = &obj->e->path_snapdir;
-	msw->cached_blocks = &obj->e->cached_blocks;
-	memcpy(msw->first_mount_date, obj->e->first_mount_date, MNT_FMT_DATE_LEN + 1);
-	strscpy(msw->original_dev_name, obj->original_dev_name, PATH_MAX);
-	memcpy(msw->block, blk, sizeof(char) * blksize);
+	used = sizeof(struct snapblocks_v2_page_hdr);
+
+	for(u64 i = 0; i < phdr->nhdrs; i++) {
+		struct snapblock_file_hdr *hdr = (struct snapblock_file_hdr*) (pgbuf + used);
+
+		if(!catch_up_record(idx, hdr->blknr, foff + used, i + 1 == phdr->nhdrs ? gend : foff)) {
+			return false;
+		}
 
-	bool retval;
-	if(!(retval = queue_work(obj->wq, &msw->work))) {
-		kfree(msw->block);
-		kfree(msw);
+		used += sizeof(struct snapblock_file_hdr) + snapblock_exthdr_size(hdr);
 	}
 
-	return retval;
+	*out_end = gend;
+	return true;
 }
 
-/**
- *
- * exported fns, the ones which the FS-specific part implementor should use
- *
- */
+// indexes records appended to snapblocks but not yet known to the index:
+// crash right after the payload write, a rebuilt index, or a snapblocks
+// file written by a module version which did not have the index at all.
+// If everything is in sync, this is just a comparison
+static bool catch_up_snapblocks_index(struct snapidx *idx, struct file *snapblocks_filp) {
+	struct snapblock_file_hdr blk_header;
+	loff_t foff = snapidx_covered(idx);
+	loff_t fsize = i_size_read(file_inode(snapblocks_filp));
+	char *pgbuf = NULL;
+	bool rv = false;
 
-void* bdsnap_search_device(
-		const struct block_device* bdev) {
+	if(likely(foff == fsize)) {
+		return true;
+	}
 
-	struct mountinfo minfo;
-	from_block_device_to_mountinfo(&minfo, bdev);
+	if(unlikely(foff > fsize)) {
+		//indexes some other (removed) snapblocks file
+		pr_warn("%s: snapblocks index is out of sync, rebuilding it...\n",
+				module_name(THIS_MODULE));
 
-	struct object_data *data = get_device_data_always(&minfo);
-	if(data == NULL) {
-		return NULL;
+		if(!snapidx_reset(idx)) {
+			return false;
+		}
+
+		foff = 0;
 	}
 
-	bool not_valid =
-		data->e == NULL ||
-		data->wq_is_destroyed;
+	while(foff < fsize) {
+		u64 magic;
+		loff_t pos = foff;
+		if(kernel_read(snapblocks_filp, &magic, sizeof(u64), &pos) != sizeof(u64)) {
+			break;
+		}
 
-	if(unlikely(not_valid)) {
-		return NULL;
-	}
+		if(magic == 0) {
+			//v2 padding
+			foff = min_t(loff_t, round_up(foff + 1, SNAPBLOCKS_V2_ALIGN), fsize);
+			continue;
+		}
 
-	return (void*) data;
-}
+		if(magic == SNAPBLOCKS_V2_MAGIC) {
+			if(pgbuf == NULL && (pgbuf = kmalloc(SNAPBLOCKS_V2_ALIGN, GFP_KERNEL)) == NULL) {
+				pr_err_failure("kmalloc");
+				goto __catch_up_snapblocks_index_finish0;
+			}
 
-EXPORT_SYMBOL_GPL(bdsnap_search_device);
+			loff_t gend = foff;
+			if(!catch_up_v2_group(idx, snapblocks_filp, pgbuf, foff, fsize, &gend)) {
+				goto __catch_up_snapblocks_index_finish0;
+			}
 
-bool bdsnap_make_snapshot(
-		void* handle, const char* block, 
-		sector_t blocknr, u64 blocksize) {
+			if(gend == foff) {
+				//torn group at the tail
+				break;
+			}
 
-	struct object_data *data = (struct object_data*) handle;
-	bool ret = false;
+			foff = gend;
+			continue;
+		}
 
-	bool valid = 
-		data != NULL && 
-		data->e != NULL &&
-		!data->wq_is_destroyed;
+		if(!read_snapblock_mandatory_header(snapblocks_filp, &blk_header, foff)) {
+			break;
+		}
+
+		loff_t recend = foff + blk_header.payld_off + blk_header.payldsiz;
+		if(recend > fsize) {
+			//torn record at the tail
+			break;
+		}
 
-	if(likely(valid)) {
-		unsigned long flags;
-		read_lock_irqsave(&data->wq_destroy_lock, flags);
-		if(!data->wq_is_destroyed) {
-			ret = queue_snapshot_work(data, block, blocknr, blocksize);
+		if(!catch_up_record(idx, blk_header.blknr, foff, recend)) {
+			goto __catch_up_snapblocks_index_finish0;
 		}
-		read_unlock_irqrestore(&data->wq_destroy_lock, flags);
+
+		foff = recend;
 	}
 
-	return ret;
+	rv = snapidx_set_covered(idx, foff);
+
+__catch_up_snapblocks_index_finish0:
+	kfree(pgbuf);
+	return rv;
 }
 
-EXPORT_SYMBOL_GPL(bdsnap_make_snapshot);
+// like snapblocks, *idx is kept open across batches
+static bool ensure_snapblocks_index_ok(
+		const struct path *path_snapdir, const char *name,
+		struct file *snapblocks_filp, 
+		struct snapidx **idx) {
+
+	if(*idx != NULL && !snapdir_file_is_live(snapidx_file(*idx), path_snapdir)) {
+		pr_warn("%s: existing snapblocks index is broken, reopening it...\n",
+				module_name(THIS_MODULE));
+
+		snapidx_close(*idx);
+		*idx = NULL;
+	}
+
+	if(*idx == NULL) {
+		struct file *idx_filp;
+		if(!ensure_snapdir_file_ok(
+					path_snapdir, name, O_RDWR | O_LARGEFILE, &idx_filp)) {
+			return false;
+		}
+
+		//idx_filp is owned by the index from now on
+		*idx = snapidx_open(idx_filp);
+		if(*idx == NULL) {
+			pr_err_failure("snapidx_open");
+			return false;
+		}
+	}
+
+	if(!catch_up_snapblocks_index(*idx, snapblocks_filp)) {
+		pr_err_failure("catch_up_snapblocks_index");
+		snapidx_close(*idx);
+		*idx = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ *
+ * memory budget
+ *
+ * in-flight captures (descriptor and block copy, whether in a ring slot,
+ * in an overflow buffer or in a page handed over) and dedup entries of
+ * all the epochs are charged to a single module-wide budget. A capture
+ * over budget is refused, exactly as if it could not be allocated: the
+ * block is missing from the snapshot and the epoch tells how many were
+ * at cleanup. Dedup tables just stop growing, and they are trimmed by
+ * a shrinker under memory pressure (see deduplication). Captured blocks
+ * sets are counted too, unconditionally: they must know every block
+ * written out, so they are never refused nor trimmed, but they leave
+ * less of the budget to captures
+ *
+ */
+
+static unsigned int memory_budget_mb = 256;
+module_param(memory_budget_mb, uint, 0644);
+MODULE_PARM_DESC(memory_budget_mb, 
+		"memory for in-flight captures, dedup entries and captured blocks sets of all the epochs, in MB, 0 means no limit");
+
+static atomic_long_t memory_used = ATOMIC_LONG_INIT(0);
+static atomic_long_t captures_over_budget = ATOMIC_LONG_INIT(0);
+
+static int param_get_atomic_long(char *buffer, const struct kernel_param *kp) {
+	return sysfs_emit(buffer, "%ld\n", atomic_long_read((atomic_long_t*) kp->arg));
+}
+
+static const struct kernel_param_ops atomic_long_ro_ops = {
+	.get = param_get_atomic_long,
+};
+
+module_param_cb(memory_used, &atomic_long_ro_ops, &memory_used, 0444);
+MODULE_PARM_DESC(memory_used, "bytes currently charged to memory_budget_mb");
+
+module_param_cb(captures_over_budget, &atomic_long_ro_ops, &captures_over_budget, 0444);
+MODULE_PARM_DESC(captures_over_budget, "captures refused because memory_budget_mb was exhausted");
+
+//atomic context allowed, a racing charge may be refused for a moment
+//when both would fit: never the other way around
+static bool memory_try_charge(size_t size) {
+	//4095TB at most: no overflow, not even on 32 bits
+	s64 budget = (s64) READ_ONCE(memory_budget_mb) << 20;
+	s64 used = atomic_long_add_return(size, &memory_used);
+
+	if(budget != 0 && used > budget) {
+		atomic_long_sub(size, &memory_used);
+		return false;
+	}
+
+	return true;
+}
+
+static inline void memory_uncharge(size_t size) {
+	atomic_long_sub(size, &memory_used);
+}
+
+/**
+ *
+ * captured blocks set
+ *
+ */
+
+static bool seed_captured_block(u64 blknr, u64 __always_unused off, void *arg) {
+	return blkbitmap_set((struct blkbitmap*) arg, blknr);
+}
+
+// the set is exact, so it must know about every block already in
+// snapblocks, if any (e.g. existing snapdir or set dropped after a failure)
+static bool ensure_captured_blocks_ok(struct blkbitmap **captured, struct snapidx *idx) {
+	if(likely(*captured != NULL)) {
+		return true;
+	}
+
+	*captured = blkbitmap_alloc_and_init(&memory_used);
+	if(*captured == NULL) {
+		pr_err_failure("blkbitmap_alloc_and_init");
+		return false;
+	}
+
+	if(!snapidx_for_each(idx, seed_captured_block, *captured)) {
+		pr_err_failure("snapidx_for_each");
+		blkbitmap_cleanup_and_destroy(*captured);
+		*captured = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ *
+ * capture claims
+ *
+ * the capture side view of the captured blocks set: a fixed size, lock-free
+ * open addressing set of the blocks captured or in flight during the epoch,
+ * so that writes to a block already covered skip the copy and the capture
+ * altogether (see bdsnap_block_needs_snapshot).
+ *
+ * It never says a block is covered when it is not (the blkbitmap above
+ * stays the exact truth for the writer): a full set, or one still to be
+ * allocated, only means captures go the usual way. Slots are never reused,
+ * a block goes from empty to claimed and, if its capture could not be
+ * pushed, to released. The writer learns about blocks captured before the
+ * set existed, and drops the set whenever a batch is lost.
+ *
+ */
+
+#define CAPTURE_CLAIMS_MAX_SLOTS (1U << 20)
+#define CAPTURE_CLAIMS_MAX_PROBES 16
+
+#define CAPTURE_CLAIM_EMPTY 0ULL
+#define CAPTURE_CLAIM_RELEASED U64_MAX
+
+static unsigned int capture_claims_slots = 8192;
+module_param(capture_claims_slots, uint, 0444);
+MODULE_PARM_DESC(capture_claims_slots, 
+		"number of blocks per epoch the capture side can tell as covered (rounded up to a power of 2, 0 disables)");
+
+struct snapshot_claims {
+	struct rcu_head rcu;
+	u32 bits;
+	u32 mask;
+	//CAPTURE_CLAIM_EMPTY, CAPTURE_CLAIM_RELEASED or block number + 1
+	u64 slots[];
+};
+
+static struct snapshot_claims *snapshot_claims_alloc(void) {
+	u32 nslots = roundup_pow_of_two(
+			min_t(unsigned int, capture_claims_slots, CAPTURE_CLAIMS_MAX_SLOTS));
+
+	struct snapshot_claims *cl = kvzalloc(struct_size(cl, slots, nslots), GFP_KERNEL);
+	if(cl == NULL) {
+		pr_err_failure("kvzalloc");
+		return NULL;
+	}
+
+	cl->bits = ilog2(nslots);
+	cl->mask = nslots - 1;
+
+	return cl;
+}
+
+//capture side readers are under RCU
+void snapshot_claims_destroy(struct snapshot_claims *cl) {
+	kvfree_rcu(cl, rcu);
+}
+
+static inline u64 claim_key_of(sector_t blknr) {
+	return (u64) blknr + 1;
+}
+
+static bool claims_test(const struct snapshot_claims *cl, sector_t blknr) {
+	u64 key = claim_key_of(blknr);
+	u32 pos = hash_64(key, cl->bits);
+
+	for(u32 i = 0; i < CAPTURE_CLAIMS_MAX_PROBES; i++) {
+		u64 v = READ_ONCE(cl->slots[(pos + i) & cl->mask]);
+		if(v == key) {
+			return true;
+		}
+
+		if(v == CAPTURE_CLAIM_EMPTY) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+// 1 if claimed now, 0 if already claimed, < 0 if there is no room
+static int claims_claim(struct snapshot_claims *cl, sector_t blknr) {
+	u64 key = claim_key_of(blknr);
+	u32 pos = hash_64(key, cl->bits);
+
+	for(u32 i = 0; i < CAPTURE_CLAIMS_MAX_PROBES; i++) {
+		u64 *slot = &cl->slots[(pos + i) & cl->mask];
+		u64 v = READ_ONCE(*slot);
+
+		//slots only move forward: whoever races for the same
+		//empty slot with the same block sees the winner key
+		if(v == CAPTURE_CLAIM_EMPTY) {
+			v = cmpxchg64(slot, CAPTURE_CLAIM_EMPTY, key);
+			if(v == CAPTURE_CLAIM_EMPTY) {
+				return 1;
+			}
+		}
+
+		if(v == key) {
+			return 0;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+// only by whoever got 1 from claims_claim (or its batch, once dropped)
+static void claims_release(struct snapshot_claims *cl, sector_t blknr) {
+	u64 key = claim_key_of(blknr);
+	u32 pos = hash_64(key, cl->bits);
+
+	for(u32 i = 0; i < CAPTURE_CLAIMS_MAX_PROBES; i++) {
+		u64 *slot = &cl->slots[(pos + i) & cl->mask];
+
+		if(READ_ONCE(*slot) == key) {
+			WRITE_ONCE(*slot, CAPTURE_CLAIM_RELEASED);
+			return;
+		}
+	}
+}
+
+// shared by the shards of the epoch: replaced under shared_lock,
+// used by the shards (as by the capture side) under RCU
+static inline struct snapshot_claims *epoch_claims_locked(struct epoch *e) {
+	return rcu_dereference_protected(e->claims, lockdep_is_held(&e->shared_lock));
+}
+
+// lazily, once per epoch (and after every reset): a failure
+// only means the capture side can't skip anything yet
+static void ensure_snapshot_claims_ok(struct epoch *e) {
+	if(likely(rcu_access_pointer(e->claims) != NULL || capture_claims_slots == 0)) {
+		return;
+	}
+
+	mutex_lock(&e->shared_lock);
+
+	if(epoch_claims_locked(e) == NULL) {
+		struct snapshot_claims *cl = snapshot_claims_alloc();
+		if(cl != NULL) {
+			rcu_assign_pointer(e->claims, cl);
+		}
+	}
+
+	mutex_unlock(&e->shared_lock);
+}
+
+// blocks claimed so far may not be in snapblocks at all
+// (those of the other shards are captured once more, that's all)
+static void reset_snapshot_claims(struct epoch *e) {
+	mutex_lock(&e->shared_lock);
+	struct snapshot_claims *cl = rcu_replace_pointer(e->claims, NULL, lockdep_is_held(&e->shared_lock));
+	mutex_unlock(&e->shared_lock);
+
+	if(cl != NULL) {
+		snapshot_claims_destroy(cl);
+	}
+}
+
+/**
+ *
+ * snapshot deferred work
+ *
+ * captures are queued on a per-epoch lockless list and written out
+ * in batches by a delayed work on the device ordered lane: either
+ * when batch_max_captures are pending or when the first of them
+ * has been waiting for batch_linger_usecs
+ *
+ */
+
+#define BATCH_MAX_CAPTURES_LIMIT 512
+
+static unsigned int batch_max_captures = 64;
+module_param(batch_max_captures, uint, 0644);
+MODULE_PARM_DESC(batch_max_captures, 
+		"max number of captured blocks written by a single vectored write (1-512)");
+
+static unsigned int batch_linger_usecs = 1000;
+module_param(batch_linger_usecs, uint, 0644);
+MODULE_PARM_DESC(batch_linger_usecs, 
+		"max time a captured block waits for its batch to fill up");
+
+static inline size_t get_batch_max_captures(void) {
+	return clamp_t(unsigned int, READ_ONCE(batch_max_captures), 1, BATCH_MAX_CAPTURES_LIMIT);
+}
+
+/**
+ *
+ * capture descriptors
+ *
+ * a few dozen bytes each, everything else (names, date, paths, files)
+ * lives in the epoch they hold a reference to. Descriptors and block
+ * copies come from dedicated caches (see /proc/slabinfo) backed by
+ * a mempool reserve, so that atomic allocations seldom fail
+ *
+ */
+
+#define SNAPSHOT_BLOCK_CACHE_SIZE PAGE_SIZE
+
+static unsigned int capture_reserve = 128;
+module_param(capture_reserve, uint, 0444);
+MODULE_PARM_DESC(capture_reserve, 
+		"number of capture descriptors and block buffers kept in reserve");
+
+// block points either to a buffer of ours or within page,
+// a page handed over by the capture path (see bdsnap_make_snapshot_page)
+struct snapshot_capture {
+	struct llist_node node;
+	struct epoch *e;
+	u64 seq;
+	sector_t block_nr;
+	u32 blocksize;
+	u32 page_off;
+	char* block;
+	struct page *page;
+};
+
+//charged on push, uncharged once written out (see free_snapshot_capture)
+static inline size_t capture_cost(u32 blocksize) {
+	return sizeof(struct snapshot_capture) + blocksize;
+}
+
+static struct kmem_cache *capture_cache;
+static struct kmem_cache *block_cache;
+static mempool_t *capture_pool;
+static mempool_t *block_pool;
+
+//atomic context allowed
+static struct snapshot_capture* alloc_snapshot_capture(u32 blocksize) {
+	struct snapshot_capture *cap = mempool_alloc(capture_pool, GFP_ATOMIC);
+	if(cap == NULL) {
+		return NULL;
+	}
+
+	//fs blocks bigger than a page are rare, no reserve for them
+	if(likely(blocksize <= SNAPSHOT_BLOCK_CACHE_SIZE)) {
+		cap->block = mempool_alloc(block_pool, GFP_ATOMIC);
+	} else {
+		cap->block = kmalloc(blocksize, GFP_ATOMIC);
+	}
+
+	if(cap->block == NULL) {
+		mempool_free(cap, capture_pool);
+		return NULL;
+	}
+
+	cap->blocksize = blocksize;
+	cap->page = NULL;
+	return cap;
+}
+
+//atomic context allowed, the page reference goes to the capture
+static struct snapshot_capture* alloc_snapshot_capture_page(
+		struct page *page, u32 page_off, u32 blocksize) {
+
+	struct snapshot_capture *cap = mempool_alloc(capture_pool, GFP_ATOMIC);
+	if(cap == NULL) {
+		return NULL;
+	}
+
+	cap->page = page;
+	cap->page_off = page_off;
+	cap->block = (char*) page_address(page) + page_off;
+	cap->blocksize = blocksize;
+
+	return cap;
+}
+
+static void free_snapshot_capture(struct snapshot_capture *cap) {
+	if(cap->page != NULL) {
+		put_page(cap->page);
+	} else if(likely(cap->blocksize <= SNAPSHOT_BLOCK_CACHE_SIZE)) {
+		mempool_free(cap->block, block_pool);
+	} else {
+		kfree(cap->block);
+	}
+
+	memory_uncharge(capture_cost(cap->blocksize));
+	mempool_free(cap, capture_pool);
+}
+
+/**
+ *
+ * per-device options
+ *
+ */
+
+#define SNAPSHOT_ZSTD_DEFAULT_LEVEL 3
+
+// out holds the key even on failures
+static int snapshot_options_parse(char *options, struct snapshot_options *out) {
+	char *opt;
+
+	out->compression = SNAPSHOT_COMPRESSION_NONE;
+	out->compression_level = 0;
+	out->checksum = SNAPSHOT_CHECKSUM_CRC32C;
+	out->encryption = SNAPSHOT_ENCRYPTION_NONE;
+	out->key_size = 0;
+	out->nr_lanes = 1;
+
+	while(options != NULL && (opt = strsep(&options, ",")) != NULL) {
+		opt = strim(opt);
+		if(*opt == 0) {
+			continue;
+		}
+
+		char *val = strchr(opt, '=');
+		if(val == NULL) {
+			return -EINVAL;
+		}
+
+		*val++ = 0;
+
+		if(strcmp(opt, "compress") == 0) {
+			if(strcmp(val, "none") == 0) {
+				out->compression = SNAPSHOT_COMPRESSION_NONE;
+			} else if(strcmp(val, "lz4") == 0) {
+				out->compression = SNAPSHOT_COMPRESSION_LZ4;
+			} else if(strcmp(val, "zstd") == 0) {
+				out->compression = SNAPSHOT_COMPRESSION_ZSTD;
+			} else {
+				return -EINVAL;
+			}
+		} else if(strcmp(opt, "level") == 0) {
+			if(kstrtoint(val, 10, &out->compression_level) != 0) {
+				return -EINVAL;
+			}
+		} else if(strcmp(opt, "csum") == 0) {
+			if(strcmp(val, "none") == 0) {
+				out->checksum = SNAPSHOT_CHECKSUM_NONE;
+			} else if(strcmp(val, "crc32c") == 0) {
+				out->checksum = SNAPSHOT_CHECKSUM_CRC32C;
+			} else {
+				return -EINVAL;
+			}
+		} else if(strcmp(opt, "encrypt") == 0) {
+			if(strcmp(val, "none") == 0) {
+				out->encryption = SNAPSHOT_ENCRYPTION_NONE;
+			} else if(strcmp(val, "aes-gcm") == 0) {
+				out->encryption = SNAPSHOT_ENCRYPTION_AES_GCM;
+			} else {
+				return -EINVAL;
+			}
+		} else if(strcmp(opt, "lanes") == 0) {
+			if(kstrtouint(val, 10, &out->nr_lanes) != 0 || 
+					out->nr_lanes == 0 || out->nr_lanes > SNAPSHOT_MAX_LANES) {
+				return -EINVAL;
+			}
+		} else if(strcmp(opt, "key") == 0) {
+			//hex, 16, 24 or 32 bytes
+			size_t hexlen = strlen(val);
+			int err = 0;
+
+			if((hexlen != 32 && hexlen != 48 && hexlen != 64) || 
+					hex2bin(out->key, val, hexlen / 2) != 0) {
+				err = -EINVAL;
+			}
+
+			out->key_size = hexlen / 2;
+			memzero_explicit(val, hexlen);
+
+			if(err != 0) {
+				return err;
+			}
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	//a key goes with encryption, and the other way around
+	if((out->encryption == SNAPSHOT_ENCRYPTION_AES_GCM) != (out->key_size != 0)) {
+		return -EINVAL;
+	}
+
+	//lz4: 0 is the fast compressor, 1+ the HC one
+	if(out->compression == SNAPSHOT_COMPRESSION_LZ4 && 
+			(out->compression_level < 0 || out->compression_level > LZ4HC_MAX_CLEVEL)) {
+		return -EINVAL;
+	}
+
+	if(out->compression == SNAPSHOT_COMPRESSION_ZSTD && 
+			(out->compression_level < zstd_min_clevel() || out->compression_level > zstd_max_clevel())) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+struct shared_snapshot_options {
+	refcount_t refs;
+	struct snapshot_options opts;
+};
+
+const struct snapshot_options *snapshot_options_share(char *options) {
+	struct shared_snapshot_options *so = kmalloc(sizeof(struct shared_snapshot_options), GFP_KERNEL);
+	if(so == NULL) {
+		pr_err_failure("kmalloc");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	int err = snapshot_options_parse(options, &so->opts);
+	if(err != 0) {
+		kfree_sensitive(so);
+		return ERR_PTR(err);
+	}
+
+	refcount_set(&so->refs, 1);
+
+	return &so->opts;
+}
+
+const struct snapshot_options *snapshot_options_get(const struct snapshot_options *opts) {
+	struct shared_snapshot_options *so = container_of(opts, struct shared_snapshot_options, opts);
+	refcount_inc(&so->refs);
+	return opts;
+}
+
+void snapshot_options_put(const struct snapshot_options *opts) {
+	struct shared_snapshot_options *so = container_of(opts, struct shared_snapshot_options, opts);
+	if(refcount_dec_and_test(&so->refs)) {
+		//the key goes with it
+		kfree_sensitive(so);
+	}
+}
+
+/**
+ *
+ * compression
+ *
+ */
+
+// one per epoch shard, used by its (ordered) lane only: no locking
+struct snapshot_compressor {
+	enum snapshot_compression compression;
+	int level;
+	void *wrkmem;
+	zstd_cctx *zcctx;
+	zstd_parameters zparams;
+};
+
+static struct snapshot_compressor *snapshot_compressor_alloc(const struct snapshot_options *opts) {
+	struct snapshot_compressor *c = kzalloc(sizeof(struct snapshot_compressor), GFP_KERNEL);
+	if(c == NULL) {
+		pr_err_failure("kzalloc");
+		return NULL;
+	}
+
+	c->compression = opts->compression;
+	c->level = opts->compression_level;
+
+	size_t wrksize;
+
+	if(c->compression == SNAPSHOT_COMPRESSION_LZ4) {
+		wrksize = c->level > 0 ? LZ4HC_MEM_COMPRESS : LZ4_MEM_COMPRESS;
+	} else {
+		//only blocks up to a page are compressed
+		c->zparams = zstd_get_params(
+				c->level != 0 ? c->level : SNAPSHOT_ZSTD_DEFAULT_LEVEL, 
+				SNAPSHOT_BLOCK_CACHE_SIZE);
+
+		wrksize = zstd_cctx_workspace_bound(&c->zparams.cParams);
+	}
+
+	c->wrkmem = kvmalloc(wrksize, GFP_KERNEL);
+	if(c->wrkmem == NULL) {
+		pr_err_failure("kvmalloc");
+		kfree(c);
+		return NULL;
+	}
+
+	if(c->compression == SNAPSHOT_COMPRESSION_ZSTD && 
+			(c->zcctx = zstd_init_cctx(c->wrkmem, wrksize)) == NULL) {
+		pr_err_failure("zstd_init_cctx");
+		kvfree(c->wrkmem);
+		kfree(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+void snapshot_compressor_destroy(struct snapshot_compressor *c) {
+	kvfree(c->wrkmem);
+	kfree(c);
+}
+
+// lazily, once per epoch shard: retried next batch on failures
+static void ensure_snapshot_compressor_ok(struct epoch_shard *shard) {
+	if(likely(shard->compressor != NULL || shard->e->opts->compression == SNAPSHOT_COMPRESSION_NONE)) {
+		return;
+	}
+
+	shard->compressor = snapshot_compressor_alloc(shard->e->opts);
+}
+
+// 0 if it did not fit in dstcap, which means it does not pay off
+static size_t snapshot_compress(
+		struct snapshot_compressor *c, 
+		const void *src, size_t srclen, 
+		void *dst, size_t dstcap) {
+
+	if(c->compression == SNAPSHOT_COMPRESSION_LZ4) {
+		int clen = c->level > 0 ?
+			LZ4_compress_HC(src, dst, srclen, dstcap, c->level, c->wrkmem) :
+			LZ4_compress_default(src, dst, srclen, dstcap, c->wrkmem);
+
+		return clen > 0 ? clen : 0;
+	}
+
+	size_t clen = zstd_compress_cctx(c->zcctx, dst, dstcap, src, srclen, &c->zparams);
+
+	return zstd_is_error(clen) ? 0 : clen;
+}
+
+/**
+ *
+ * deduplication
+ *
+ */
+
+// blocks are identified by two 64 bits hashes of their content: one
+// single 64 bits hash would make a (silently) wrong restore likely
+// enough to matter for big epochs
+#define SNAPSHOT_DEDUP_SEED0 0x6264736e61703031ULL
+#define SNAPSHOT_DEDUP_SEED1 0x9e3779b97f4a7c15ULL
+
+static unsigned int dedup_max_entries = 1 << 18;
+module_param(dedup_max_entries, uint, 0644);
+MODULE_PARM_DESC(dedup_max_entries, 
+		"blocks remembered per epoch for deduplication (32B each), 0 disables it (zero blocks are always elided)");
+
+// all zeros means no key
+struct snapshot_dedup_key {
+	u64 h[2];
+};
+
+struct snapshot_dedup_entry {
+	struct rhash_head linkage;
+	struct snapshot_dedup_key key;
+	u64 off;
+};
+
+static const struct rhashtable_params dedup_ht_params = {
+	.key_len = sizeof(struct snapshot_dedup_key),
+	.key_offset = offsetof(struct snapshot_dedup_entry, key),
+	.head_offset = offsetof(struct snapshot_dedup_entry, linkage),
+};
+
+// content to record offset of the first record of the epoch shard with
+// that content. One per epoch shard, used by its (ordered) lane and
+// trimmed by the shrinker: the lock is hardly ever contended. It describes
+// one snapblocks file (segment), dropped if the file is reopened
+struct snapshot_dedup {
+	struct mutex lock;
+	struct rhashtable ht;
+	unsigned int nentries;
+	//on dedups, for the shrinker
+	struct list_head node;
+};
+
+static LIST_HEAD(dedups);
+static DEFINE_MUTEX(dedups_lock);
+//of all the dedups, what the shrinker can free
+static atomic_long_t dedup_entries = ATOMIC_LONG_INIT(0);
+
+static inline void snapshot_dedup_key_of(struct snapshot_dedup_key *key, const void *block, size_t size) {
+	key->h[0] = xxh64(block, size, SNAPSHOT_DEDUP_SEED0);
+	key->h[1] = xxh64(block, size, SNAPSHOT_DEDUP_SEED1) | 1;
+}
+
+static struct snapshot_dedup *snapshot_dedup_alloc(void) {
+	struct snapshot_dedup *dd = kmalloc(sizeof(struct snapshot_dedup), GFP_KERNEL);
+	if(dd == NULL) {
+		pr_err_failure("kmalloc");
+		return NULL;
+	}
+
+	int err = rhashtable_init(&dd->ht, &dedup_ht_params);
+	if(err != 0) {
+		pr_err_failure_with_code("rhashtable_init", err);
+		kfree(dd);
+		return NULL;
+	}
+
+	mutex_init(&dd->lock);
+	dd->nentries = 0;
+
+	mutex_lock(&dedups_lock);
+	list_add(&dd->node, &dedups);
+	mutex_unlock(&dedups_lock);
+
+	return dd;
+}
+
+static void snapshot_dedup_free_fn(void *ptr, void __always_unused *arg) {
+	kfree(ptr);
+}
+
+void snapshot_dedup_destroy(struct snapshot_dedup *dd) {
+	//the shrinker is not looking at it once it is off the list
+	mutex_lock(&dedups_lock);
+	list_del(&dd->node);
+	mutex_unlock(&dedups_lock);
+
+	atomic_long_sub(dd->nentries, &dedup_entries);
+	memory_uncharge(dd->nentries * sizeof(struct snapshot_dedup_entry));
+
+	rhashtable_free_and_destroy(&dd->ht, snapshot_dedup_free_fn, NULL);
+	kfree(dd);
+}
+
+static bool snapshot_dedup_lookup(struct snapshot_dedup *dd, const struct snapshot_dedup_key *key, u64 *out_off) {
+	mutex_lock(&dd->lock);
+
+	struct snapshot_dedup_entry *entry = 
+		rhashtable_lookup_fast(&dd->ht, key, dedup_ht_params);
+
+	if(entry != NULL) {
+		*out_off = entry->off;
+	}
+
+	mutex_unlock(&dd->lock);
+
+	return entry != NULL;
+}
+
+// best effort: a block which is not remembered is just stored again
+static void snapshot_dedup_insert(struct snapshot_dedup *dd, const struct snapshot_dedup_key *key, u64 off) {
+	mutex_lock(&dd->lock);
+
+	if(dd->nentries >= READ_ONCE(dedup_max_entries)) {
+		goto __snapshot_dedup_insert_finish0;
+	}
+
+	if(!memory_try_charge(sizeof(struct snapshot_dedup_entry))) {
+		goto __snapshot_dedup_insert_finish0;
+	}
+
+	//reclaim may run the shrinker, it skips this (locked) table
+	struct snapshot_dedup_entry *entry = kmalloc(sizeof(struct snapshot_dedup_entry), GFP_KERNEL | __GFP_NOWARN);
+	if(entry == NULL) {
+		goto __snapshot_dedup_insert_finish1;
+	}
+
+	entry->key = *key;
+	entry->off = off;
+
+	if(rhashtable_lookup_insert_fast(&dd->ht, &entry->linkage, dedup_ht_params) != 0) {
+		kfree(entry);
+		goto __snapshot_dedup_insert_finish1;
+	}
+
+	dd->nentries++;
+	atomic_long_inc(&dedup_entries);
+
+	mutex_unlock(&dd->lock);
+	return;
+
+__snapshot_dedup_insert_finish1:
+	memory_uncharge(sizeof(struct snapshot_dedup_entry));
+__snapshot_dedup_insert_finish0:
+	mutex_unlock(&dd->lock);
+}
+
+// dd->lock held, up to nr entries (whichever the walk meets first) are
+// forgotten: their blocks are just stored again if they show up.
+// An entry is freed once the walk has moved past it
+static unsigned long snapshot_dedup_trim(struct snapshot_dedup *dd, unsigned long nr) {
+	struct rhashtable_iter iter;
+	struct snapshot_dedup_entry *entry;
+	struct snapshot_dedup_entry *prev = NULL;
+	unsigned long freed = 0;
+
+	rhashtable_walk_enter(&dd->ht, &iter);
+	rhashtable_walk_start(&iter);
+
+	while(freed < nr && (entry = rhashtable_walk_next(&iter)) != NULL) {
+		if(IS_ERR(entry)) {
+			//resized meanwhile, entries may be seen twice
+			if(PTR_ERR(entry) == -EAGAIN) {
+				continue;
+			}
+
+			break;
+		}
+
+		kfree(prev);
+		prev = NULL;
+
+		if(rhashtable_remove_fast(&dd->ht, &entry->linkage, dedup_ht_params) == 0) {
+			prev = entry;
+			freed++;
+		}
+	}
+
+	rhashtable_walk_stop(&iter);
+	rhashtable_walk_exit(&iter);
+
+	kfree(prev);
+
+	dd->nentries -= freed;
+	atomic_long_sub(freed, &dedup_entries);
+	memory_uncharge(freed * sizeof(struct snapshot_dedup_entry));
+
+	return freed;
+}
+
+static unsigned long dedup_shrinker_count(
+		struct shrinker __always_unused *shrinker, 
+		struct shrink_control __always_unused *sc) {
+
+	long nr = atomic_long_read(&dedup_entries);
+	return nr > 0 ? nr : SHRINK_EMPTY;
+}
+
+// tables being used right now (or being destroyed) are skipped
+static unsigned long dedup_shrinker_scan(
+		struct shrinker __always_unused *shrinker, 
+		struct shrink_control *sc) {
+
+	if(!mutex_trylock(&dedups_lock)) {
+		return SHRINK_STOP;
+	}
+
+	unsigned long freed = 0;
+	struct snapshot_dedup *dd;
+
+	list_for_each_entry(dd, &dedups, node) {
+		if(freed >= sc->nr_to_scan) {
+			break;
+		}
+
+		if(mutex_trylock(&dd->lock)) {
+			freed += snapshot_dedup_trim(dd, sc->nr_to_scan - freed);
+			mutex_unlock(&dd->lock);
+		}
+	}
+
+	mutex_unlock(&dedups_lock);
+
+	return freed > 0 ? freed : SHRINK_STOP;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+static struct shrinker *dedup_shrinker;
+
+static int register_dedup_shrinker(void) {
+	dedup_shrinker = shrinker_alloc(0, "bdsnap-dedup");
+	if(dedup_shrinker == NULL) {
+		pr_err_failure("shrinker_alloc");
+		return -ENOMEM;
+	}
+
+	dedup_shrinker->count_objects = dedup_shrinker_count;
+	dedup_shrinker->scan_objects = dedup_shrinker_scan;
+	dedup_shrinker->seeks = DEFAULT_SEEKS;
+
+	shrinker_register(dedup_shrinker);
+	return 0;
+}
+
+static void unregister_dedup_shrinker(void) {
+	shrinker_free(dedup_shrinker);
+}
+#else
+static struct shrinker dedup_shrinker = {
+	.count_objects = dedup_shrinker_count,
+	.scan_objects = dedup_shrinker_scan,
+	.seeks = DEFAULT_SEEKS
+};
+
+static int register_dedup_shrinker(void) {
+	int err = register_shrinker(&dedup_shrinker, "bdsnap-dedup");
+	if(err != 0) {
+		pr_err_failure_with_code("register_shrinker", err);
+	}
+
+	return err;
+}
+
+static void unregister_dedup_shrinker(void) {
+	unregister_shrinker(&dedup_shrinker);
+}
+#endif
+
+// lazily, once per epoch shard (and snapblocks file): retried next batch on failures
+static void ensure_snapshot_dedup_ok(struct epoch_shard *shard) {
+	if(likely(shard->dedup != NULL || READ_ONCE(dedup_max_entries) == 0)) {
+		return;
+	}
+
+	shard->dedup = snapshot_dedup_alloc();
+}
+
+/**
+ *
+ * encryption
+ *
+ */
+
+// one per epoch shard, "gcm(aes)" as resolved by the crypto API (AES-NI,
+// async offload engines, ...), used by its (ordered) lane only
+struct snapshot_encryptor {
+	struct crypto_aead *tfm;
+};
+
+static struct snapshot_encryptor *snapshot_encryptor_alloc(const struct snapshot_options *opts) {
+	struct snapshot_encryptor *c = kmalloc(sizeof(struct snapshot_encryptor), GFP_KERNEL);
+	if(c == NULL) {
+		pr_err_failure("kmalloc");
+		return NULL;
+	}
+
+	c->tfm = crypto_alloc_aead("gcm(aes)", 0, 0);
+	if(IS_ERR(c->tfm)) {
+		pr_err_failure_with_code("crypto_alloc_aead", PTR_ERR(c->tfm));
+		goto __snapshot_encryptor_alloc_finish0;
+	}
+
+	int err = crypto_aead_setkey(c->tfm, opts->key, opts->key_size);
+	if(err != 0) {
+		pr_err_failure_with_code("crypto_aead_setkey", err);
+		goto __snapshot_encryptor_alloc_finish1;
+	}
+
+	if((err = crypto_aead_setauthsize(c->tfm, SNAPBLOCK_AEAD_TAG_SIZE)) != 0) {
+		pr_err_failure_with_code("crypto_aead_setauthsize", err);
+		goto __snapshot_encryptor_alloc_finish1;
+	}
+
+	return c;
+
+__snapshot_encryptor_alloc_finish1:
+	crypto_free_aead(c->tfm);
+__snapshot_encryptor_alloc_finish0:
+	kfree(c);
+	return NULL;
+}
+
+void snapshot_encryptor_destroy(struct snapshot_encryptor *c) {
+	crypto_free_aead(c->tfm);
+	kfree(c);
+}
+
+// lazily, once per epoch shard: retried next batch on failures, blocks
+// of a device with encryption are never written in the clear
+static bool ensure_snapshot_encryptor_ok(struct epoch_shard *shard) {
+	if(likely(shard->encryptor != NULL || shard->e->opts->encryption == SNAPSHOT_ENCRYPTION_NONE)) {
+		return true;
+	}
+
+	shard->encryptor = snapshot_encryptor_alloc(shard->e->opts);
+	return shard->encryptor != NULL;
+}
+
+// one in-flight encryption, everything the engine
+// may touch lives here (never on the stack)
+struct snapshot_aead_req {
+	struct aead_request *req;
+	struct crypto_wait wait;
+	int err;
+	void *out;
+	struct scatterlist src[2];
+	struct scatterlist dst[3];
+	struct {
+		struct snapblock_aead_aad aad;
+		//the associated data is expected in dst too
+		struct snapblock_aead_aad aad_out;
+		u8 iv[SNAPBLOCK_AEAD_IV_SIZE];
+		u8 tag[SNAPBLOCK_AEAD_TAG_SIZE];
+	} dma ____cacheline_aligned;
+};
+
+/**
+ *
+ * batches
+ *
+ */
+
+// extended header of one record, as written
+struct snapblock_exthdr_buf {
+	u8 bytes[SNAPBLOCK_MAX_EXTHDR_SIZE];
+};
+
+// scratch space for one batch, allocated once per drain
+struct snapshot_batch {
+	struct snapshot_capture **caps;
+	struct snapblock_file_hdr *hdrs;
+	struct write_snapblock_args *wargs;
+	u64 *rec_offs;
+	struct kvec *kv;
+	struct bio_vec *bv;
+	struct page **pages;
+	void **cbufs;
+	struct snapblock_exthdr_buf *exthdrs;
+	struct snapshot_dedup_key *dkeys;
+	struct snapshot_aead_req **areqs;
+};
+
+static bool alloc_snapshot_batch(struct snapshot_batch *batch, size_t max) {
+	size_t rec_size = 
+		sizeof(struct snapshot_capture*) +
+		sizeof(struct snapblock_file_hdr) + 
+		sizeof(struct write_snapblock_args) +
+		sizeof(u64) +
+		sizeof(struct kvec) * SNAPBLOCK_MAX_KVECS_PER_RECORD +
+		sizeof(struct bio_vec) * SNAPBLOCK_MAX_BVECS_PER_RECORD +
+		sizeof(struct page*) * SNAPBLOCK_MAX_V2_PAGES_PER_RECORD +
+		sizeof(void*) +
+		sizeof(struct snapblock_exthdr_buf) +
+		sizeof(struct snapshot_dedup_key) +
+		sizeof(struct snapshot_aead_req*);
+
+	char *mem = kmalloc_array(max, rec_size, GFP_KERNEL);
+	if(mem == NULL) {
+		return false;
+	}
+
+	batch->kv = (struct kvec*) mem;
+	batch->bv = (struct bio_vec*) (batch->kv + max * SNAPBLOCK_MAX_KVECS_PER_RECORD);
+	batch->pages = (struct page**) (batch->bv + max * SNAPBLOCK_MAX_BVECS_PER_RECORD);
+	batch->cbufs = (void**) (batch->pages + max * SNAPBLOCK_MAX_V2_PAGES_PER_RECORD);
+	batch->wargs = (struct write_snapblock_args*) (batch->cbufs + max);
+	batch->caps = (struct snapshot_capture**) (batch->wargs + max);
+	batch->rec_offs = (u64*) (batch->caps + max);
+	batch->hdrs = (struct snapblock_file_hdr*) (batch->rec_offs + max);
+	batch->exthdrs = (struct snapblock_exthdr_buf*) (batch->hdrs + max);
+	batch->dkeys = (struct snapshot_dedup_key*) (batch->exthdrs + max);
+	batch->areqs = (struct snapshot_aead_req**) (batch->dkeys + max);
+
+	return true;
+}
+
+static inline void free_snapshot_batch(struct snapshot_batch *batch) {
+	kfree(batch->kv);
+}
+
+static bool already_in_batch(const struct snapshot_batch *batch, size_t nrecs, sector_t blknr) {
+	for(size_t i = 0; i < nrecs; i++) {
+		if(batch->hdrs[i].blknr == blknr) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline void set_snapblock_payload(
+		struct snapshot_batch *batch, size_t i, 
+		enum snapblock_payload_type type, 
+		const void *exthdr, size_t exthdr_size,
+		const void *payload, size_t payload_size) {
+
+	struct write_snapblock_args *wargs = &batch->wargs[i];
+	struct snapblock_file_hdr *hdr = &batch->hdrs[i];
+
+	hdr->payld_type = type;
+	hdr->payldsiz = payload_size;
+	hdr->payld_off = sizeof(struct snapblock_file_hdr) + exthdr_size;
+
+	memcpy(batch->exthdrs[i].bytes, exthdr, exthdr_size);
+
+	wargs->extended_hdr = &batch->exthdrs[i];
+	wargs->extended_hdr_size = exthdr_size;
+	wargs->payload = payload;
+	wargs->payload_size = payload_size;
+}
+
+// buffers of ours holding payloads (batch->cbufs)
+static inline void *alloc_snapblock_cbuf(size_t size, gfp_t gfp) {
+	return likely(size <= SNAPSHOT_BLOCK_CACHE_SIZE) ? 
+		kmem_cache_alloc(block_cache, gfp) : 
+		kmalloc(size, gfp);
+}
+
+static inline void free_snapblock_cbuf(void *cbuf, size_t size) {
+	if(likely(size <= SNAPSHOT_BLOCK_CACHE_SIZE)) {
+		kmem_cache_free(block_cache, cbuf);
+	} else {
+		kfree(cbuf);
+	}
+}
+
+// appends the checksum of the payload (as it is going to be written)
+// to the extended header of record i, records without payload have none
+static void checksum_snapblock(struct snapshot_batch *batch, size_t i) {
+	struct write_snapblock_args *wargs = &batch->wargs[i];
+	struct snapblock_file_hdr *hdr = &batch->hdrs[i];
+
+	if(wargs->payload_size == 0) {
+		return;
+	}
+
+	struct snapblock_csum_exthdr csum = {
+		.crc32c = ~crc32c(~0U, wargs->payload, wargs->payload_size),
+		.reserved = 0
+	};
+
+	memcpy(batch->exthdrs[i].bytes + wargs->extended_hdr_size, &csum, sizeof(csum));
+
+	hdr->payld_type |= SNAPBLOCK_PAYLOAD_FLAG_CRC32C;
+	hdr->payld_off += sizeof(csum);
+
+	wargs->extended_hdr = &batch->exthdrs[i];
+	wargs->extended_hdr_size += sizeof(csum);
+}
+
+// turns record i into a compressed one, if it is worth it: the
+// compressed block must be smaller than the raw one. Buffers
+// (batch->cbufs) are freed once the batch is written
+static void compress_snapblock(struct snapshot_compressor *c, struct snapshot_batch *batch, size_t i) {
+	struct write_snapblock_args *wargs = &batch->wargs[i];
+
+	if(wargs->payload_size > SNAPSHOT_BLOCK_CACHE_SIZE) {
+		return;
+	}
+
+	void *dst = alloc_snapblock_cbuf(wargs->payload_size, GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+	if(dst == NULL) {
+		return;
+	}
+
+	size_t clen = snapshot_compress(c, wargs->payload, wargs->payload_size, dst, wargs->payload_size - 1);
+	if(clen == 0) {
+		free_snapblock_cbuf(dst, wargs->payload_size);
+		return;
+	}
+
+	batch->cbufs[i] = dst;
+
+	struct snapblock_rawsiz_exthdr ehdr = {
+		.rawsiz = wargs->payload_size
+	};
+
+	set_snapblock_payload(batch, i, 
+			c->compression == SNAPSHOT_COMPRESSION_LZ4 ? 
+				SNAPBLOCK_PAYLOAD_TYPE_LZ4 : 
+				SNAPBLOCK_PAYLOAD_TYPE_ZSTD,
+			&ehdr, sizeof(ehdr), 
+			dst, clen);
+}
+
+// submits the encryption of the payload of record i (batch->areqs[i]),
+// the engine works while the next records are prepared. Records without
+// payload are not encrypted. false on failures: the batch must not be
+// written, the record would reach the file in the clear
+static bool encrypt_snapblock(struct snapshot_encryptor *c, struct snapshot_batch *batch, size_t i) {
+	const struct write_snapblock_args *wargs = &batch->wargs[i];
+	const struct snapblock_file_hdr *hdr = &batch->hdrs[i];
+	size_t size = wargs->payload_size;
+
+	if(size == 0) {
+		return true;
+	}
+
+	struct snapshot_aead_req *areq = kmalloc(sizeof(struct snapshot_aead_req), GFP_KERNEL);
+	if(areq == NULL) {
+		pr_err_failure("kmalloc");
+		return false;
+	}
+
+	areq->req = aead_request_alloc(c->tfm, GFP_KERNEL);
+	if(areq->req == NULL) {
+		pr_err_failure("aead_request_alloc");
+		goto __encrypt_snapblock_finish0;
+	}
+
+	areq->out = alloc_snapblock_cbuf(size, GFP_KERNEL);
+	if(areq->out == NULL) {
+		pr_err_failure("alloc_snapblock_cbuf");
+		goto __encrypt_snapblock_finish1;
+	}
+
+	areq->dma.aad.blknr = hdr->blknr;
+	areq->dma.aad.payld_type = hdr->payld_type;
+	areq->dma.aad_out = areq->dma.aad;
+
+	//96 bits random nonces, never the same twice in practice
+	get_random_bytes(areq->dma.iv, SNAPBLOCK_AEAD_IV_SIZE);
+
+	sg_init_table(areq->src, 2);
+	sg_set_buf(&areq->src[0], &areq->dma.aad, sizeof(struct snapblock_aead_aad));
+	sg_set_buf(&areq->src[1], wargs->payload, size);
+
+	sg_init_table(areq->dst, 3);
+	sg_set_buf(&areq->dst[0], &areq->dma.aad_out, sizeof(struct snapblock_aead_aad));
+	sg_set_buf(&areq->dst[1], areq->out, size);
+	sg_set_buf(&areq->dst[2], areq->dma.tag, SNAPBLOCK_AEAD_TAG_SIZE);
+
+	crypto_init_wait(&areq->wait);
+	aead_request_set_callback(areq->req, 
+			CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP, 
+			crypto_req_done, &areq->wait);
+	aead_request_set_ad(areq->req, sizeof(struct snapblock_aead_aad));
+	aead_request_set_crypt(areq->req, areq->src, areq->dst, size, areq->dma.iv);
+
+	//-EINPROGRESS or -EBUSY (backlogged) with async engines
+	areq->err = crypto_aead_encrypt(areq->req);
+	batch->areqs[i] = areq;
+
+	return true;
+
+__encrypt_snapblock_finish1:
+	aead_request_free(areq->req);
+__encrypt_snapblock_finish0:
+	kfree(areq);
+	return false;
+}
+
+// waits for every encryption submitted by encrypt_snapblock, the
+// ciphertexts replace the payloads. false if any failed
+static bool finish_snapblocks_encryption(struct snapshot_batch *batch, size_t nrecs) {
+	bool ok = true;
+
+	for(size_t i = 0; i < nrecs; i++) {
+		struct snapshot_aead_req *areq = batch->areqs[i];
+		if(areq == NULL) {
+			continue;
+		}
+
+		struct write_snapblock_args *wargs = &batch->wargs[i];
+		struct snapblock_file_hdr *hdr = &batch->hdrs[i];
+
+		int err = crypto_wait_req(areq->err, &areq->wait);
+		if(err != 0) {
+			pr_err_failure_with_code("crypto_aead_encrypt", err);
+			free_snapblock_cbuf(areq->out, wargs->payload_size);
+			ok = false;
+			goto __finish_snapblocks_encryption_next;
+		}
+
+		struct snapblock_aead_exthdr ehdr = {
+			.reserved = 0
+		};
+
+		memcpy(ehdr.iv, areq->dma.iv, SNAPBLOCK_AEAD_IV_SIZE);
+		memcpy(ehdr.tag, areq->dma.tag, SNAPBLOCK_AEAD_TAG_SIZE);
+		memcpy(batch->exthdrs[i].bytes + wargs->extended_hdr_size, &ehdr, sizeof(ehdr));
+
+		hdr->payld_type |= SNAPBLOCK_PAYLOAD_FLAG_AES_GCM;
+		hdr->payld_off += sizeof(ehdr);
+
+		wargs->extended_hdr = &batch->exthdrs[i];
+		wargs->extended_hdr_size += sizeof(ehdr);
+
+		if(batch->cbufs[i] != NULL) {
+			free_snapblock_cbuf(batch->cbufs[i], wargs->payload_size);
+		}
+
+		batch->cbufs[i] = areq->out;
+		wargs->payload = areq->out;
+
+__finish_snapblocks_encryption_next:
+		aead_request_free(areq->req);
+		kfree(areq);
+		batch->areqs[i] = NULL;
+	}
+
+	return ok;
+}
+
+// zero blocks and blocks already seen during this epoch are stored without
+// payload. false if record i has to be written as usual, dkeys[i] is set
+// if it has to be remembered once written
+static bool dedup_snapblock(struct snapshot_dedup *dd, struct snapshot_batch *batch, size_t i) {
+	const struct write_snapblock_args *wargs = &batch->wargs[i];
+	size_t rawsiz = wargs->payload_size;
+
+	if(memchr_inv(wargs->payload, 0, rawsiz) == NULL) {
+		struct snapblock_rawsiz_exthdr ehdr = {
+			.rawsiz = rawsiz
+		};
+
+		set_snapblock_payload(batch, i, SNAPBLOCK_PAYLOAD_TYPE_ZERO, 
+				&ehdr, sizeof(ehdr), NULL, 0);
+
+		return true;
+	}
+
+	if(dd == NULL) {
+		return false;
+	}
+
+	struct snapshot_dedup_key *key = &batch->dkeys[i];
+	snapshot_dedup_key_of(key, wargs->payload, rawsiz);
+
+	u64 ref_off = 0;
+	ssize_t ref_rec = -1;
+
+	if(!snapshot_dedup_lookup(dd, key, &ref_off)) {
+		//or a record of this very batch, keys of records
+		//without a payload of their own are all zeros
+		for(size_t k = 0; k < i && ref_rec < 0; k++) {
+			if(memcmp(&batch->dkeys[k], key, sizeof(*key)) == 0) {
+				ref_rec = k;
+			}
+		}
+
+		if(ref_rec < 0) {
+			return false;
+		}
+	}
+
+	memset(key, 0, sizeof(*key));
+
+	struct snapblock_ref_exthdr ehdr = {
+		.rawsiz = rawsiz,
+		.ref_off = ref_off
+	};
+
+	set_snapblock_payload(batch, i, SNAPBLOCK_PAYLOAD_TYPE_REF, 
+			&ehdr, sizeof(ehdr), NULL, 0);
+
+	batch->wargs[i].ref_rec = ref_rec;
+
+	return true;
+}
+
+// shared by the shards of the epoch, each batch works on its own
+// reference: another shard may replace a broken one meanwhile
+static bool get_epoch_snapdir(struct epoch *e, struct path *out) {
+	mutex_lock(&e->shared_lock);
+
+	bool ok = ensure_path_snapdir_ok(
+			&e->path_snapdir, 
+			e->original_dev_name->str, 
+			e->first_mount_date);
+
+	if(ok) {
+		*out = *e->path_snapdir;
+		path_get(out);
+	}
+
+	mutex_unlock(&e->shared_lock);
+	return ok;
+}
+
+/**
+ *
+ * lost captures
+ *
+ * blocks whose pre-image never makes it to snapblocks (capture refused,
+ * batch dropped) leave the snapshot incomplete: the first one is told in
+ * the kernel log, and the snapdir gets an "incomplete" file holding how
+ * many blocks are missing so far, which restore reports (and refuses
+ * unless told otherwise). It is (re)written by the next batch of the
+ * epoch and, for the final count, by its cleanup
+ *
+ */
+
+// atomic context allowed
+static void count_lost_captures(struct epoch *e, int n) {
+	if(atomic_add_return(n, &e->nr_lost_captures) == n) {
+		pr_warn_ratelimited("%s: snapshot %s%s is missing blocks from now on "
+				"(memory budget exhausted, out of memory or write out failure)\n",
+				module_name(THIS_MODULE), e->original_dev_name->str, e->first_mount_date);
+	}
+}
+
+// the count only grows: fixed width, rewritten in place
+static bool write_incomplete_file(const struct path *snapdir, int nr_lost) {
+	struct file *filp;
+	if(!ensure_snapdir_file_ok(snapdir, SNAPSHOT_INCOMPLETE_FILE_NAME, O_WRONLY | O_LARGEFILE, &filp)) {
+		return false;
+	}
+
+	char buf[sizeof("2147483647\n")];
+	int len = scnprintf(buf, sizeof(buf), "%10d\n", nr_lost);
+
+	loff_t pos = 0;
+	ssize_t wrote = kernel_write(filp, buf, len, &pos);
+
+	fput(filp);
+
+	if(wrote != len) {
+		pr_err_failure_with_code("kernel_write", wrote < 0 ? wrote : -EIO);
+		return false;
+	}
+
+	return true;
+}
+
+static void ensure_losses_marked(struct epoch *e, const struct path *snapdir) {
+	int nr_lost = atomic_read(&e->nr_lost_captures);
+	if(likely(nr_lost == READ_ONCE(e->nr_lost_marked))) {
+		return;
+	}
+
+	mutex_lock(&e->shared_lock);
+
+	if(nr_lost > e->nr_lost_marked && write_incomplete_file(snapdir, nr_lost)) {
+		WRITE_ONCE(e->nr_lost_marked, nr_lost);
+	}
+
+	mutex_unlock(&e->shared_lock);
+}
+
+void mark_epoch_losses(struct epoch *e) {
+	if(likely(atomic_read(&e->nr_lost_captures) == READ_ONCE(e->nr_lost_marked))) {
+		return;
+	}
+
+	struct path snapdir;
+	if(!get_epoch_snapdir(e, &snapdir)) {
+		return;
+	}
+
+	ensure_losses_marked(e, &snapdir);
+
+	path_put(&snapdir);
+}
+
+// the batch is dropped before any of it is written: its blocks are not in
+// snapblocks, so their next writes must be captured (and tried) again
+static void release_batch_claims(struct epoch *e, struct snapshot_batch *batch, size_t ncaps) {
+	count_lost_captures(e, ncaps);
+
+	rcu_read_lock();
+
+	struct snapshot_claims *claims = rcu_dereference(e->claims);
+	for(size_t i = 0; claims != NULL && i < ncaps; i++) {
+		claims_release(claims, batch->caps[i]->block_nr);
+	}
+
+	rcu_read_unlock();
+}
+
+// ncaps captures are in batch->caps, caller frees them afterwards
+static void write_out_batch(struct epoch_shard *shard, struct snapshot_batch *batch, size_t ncaps) {
+	struct epoch *e = shard->e;
+	struct snapshot_claims *claims;
+
+	//cheap filtering first, if every block is already
+	//captured there is no need to even touch any file
+	if(shard->captured_blocks != NULL) {
+		size_t nkept = 0;
+
+		rcu_read_lock();
+		claims = rcu_dereference(e->claims);
+
+		for(size_t i = 0; i < ncaps; i++) {
+			sector_t blknr = batch->caps[i]->block_nr;
+
+			if(!blkbitmap_test(shard->captured_blocks, blknr)) {
+				swap(batch->caps[nkept], batch->caps[i]);
+				nkept++;
+			} else if(claims != NULL) {
+				//next writes of the block won't even be captured
+				claims_claim(claims, blknr);
+			}
+		}
+
+		rcu_read_unlock();
+
+		if(nkept == 0) {
+			return;
+		}
+
+		ncaps = nkept;
+	}
+
+	struct path snapdir;
+	if(!get_epoch_snapdir(e, &snapdir)) {
+		release_batch_claims(e, batch, ncaps);
+		return;
+	}
+
+	ensure_losses_marked(e, &snapdir);
+
+	bool reopened;
+	if(!ensure_snapblocks_file_ok(
+				&snapdir,
+				shard->snapblocks_name,
+				&shard->snapblocks_filp,
+				&shard->snapblocks_dio_filp,
+				&reopened)) {
+		goto __write_out_batch_finish1;
+	}
+
+	if(unlikely(reopened && shard->captured_blocks != NULL)) {
+		//the set described the previous file: seed it again
+		blkbitmap_cleanup_and_destroy(shard->captured_blocks);
+		shard->captured_blocks = NULL;
+	}
+
+	if(unlikely(reopened)) {
+		reset_snapshot_claims(e);
+	}
+
+	if(unlikely(reopened && shard->dedup != NULL)) {
+		//its offsets are meaningless in the new file
+		snapshot_dedup_destroy(shard->dedup);
+		shard->dedup = NULL;
+	}
+
+	struct file *snapblocks_filp = shard->snapblocks_filp;
+
+	if(!ensure_snapblocks_index_ok(
+				&snapdir,
+				shard->snapidx_name,
+				snapblocks_filp,
+				&shard->snapblocks_idx)) {
+		goto __write_out_batch_finish1;
+	}
+
+	struct snapidx *idx = shard->snapblocks_idx;
+
+	if(!ensure_captured_blocks_ok(
+				&shard->captured_blocks,
+				idx)) {
+		goto __write_out_batch_finish1;
+	}
+
+	if(!ensure_snapshot_encryptor_ok(shard)) {
+		goto __write_out_batch_finish1;
+	}
+
+	//no compressor, no compression: blocks are stored raw
+	ensure_snapshot_compressor_ok(shard);
+	ensure_snapshot_dedup_ok(shard);
+	ensure_snapshot_claims_ok(e);
+
+	//ordered lane: we are the only writer of this snapblocks file
+	u64 start_off = i_size_read(file_inode(snapblocks_filp));
+	bool captured_ok = true;
+	bool encrypted_ok = true;
+	size_t nrecs = 0;
+
+	for(size_t i = 0; i < ncaps; i++) {
+		struct snapshot_capture *cap = batch->caps[i];
+
+		//blocks are claimed as they join the batch, so a block
+		//written twice in a row shows up only once
+		if(blkbitmap_test(shard->captured_blocks, cap->block_nr) ||
+				(!captured_ok && already_in_batch(batch, nrecs, cap->block_nr))) {
+			continue;
+		}
+
+		if(captured_ok && !blkbitmap_set(shard->captured_blocks, cap->block_nr)) {
+			pr_err_failure("blkbitmap_set");
+			captured_ok = false;
+		}
+
+		SET_SNAPBLOCK_FILE_HDR(batch->hdrs[nrecs], 
+				cap->block_nr, 
+				cap->blocksize);
+
+		SET_WRITE_SNAPBLOCK_ARGS(batch->wargs[nrecs], 
+				&batch->hdrs[nrecs], 
+				cap->block, 
+				cap->blocksize);
+
+		batch->cbufs[nrecs] = NULL;
+		batch->areqs[nrecs] = NULL;
+		memset(&batch->dkeys[nrecs], 0, sizeof(struct snapshot_dedup_key));
+
+		if(!dedup_snapblock(shard->dedup, batch, nrecs) && shard->compressor != NULL) {
+			compress_snapblock(shard->compressor, batch, nrecs);
+		}
+
+		if(shard->encryptor != NULL && encrypted_ok) {
+			encrypted_ok = encrypt_snapblock(shard->encryptor, batch, nrecs);
+		}
+
+		nrecs++;
+	}
+
+	if(shard->encryptor != NULL) {
+		encrypted_ok = finish_snapblocks_encryption(batch, nrecs) && encrypted_ok;
+	}
+
+	//of the payloads as stored, ciphertexts included
+	for(size_t i = 0; e->opts->checksum == SNAPSHOT_CHECKSUM_CRC32C && i < nrecs; i++) {
+		checksum_snapblock(batch, i);
+	}
+
+	//a batch that cannot be encrypted as a whole is lost, as on write errors
+	bool written = encrypted_ok;
+
+	if(written && nrecs > 0 && READ_ONCE(snapblocks_format) == SNAPBLOCKS_FORMAT_V1) {
+		written = write_snapblocks(
+				snapblocks_filp, 
+				batch->wargs, 
+				nrecs, 
+				batch->kv,
+				batch->rec_offs);
+	} else if(written && nrecs > 0) {
+		written = write_snapblocks_v2(
+				snapblocks_filp, 
+				&shard->snapblocks_dio_filp,
+				batch->wargs, 
+				nrecs, 
+				batch->bv,
+				batch->pages,
+				batch->rec_offs);
+	}
+
+	for(size_t i = 0; i < nrecs; i++) {
+		if(batch->cbufs[i] != NULL) {
+			free_snapblock_cbuf(batch->cbufs[i], batch->wargs[i].payload_size);
+		}
+	}
+
+	if(!written || !captured_ok) {
+		//the set is not exact anymore: drop it,
+		//next batch will seed a new one from the index
+		blkbitmap_cleanup_and_destroy(shard->captured_blocks);
+		shard->captured_blocks = NULL;
+	}
+
+	if(!written) {
+		//these blocks are lost, so are their claims
+		count_lost_captures(e, nrecs);
+		reset_snapshot_claims(e);
+		goto __write_out_batch_finish0;
+	}
+
+	rcu_read_lock();
+	claims = rcu_dereference(e->claims);
+
+	//most are claimed already, by their capture
+	for(size_t i = 0; claims != NULL && i < nrecs; i++) {
+		claims_claim(claims, batch->hdrs[i].blknr);
+	}
+
+	rcu_read_unlock();
+
+	u64 end_off = i_size_read(file_inode(snapblocks_filp));
+
+	for(size_t i = 0; shard->dedup != NULL && i < nrecs; i++) {
+		if(batch->dkeys[i].h[1] != 0) {
+			snapshot_dedup_insert(shard->dedup, &batch->dkeys[i], batch->rec_offs[i]);
+		}
+	}
+
+	for(size_t i = 0; i < nrecs; i++) {
+		//a crash in the midst: next catch up rescans the whole batch
+		if(!snapidx_insert(
+					idx, 
+					batch->hdrs[i].blknr, 
+					batch->rec_offs[i], 
+					i + 1 == nrecs ? end_off : start_off)) {
+			//blocks are in snapblocks anyway, next catch up will fix the index
+			pr_err_failure("snapidx_insert");
+			break;
+		}
+	}
+
+	path_put(&snapdir);
+	return;
+
+__write_out_batch_finish1:
+	release_batch_claims(e, batch, ncaps);
+__write_out_batch_finish0:
+	path_put(&snapdir);
+}
+
+void drain_epoch_pending_captures(struct epoch_shard *shard) {
+	struct epoch *e = shard->e;
+	struct llist_node *list = llist_del_all(&shard->pending_captures);
+	if(list == NULL) {
+		return;
+	}
+
+	//llist is LIFO, captures must be written in arrival order
+	list = llist_reverse_order(list);
+
+	struct snapshot_batch batch;
+	size_t batch_max = get_batch_max_captures();
+
+	//degrade to one capture at a time rather than dropping them
+	struct snapshot_capture *cap1;
+	struct snapblock_file_hdr hdr1;
+	struct write_snapblock_args wargs1;
+	u64 rec_off1;
+	struct kvec kv1[SNAPBLOCK_MAX_KVECS_PER_RECORD];
+	struct bio_vec bv1[SNAPBLOCK_MAX_BVECS_PER_RECORD];
+	struct page *pages1[SNAPBLOCK_MAX_V2_PAGES_PER_RECORD];
+	void *cbuf1;
+	struct snapblock_exthdr_buf exthdr1;
+	struct snapshot_dedup_key dkey1;
+	struct snapshot_aead_req *areq1;
+
+	bool batch_allocated = alloc_snapshot_batch(&batch, batch_max);
+	if(unlikely(!batch_allocated)) {
+		pr_err_failure("alloc_snapshot_batch");
+		batch_max = 1;
+		batch.caps = &cap1;
+		batch.hdrs = &hdr1;
+		batch.wargs = &wargs1;
+		batch.rec_offs = &rec_off1;
+		batch.kv = kv1;
+		batch.bv = bv1;
+		batch.pages = pages1;
+		batch.cbufs = &cbuf1;
+		batch.exthdrs = &exthdr1;
+		batch.dkeys = &dkey1;
+		batch.areqs = &areq1;
+	}
+
+	while(list != NULL) {
+		size_t ncaps = 0;
+
+		while(list != NULL && ncaps < batch_max) {
+			batch.caps[ncaps++] = llist_entry(list, struct snapshot_capture, node);
+			list = list->next;
+		}
+
+		atomic_sub(ncaps, &shard->nr_pending_captures);
+
+		write_out_batch(shard, &batch, ncaps);
+
+		for(size_t i = 0; i < ncaps; i++) {
+			free_snapshot_capture(batch.caps[i]);
+			//if it is the last one, cleanup runs after us (ordered lane,
+			//or it waits for us if the shard has a lane of its own)
+			put_an_epoch(e);
+		}
+	}
+
+	if(likely(batch_allocated)) {
+		free_snapshot_batch(&batch);
+	}
+}
+
+void epoch_pending_captures_work(struct lane_work *work) {
+	struct epoch_shard *shard = container_of(
+			to_lane_delayed_work(work), struct epoch_shard, pending_captures_work);
+
+	drain_epoch_pending_captures(shard);
+}
+
+void expedite_epoch_pending_captures(struct epoch *e) {
+	WRITE_ONCE(e->ended, true);
+	smp_mb();
+
+	for(unsigned int i = 0; i < e->nr_shards; i++) {
+		lane_mod_delayed_work(e->shards[i].lane, &e->shards[i].pending_captures_work, 0);
+	}
+}
+
+void flush_epoch_pending_captures(struct epoch *e) {
+	for(unsigned int i = 0; i < e->nr_shards; i++) {
+		lane_flush_delayed_work(&e->shards[i].pending_captures_work);
+	}
+}
+
+/**
+ *
+ * epoch dispatch
+ *
+ */
+
+// ordering only matters between captures of the same block
+static inline struct epoch_shard *epoch_shard_of(struct epoch *e, sector_t blknr) {
+	if(e->nr_shards == 1) {
+		return &e->shards[0];
+	}
+
+	return &e->shards[hash_64(blknr, 32) % e->nr_shards];
+}
+
+// the capture reference goes to the epoch shard pending list
+static void epoch_queue_capture(struct snapshot_capture *cap) {
+	struct epoch *e = cap->e;
+	struct epoch_shard *shard = epoch_shard_of(e, cap->block_nr);
+
+	//this one keeps the epoch alive until queuing is done: the
+	//capture may be written out (and put) as soon as it is in the list
+	get_an_epoch(e);
+
+	llist_add(&cap->node, &shard->pending_captures);
+
+	bool expedite = 
+		atomic_inc_return(&shard->nr_pending_captures) == get_batch_max_captures() ||
+		READ_ONCE(e->ended);
+
+	if(expedite) {
+		lane_mod_delayed_work(shard->lane, &shard->pending_captures_work, 0);
+	} else {
+		//no-op if already pending: the first capture sets the deadline
+		lane_queue_delayed_work(shard->lane, &shard->pending_captures_work, 
+				usecs_to_jiffies(READ_ONCE(batch_linger_usecs)));
+	}
+
+	//if last, cleanup cancels any timer we may have armed
+	put_an_epoch(e);
+}
+
+/**
+ *
+ * per-CPU capture rings
+ *
+ * the capture path (task context, preemption disabled) copies the block
+ * into a preallocated slot of its CPU ring and bumps the ring head,
+ * no locks, no allocations, no workqueue. A single module-wide drainer
+ * moves captures from every ring to their epoch pending list.
+ *
+ * Ordering: each capture gets a module-wide sequence number. The drainer
+ * reads the last issued one, waits for the (non-preemptible, so short)
+ * captures still in progress on every CPU, and then takes every capture
+ * up to it, from rings and overflow list, in sequence order. Whatever
+ * comes later gets a greater number, so two captures of the same block
+ * reach the epoch in the same order they were taken, as the ordered wq
+ * alone guaranteed before.
+ *
+ * Full ring, blocks bigger than a slot, or non-task context fall back
+ * to an atomic allocation on the overflow list, same ordering rules.
+ *
+ */
+
+#define CAPTURE_RING_MAX_SLOTS 4096
+
+static unsigned int capture_ring_slots = 64;
+module_param(capture_ring_slots, uint, 0444);
+MODULE_PARM_DESC(capture_ring_slots, 
+		"number of preallocated capture slots per CPU (rounded up to a power of 2)");
+
+struct capture_ring {
+	//producer side, owned by the CPU
+	u32 head ____cacheline_aligned;
+	local_t busy;
+
+	//consumer side, owned by the drainer
+	u32 tail ____cacheline_aligned;
+
+	u32 mask;
+	struct snapshot_capture *slots;
+};
+
+static struct capture_ring __percpu *capture_rings;
+static atomic64_t captures_seq = ATOMIC64_INIT(0);
+static LLIST_HEAD(overflow_captures);
+
+static DEFINE_MUTEX(capture_rings_drain_lock);
+static void capture_rings_drain_work(struct work_struct *work);
+static DECLARE_WORK(capture_rings_drain, capture_rings_drain_work);
+
+static inline void kick_capture_rings_drain(void) {
+	if(!work_pending(&capture_rings_drain)) {
+		queue_work(system_unbound_wq, &capture_rings_drain);
+	}
+}
+
+static bool alloc_capture_rings(void) {
+	capture_rings = alloc_percpu(struct capture_ring);
+	if(capture_rings == NULL) {
+		pr_err_failure("alloc_percpu");
+		return false;
+	}
+
+	u32 nslots = roundup_pow_of_two(
+			clamp_t(unsigned int, capture_ring_slots, 1, CAPTURE_RING_MAX_SLOTS));
+
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		struct capture_ring *ring = per_cpu_ptr(capture_rings, cpu);
+
+		ring->mask = nslots - 1;
+		local_set(&ring->busy, 0);
+
+		ring->slots = kvcalloc(nslots, sizeof(struct snapshot_capture), GFP_KERNEL);
+		if(ring->slots == NULL) {
+			pr_err_failure("kvcalloc");
+			return false;
+		}
+
+		for(u32 i = 0; i < nslots; i++) {
+			ring->slots[i].block = kmem_cache_alloc(block_cache, GFP_KERNEL);
+			if(ring->slots[i].block == NULL) {
+				pr_err_failure("kmem_cache_alloc");
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+//also on partial allocations, rings must be empty
+static void free_capture_rings(void) {
+	if(capture_rings == NULL) {
+		return;
+	}
+
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		struct capture_ring *ring = per_cpu_ptr(capture_rings, cpu);
+
+		if(ring->slots == NULL) {
+			continue;
+		}
+
+		for(u32 i = 0; i <= ring->mask; i++) {
+			if(ring->slots[i].block != NULL) {
+				kmem_cache_free(block_cache, ring->slots[i].block);
+			}
+		}
+
+		kvfree(ring->slots);
+	}
+
+	free_percpu(capture_rings);
+	capture_rings = NULL;
+}
+
+// the capture reference goes to the ring or to the overflow list,
+// and so does the page reference, if page is not NULL: then the block
+// is not copied at all, only the page pointer is stored
+static bool push_capture(
+		struct epoch *e, const char* blk, 
+		struct page *page, u32 page_off, 
+		sector_t blknr, u32 blksize) {
+
+	if(unlikely(!memory_try_charge(capture_cost(blksize)))) {
+		atomic_long_inc(&captures_over_budget);
+		return false;
+	}
+
+	bool rv = true;
+	struct capture_ring *ring = get_cpu_ptr(capture_rings);
+
+	//the drainer waits for this to go back to 0, the sequence
+	//number must be taken once it can see we are in progress
+	local_inc(&ring->busy);
+	smp_mb();
+
+	u32 head = ring->head;
+	bool use_slot = 
+		in_task() &&
+		(page != NULL || blksize <= SNAPSHOT_BLOCK_CACHE_SIZE) &&
+		head - smp_load_acquire(&ring->tail) <= ring->mask;
+
+	if(likely(use_slot)) {
+		struct snapshot_capture *slot = &ring->slots[head & ring->mask];
+
+		slot->seq = atomic64_inc_return(&captures_seq);
+		slot->e = e;
+		slot->block_nr = blknr;
+		slot->blocksize = blksize;
+
+		//the slot buffer stays where it is either way
+		slot->page = page;
+		if(page != NULL) {
+			slot->page_off = page_off;
+		} else {
+			memcpy(slot->block, blk, sizeof(char) * blksize);
+		}
+
+		smp_store_release(&ring->head, head + 1);
+	} else {
+		struct snapshot_capture *cap = page != NULL ?
+			alloc_snapshot_capture_page(page, page_off, blksize) :
+			alloc_snapshot_capture(blksize);
+
+		if(cap != NULL) {
+			cap->seq = atomic64_inc_return(&captures_seq);
+			cap->e = e;
+			cap->block_nr = blknr;
+
+			if(page == NULL) {
+				memcpy(cap->block, blk, sizeof(char) * blksize);
+			}
+
+			llist_add(&cap->node, &overflow_captures);
+		} else {
+			rv = false;
+		}
+	}
+
+	smp_mb();
+	local_dec(&ring->busy);
+
+	put_cpu_ptr(capture_rings);
+
+	if(likely(rv)) {
+		kick_capture_rings_drain();
+	} else {
+		memory_uncharge(capture_cost(blksize));
+	}
+
+	return rv;
+}
+
+static int cmp_captures_seq(const void *a, const void *b) {
+	const struct snapshot_capture *ca = *(const struct snapshot_capture* const*) a;
+	const struct snapshot_capture *cb = *(const struct snapshot_capture* const*) b;
+
+	if(ca->seq < cb->seq) {
+		return -1;
+	}
+
+	return ca->seq > cb->seq;
+}
+
+static void put_back_overflow_captures(struct llist_node *first) {
+	if(first == NULL) {
+		return;
+	}
+
+	struct llist_node *last = first;
+	while(last->next != NULL) {
+		last = last->next;
+	}
+
+	llist_add_batch(first, last, &overflow_captures);
+}
+
+// moves a ring slot out to a brand new capture, the slot gets a
+// fresh buffer instead of the block being copied again (or keeps
+// its own, if the block was handed over within a page)
+static struct snapshot_capture* take_ring_slot(struct snapshot_capture *slot) {
+	struct snapshot_capture *cap = mempool_alloc(capture_pool, GFP_KERNEL);
+
+	cap->e = slot->e;
+	cap->seq = slot->seq;
+	cap->block_nr = slot->block_nr;
+	cap->blocksize = slot->blocksize;
+	cap->page = slot->page;
+
+	if(slot->page != NULL) {
+		cap->page_off = slot->page_off;
+		cap->block = (char*) page_address(slot->page) + slot->page_off;
+		slot->page = NULL;
+	} else {
+		cap->block = slot->block;
+		slot->block = mempool_alloc(block_pool, GFP_KERNEL);
+	}
+
+	slot->e = NULL;
+
+	return cap;
+}
+
+// false only if the scratch array can't be allocated,
+// nothing has been taken in that case
+static bool drain_capture_rings_once(void) {
+	u64 upto = atomic64_read(&captures_seq);
+	smp_mb();
+
+	//captures still in progress may have got a number up to upto
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		struct capture_ring *ring = per_cpu_ptr(capture_rings, cpu);
+		while(local_read(&ring->busy) != 0) {
+			cpu_relax();
+		}
+	}
+
+	smp_rmb();
+
+	struct llist_node *overflow = llist_del_all(&overflow_captures);
+	struct llist_node *later = NULL;
+	size_t ntaken = 0;
+
+	struct snapshot_capture *cap;
+	struct snapshot_capture *tmp;
+
+	llist_for_each_entry_safe(cap, tmp, overflow, node) {
+		if(cap->seq <= upto) {
+			ntaken++;
+		}
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct capture_ring *ring = per_cpu_ptr(capture_rings, cpu);
+		ntaken += smp_load_acquire(&ring->head) - ring->tail;
+	}
+
+	if(ntaken == 0) {
+		return true;
+	}
+
+	struct snapshot_capture **taken = kvmalloc_array(ntaken, sizeof(struct snapshot_capture*), GFP_KERNEL);
+	if(taken == NULL) {
+		pr_err_failure("kvmalloc_array");
+		put_back_overflow_captures(overflow);
+		return false;
+	}
+
+	size_t n = 0;
+
+	llist_for_each_entry_safe(cap, tmp, overflow, node) {
+		if(cap->seq <= upto) {
+			taken[n++] = cap;
+		} else {
+			cap->node.next = later;
+			later = &cap->node;
+		}
+	}
+
+	put_back_overflow_captures(later);
+
+	for_each_possible_cpu(cpu) {
+		struct capture_ring *ring = per_cpu_ptr(capture_rings, cpu);
+		u32 tail = ring->tail;
+		u32 head = smp_load_acquire(&ring->head);
+
+		//later captures are behind these, ring order is sequence order
+		while(tail != head && n < ntaken && ring->slots[tail & ring->mask].seq <= upto) {
+			taken[n++] = take_ring_slot(&ring->slots[tail & ring->mask]);
+			tail++;
+		}
+
+		smp_store_release(&ring->tail, tail);
+	}
+
+	sort(taken, n, sizeof(struct snapshot_capture*), cmp_captures_seq, NULL);
+
+	for(size_t i = 0; i < n; i++) {
+		epoch_queue_capture(taken[i]);
+	}
+
+	kvfree(taken);
+	return true;
+}
+
+// process context only, after this returns every capture pushed
+// before the call is on its epoch pending list
+void drain_capture_rings(void) {
+	mutex_lock(&capture_rings_drain_lock);
+
+	while(!drain_capture_rings_once()) {
+		msleep(1);
+	}
+
+	mutex_unlock(&capture_rings_drain_lock);
+}
+
+static void capture_rings_drain_work(struct work_struct __always_unused *work) {
+	drain_capture_rings();
+}
+
+/**
+ *
+ * setup and teardown
+ *
+ */
+
+int setup_snapshot(void) {
+#ifdef SLAB_NO_MERGE
+	slab_flags_t flags = SLAB_NO_MERGE;
+#else
+	slab_flags_t flags = 0;
+#endif
+
+	capture_cache = kmem_cache_create("bdsnap_capture", 
+			sizeof(struct snapshot_capture), 0, flags, NULL);
+	if(capture_cache == NULL) {
+		pr_err_failure("kmem_cache_create");
+		return -ENOMEM;
+	}
+
+	//aligned: blocks are handed to O_DIRECT writes as they are
+	block_cache = kmem_cache_create("bdsnap_block", 
+			SNAPSHOT_BLOCK_CACHE_SIZE, SNAPSHOT_BLOCK_CACHE_SIZE, flags, NULL);
+	if(block_cache == NULL) {
+		pr_err_failure("kmem_cache_create");
+		goto __setup_snapshot_finish0;
+	}
+
+	capture_pool = mempool_create_slab_pool(capture_reserve, capture_cache);
+	if(capture_pool == NULL) {
+		pr_err_failure("mempool_create_slab_pool");
+		goto __setup_snapshot_finish1;
+	}
+
+	block_pool = mempool_create_slab_pool(capture_reserve, block_cache);
+	if(block_pool == NULL) {
+		pr_err_failure("mempool_create_slab_pool");
+		goto __setup_snapshot_finish2;
+	}
+
+	if(!alloc_capture_rings()) {
+		goto __setup_snapshot_finish3;
+	}
+
+	if(register_dedup_shrinker() != 0) {
+		goto __setup_snapshot_finish3;
+	}
+
+	return 0;
+
+__setup_snapshot_finish3:
+	free_capture_rings();
+	mempool_destroy(block_pool);
+__setup_snapshot_finish2:
+	mempool_destroy(capture_pool);
+__setup_snapshot_finish1:
+	kmem_cache_destroy(block_cache);
+__setup_snapshot_finish0:
+	kmem_cache_destroy(capture_cache);
+	return -ENOMEM;
+}
+
+//every epoch must be gone already
+void destroy_snapshot(void) {
+	unregister_dedup_shrinker();
+	cancel_work_sync(&capture_rings_drain);
+	free_capture_rings();
+	mempool_destroy(block_pool);
+	mempool_destroy(capture_pool);
+	kmem_cache_destroy(block_cache);
+	kmem_cache_destroy(capture_cache);
+}
+
+/**
+ *
+ * exported fns, the ones which the FS-specific part implementor should use
+ *
+ */
+
+void* bdsnap_search_device(
+		const struct block_device* bdev) {
+
+	struct object_data *data = get_device_data_cached(bdev);
+	if(data == NULL) {
+		return NULL;
+	}
+
+	bool not_valid =
+		data->e == NULL ||
+		data->wq_is_destroyed;
+
+	if(unlikely(not_valid)) {
+		return NULL;
+	}
+
+	return (void*) data;
+}
+
+EXPORT_SYMBOL_GPL(bdsnap_search_device);
+
+bool bdsnap_block_needs_snapshot(void* handle, sector_t blocknr) {
+	struct object_data *data = (struct object_data*) handle;
+	bool ret = false;
+
+	if(unlikely(data == NULL)) {
+		return false;
+	}
+
+	rcu_read_lock();
+
+	//epochs and claims are freed after a grace period
+	struct epoch *e = READ_ONCE(data->e);
+	if(likely(e != NULL)) {
+		struct snapshot_claims *claims = rcu_dereference(e->claims);
+		ret = claims == NULL || !claims_test(claims, blocknr);
+	}
+
+	rcu_read_unlock();
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(bdsnap_block_needs_snapshot);
+
+// lockless: device teardown waits for a grace period after setting
+// wq_is_destroyed, and then drains the rings, so whatever got past
+// the check below is on its epoch pending list before the wq goes away.
+// A block already claimed during the epoch is not captured again, the
+// page (if any) is put right away
+static bool __do_make_snapshot(
+		void* handle, const char* block, 
+		struct page *page, u32 page_off,
+		sector_t blocknr, u32 blocksize) {
+
+	struct object_data *data = (struct object_data*) handle;
+	bool ret = false;
+
+	if(unlikely(data == NULL)) {
+		return false;
+	}
+
+	rcu_read_lock();
+
+	//epochs (and claims) are freed after a grace period,
+	//and a dying one can't be got
+	struct epoch *e = READ_ONCE(data->e);
+	if(unlikely(e == NULL || READ_ONCE(data->wq_is_destroyed))) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	struct snapshot_claims *claims = rcu_dereference(e->claims);
+	int claimed = claims != NULL ? claims_claim(claims, blocknr) : -ENOSPC;
+
+	if(claimed == 0) {
+		//the first capture of the block is the one that counts:
+		//no reference, no copy, nothing to write out
+		if(page != NULL) {
+			put_page(page);
+		}
+
+		rcu_read_unlock();
+		return true;
+	}
+
+	if(likely(get_an_epoch(e))) {
+		ret = push_capture(e, block, page, page_off, blocknr, blocksize);
+		if(unlikely(!ret)) {
+			//missing from the snapshot, see lost captures
+			count_lost_captures(e, 1);
+			put_an_epoch(e);
+		}
+	}
+
+	if(unlikely(!ret && claimed > 0)) {
+		claims_release(claims, blocknr);
+	}
+
+	rcu_read_unlock();
+
+	return ret;
+}
+
+bool bdsnap_make_snapshot(
+		void* handle, const char* block, 
+		sector_t blocknr, u64 blocksize) {
+
+	return __do_make_snapshot(handle, block, NULL, 0, blocknr, blocksize);
+}
+
+EXPORT_SYMBOL_GPL(bdsnap_make_snapshot);
+
+bool bdsnap_make_snapshot_page(
+		void* handle, struct page *page, unsigned int offset,
+		sector_t blocknr, u64 blocksize) {
+
+	if(unlikely(page == NULL || offset + blocksize > page_size(page))) {
+		if(page != NULL) {
+			put_page(page);
+		}
+
+		return false;
+	}
+
+	bool ret = __do_make_snapshot(handle, NULL, page, offset, blocknr, blocksize);
+	if(!ret) {
+		put_page(page);
+	}
+
+	return ret;
+}
+
+EXPORT_SYMBOL_GPL(bdsnap_make_snapshot_page);
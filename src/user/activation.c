@@ -1,7 +1,11 @@
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -12,13 +16,17 @@ static void print_help(const char* prog, const char* msg) {
 		fprintf(stderr, "args-error: %s\n", msg);
 	}
 
-	printf("usage: %s [-h] [-a or -d] [-c chrdev or -s] <-f device or file> <-p password>\n", prog);
+	printf("usage: %s [-h] [-a or -d] [-c chrdev or -s] <-f device or file or -l list> <-p password> [-o options]\n", prog);
 	puts(" -a: activate snapshot service for device (not mandatory, default)");
 	puts(" -d: deactivate snapshot service for device (not mandatory)");
 	puts(" -c: use *that* character device as an interface to the snapshot kernel module (not mandatory)");
 	puts(" -s: use sysfs as the interface to the snapshot kernel module (not mandatory, default)");
-	puts(" -f: the block device or regular image file (mandatory)");
+	puts(" -f: the block device or regular image file (mandatory, unless -l)");
+	puts(" -l: a file listing devices or image files, one per line, \"-\" for stdin: (de)activated as a single batch");
 	puts(" -p: the password (mandatory)");
+	puts(" -o: per-device options on activation, comma separated (not mandatory)");
+	puts("     compress=none|lz4|zstd: compress captured blocks (default none)");
+	puts("     level=N: compression level, 0 is the default (lz4: 1+ selects lz4hc)");
 	puts(" -h: to print this help (not mandatory)");
 }
 
@@ -106,7 +114,235 @@ static void deactivate_chrdev(const char* path, const char* passwd, const char*
 	__do_chrdev(path, passwd, chrdev_path, DEACTIVATE_CHRDEV_IOCTL_CMD);
 }
 
-static void do_basic_checks_on(const char* prog, const char* path, const char* passwd) {
+/* batches */
+
+#define ACTIVATE_BATCH_CHRDEV_IOCTL_CMD 2
+#define DEACTIVATE_BATCH_CHRDEV_IOCTL_CMD 3
+#define BATCH_MAX_ENTRIES 4096
+//all the "index errno" lines of a sysfs batch fit the page batch_status is
+#define SYSFS_BATCH_MAX_ENTRIES(pagesize) ((pagesize) / (sizeof("4095 -4095\n") - 1))
+
+struct activation_batch_ioctl_args {
+	const char* data;
+	size_t datalen;
+	int *statuses;
+	size_t nr_statuses;
+};
+
+//one per line, empty lines are skipped (as the module does)
+static char** read_list(FILE* f, size_t* out_n) {
+	char **paths = NULL;
+	size_t n = 0;
+	size_t cap = 0;
+
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+
+	while((len = getline(&line, &linecap, f)) != -1) {
+		while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' ' || line[len - 1] == '\t')) {
+			line[--len] = 0;
+		}
+
+		if(len == 0) {
+			continue;
+		}
+
+		if(n == cap) {
+			cap = cap == 0 ? 64 : cap * 2;
+			char **tmp = (char**) realloc(paths, sizeof(char*) * cap);
+			if(tmp == NULL) {
+				goto __read_list_fail;
+			}
+			paths = tmp;
+		}
+
+		paths[n] = strdup(line);
+		if(paths[n] == NULL) {
+			goto __read_list_fail;
+		}
+
+		n++;
+	}
+
+	free(line);
+	*out_n = n;
+	return paths;
+
+__read_list_fail:
+	perror("malloc");
+	for(size_t i = 0; i < n; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(line);
+	return NULL;
+}
+
+//as many paths (from the first) as fit a request: "p0\np1...\rtail\0"
+static size_t batch_chunk_len(char** paths, size_t n, size_t tail_len, size_t max_len, size_t max_entries) {
+	size_t len = tail_len + 2;
+	size_t i = 0;
+
+	for(; i < n && i < max_entries; i++) {
+		len += strlen(paths[i]) + (i > 0 ? 1 : 0);
+		if(len > max_len) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static char* batch_join(char** paths, size_t n, const char* tail, size_t* out_len) {
+	size_t s = strlen(tail) + 2;
+	for(size_t i = 0; i < n; i++) {
+		s += strlen(paths[i]) + 1;
+	}
+
+	char* buf = (char*) malloc(sizeof(char) * s);
+	if(buf == NULL) {
+		return NULL;
+	}
+
+	size_t off = 0;
+	for(size_t i = 0; i < n; i++) {
+		off += snprintf(buf + off, s - off, i > 0 ? "\n%s" : "%s", paths[i]);
+	}
+
+	off += snprintf(buf + off, s - off, "\r%s", tail);
+
+	*out_len = off + 1;
+	return buf;
+}
+
+//statuses of the failed entries, "index errno" lines
+static int read_batch_status(int* statuses, size_t n) {
+	FILE* f = fopen("/sys/module/blkdev_snapshot/batch_status", "r");
+	if(f == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	size_t idx;
+	int status;
+	while(fscanf(f, "%zu %d", &idx, &status) == 2) {
+		if(idx < n) {
+			statuses[idx] = status;
+		}
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static int __do_sysfs_batch(char* data, size_t datalen, int* statuses, size_t n, bool activate) {
+	const char *sysfs_path = activate ? 
+		"/sys/module/blkdev_snapshot/activate_snapshot_batch" : 
+		"/sys/module/blkdev_snapshot/deactivate_snapshot_batch";
+
+	int fd = open(sysfs_path, O_WRONLY);
+	if(fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	int err = write(fd, data, datalen);
+	close(fd);
+
+	if(err < 0) {
+		perror("write");
+		return -1;
+	}
+
+	return read_batch_status(statuses, n);
+}
+
+static int __do_chrdev_batch(char* data, size_t datalen, int* statuses, size_t n, const char* chrdev_path, bool activate) {
+	int fd = open(chrdev_path, 0);
+	if(fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	struct activation_batch_ioctl_args act;
+	act.data = data;
+	act.datalen = datalen;
+	act.statuses = statuses;
+	act.nr_statuses = n;
+
+	int err = ioctl(fd, activate ? ACTIVATE_BATCH_CHRDEV_IOCTL_CMD : DEACTIVATE_BATCH_CHRDEV_IOCTL_CMD, &act);
+	close(fd);
+
+	if(err < 0) {
+		perror("ioctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+//sysfs takes up to a page per write (and per statuses read), bigger lists go in more batches
+static bool do_batch(char** paths, size_t n, const char* tail, const char* chrdev, bool activate) {
+	size_t pagesize = (size_t) sysconf(_SC_PAGESIZE);
+	size_t max_len = chrdev == NULL ? pagesize : SIZE_MAX;
+	size_t max_entries = chrdev == NULL ? SYSFS_BATCH_MAX_ENTRIES(pagesize) : BATCH_MAX_ENTRIES;
+	if(max_entries > BATCH_MAX_ENTRIES) {
+		max_entries = BATCH_MAX_ENTRIES;
+	}
+	bool all_ok = true;
+
+	int *statuses = (int*) calloc(BATCH_MAX_ENTRIES, sizeof(int));
+	if(statuses == NULL) {
+		perror("malloc");
+		return false;
+	}
+
+	for(size_t i = 0; i < n;) {
+		size_t nchunk = batch_chunk_len(paths + i, n - i, strlen(tail), max_len, max_entries);
+		if(nchunk == 0) {
+			printf("%s: %s\n", paths[i], strerror(ENAMETOOLONG));
+			all_ok = false;
+			i++;
+			continue;
+		}
+
+		size_t datalen;
+		char *data = batch_join(paths + i, nchunk, tail, &datalen);
+		if(data == NULL) {
+			perror("malloc");
+			all_ok = false;
+			break;
+		}
+
+		memset(statuses, 0, sizeof(int) * nchunk);
+
+		int err = chrdev == NULL ? 
+			__do_sysfs_batch(data, datalen, statuses, nchunk, activate) : 
+			__do_chrdev_batch(data, datalen, statuses, nchunk, chrdev, activate);
+
+		//the password
+		memset(data, 0, datalen);
+		free(data);
+
+		if(err != 0) {
+			all_ok = false;
+			break;
+		}
+
+		for(size_t j = 0; j < nchunk; j++) {
+			printf("%s: %s\n", paths[i + j], statuses[j] == 0 ? "ok" : strerror(-statuses[j]));
+			all_ok = all_ok && statuses[j] == 0;
+		}
+
+		i += nchunk;
+	}
+
+	free(statuses);
+	return all_ok;
+}
+
+static void do_basic_checks_on(const char* prog, const char* path, const char* passwd, const char* options) {
 	if(passwd == NULL) {
 		print_help(prog, "a password is required (see opt \"-p\")");
 		exit(EXIT_FAILURE);
@@ -126,6 +362,11 @@ static void do_basic_checks_on(const char* prog, const char* path, const char* p
 		print_help(prog, "filepaths cannot contain a carriage return (aka \"\\r\")");
 		exit(EXIT_FAILURE);
 	}
+
+	if(options != NULL && strchr(options, '\r') != NULL) {
+		print_help(prog, "options cannot contain a carriage return (aka \"\\r\")");
+		exit(EXIT_FAILURE);
+	}
 }
 
 typedef void (*mgmt_fpt)(const char*, const char*, const char*);
@@ -148,9 +389,11 @@ int main(int argc, char** argv){
 	char *chrdev = NULL;
 	char *filepath = NULL;
 	char *passwd = NULL;
+	char *options = NULL;
+	char *listpath = NULL;
 	bool need_to_activate = true;
 
-	while((ch=getopt(argc, argv, "c:adf:p:hs")) != -1) {
+	while((ch=getopt(argc, argv, "c:adf:l:p:o:hs")) != -1) {
 		switch(ch) {
 			case 'c':
 				chrdev = optarg;
@@ -167,9 +410,15 @@ int main(int argc, char** argv){
 			case 'f':
 				filepath = optarg;
 				break;
+			case 'l':
+				listpath = optarg;
+				break;
 			case 'p':
 				passwd = optarg;
 				break;
+			case 'o':
+				options = optarg;
+				break;
 			case 'h':
 				print_help(argv[0], NULL);
 				exit(EXIT_SUCCESS);
@@ -177,10 +426,66 @@ int main(int argc, char** argv){
 		}
 	}
 
-	do_basic_checks_on(argv[0], filepath, passwd);
+	if(filepath != NULL && listpath != NULL) {
+		print_help(argv[0], "either a device or file (see opt \"-f\") or a list (see opt \"-l\")");
+		exit(EXIT_FAILURE);
+	}
+
+	char **paths = NULL;
+	size_t npaths = 0;
+
+	if(listpath != NULL) {
+		FILE *list = strcmp(listpath, "-") == 0 ? stdin : fopen(listpath, "r");
+		if(list == NULL) {
+			perror("fopen");
+			exit(EXIT_FAILURE);
+		}
+
+		paths = read_list(list, &npaths);
+		if(list != stdin) {
+			fclose(list);
+		}
+
+		if(paths == NULL) {
+			exit(EXIT_FAILURE);
+		}
+
+		for(size_t i = 0; i < npaths; i++) {
+			do_basic_checks_on(argv[0], paths[i], passwd, options);
+		}
+	} else {
+		do_basic_checks_on(argv[0], filepath, passwd, options);
+	}
+
 	mgmt_fpt fn = get_mgmt_fn(chrdev, need_to_activate);
 
-	fn(filepath, passwd, chrdev);
+	//options go as a third field: "path\rpasswd\roptions"
+	char *passwd_and_options = passwd;
+	if(options != NULL && need_to_activate) {
+		passwd_and_options = concat(passwd, options);
+		if(passwd_and_options == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bool ok = true;
+
+	if(listpath != NULL) {
+		//"path\npath...\rpasswd\roptions", authenticated once per batch
+		ok = do_batch(paths, npaths, passwd_and_options, chrdev, need_to_activate);
+
+		for(size_t i = 0; i < npaths; i++) {
+			free(paths[i]);
+		}
+		free(paths);
+	} else {
+		fn(filepath, passwd_and_options, chrdev);
+	}
+
+	if(passwd_and_options != passwd) {
+		free(passwd_and_options);
+	}
 
-	exit(EXIT_SUCCESS);
+	exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
 }
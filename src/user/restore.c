@@ -1,3 +1,5 @@
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,22 +9,44 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <lz4.h>
+#include <zstd.h>
+#include <openssl/evp.h>
 
 static char *snapblocks_path = NULL;
 static char *device_path = NULL;
 static uint64_t restore_only_blknum = 0;
 static bool restore_all = true;
 static bool ask = true;
+static bool verify_only = false;
+static bool allow_incomplete = false;
+static uint8_t aead_key[32];
+static size_t aead_key_size = 0;
 
 static void print_help(const char* prog, const char* msg) {
 	if(msg) {
 		fprintf(stderr, "args-error: %s\n", msg);
 	}
 
-	printf("usage: %s [-h] <-s snapblocks_path> <-f device path> [-n blknum] [-a or -o] [-p or -c]\n", prog);
+	printf("usage: %s [-h] <-s snapblocks_path> <-f device path or --verify-only> [-k key] [-n blknum] [-a or -o] [-p or -c] [--allow-incomplete]\n", prog);
 	puts(" -h: prints this help");
-	puts(" -s: specify the snapblocks path (mandatory)");
-	puts(" -f: specify the block device or regular image path (mandatory)");
+	puts(" -s: specify the snapblocks path, or the snapshot directory of the epoch to take every segment from (mandatory)");
+	puts(" -f: specify the block device or regular image path (mandatory, unless --verify-only)");
+	puts(" --verify-only: walk the whole snapblocks and check every checksum, nothing is restored");
+	puts(" --allow-incomplete: restore a snapshot that misses blocks anyway (refused otherwise)");
+	puts(" -k: hex key of encrypted snapblocks, as given on activation (mandatory for them)");
 	puts(" -n: specify exactly one block number to restore (not mandatory)");
 	puts(" -a: restore every block I find in snapblocks (not mandatory, default)");
 	puts(" -o: dont restore every block I find in snapblocks (not mandatory)");
@@ -45,12 +69,41 @@ static uint64_t to_u64(const char* arg) {
 
 enum snapblock_payload_type : uint64_t {
 	SNAPBLOCK_PAYLOAD_TYPE_RAW,
+	SNAPBLOCK_PAYLOAD_TYPE_LZ4,
+	SNAPBLOCK_PAYLOAD_TYPE_ZSTD,
+	SNAPBLOCK_PAYLOAD_TYPE_ZERO,
+	SNAPBLOCK_PAYLOAD_TYPE_REF,
 };
 
+// the payload is followed by its checksum, last field of the extended header
+#define SNAPBLOCK_PAYLOAD_FLAG_CRC32C (1ULL << 63)
+
+// the payload is the AES-GCM ciphertext of the payload of that type
+#define SNAPBLOCK_PAYLOAD_FLAG_AES_GCM (1ULL << 62)
+
+#define SNAPBLOCK_PAYLOAD_TYPE_MASK \
+	(~(SNAPBLOCK_PAYLOAD_FLAG_CRC32C | SNAPBLOCK_PAYLOAD_FLAG_AES_GCM))
+
 static const char* payload_type_to_str(enum snapblock_payload_type type) {
 	if(type == SNAPBLOCK_PAYLOAD_TYPE_RAW) {
 		return "raw fs blocks";
 	}
+
+	if(type == SNAPBLOCK_PAYLOAD_TYPE_LZ4) {
+		return "lz4 compressed fs blocks";
+	}
+
+	if(type == SNAPBLOCK_PAYLOAD_TYPE_ZSTD) {
+		return "zstd compressed fs blocks";
+	}
+
+	if(type == SNAPBLOCK_PAYLOAD_TYPE_ZERO) {
+		return "zero filled fs blocks";
+	}
+
+	if(type == SNAPBLOCK_PAYLOAD_TYPE_REF) {
+		return "same content as an earlier snapblock";
+	}
 	
 	return "(unknown)";
 }
@@ -63,24 +116,378 @@ struct snapblock_file_hdr {
 	uint64_t payld_off;
 } __attribute__((__packed__));
 
-static void __do_restore_rawblocks(int snaps_fd, int device_fd, const struct snapblock_file_hdr *mhdr) {
-	lseek(snaps_fd, mhdr->payld_off - sizeof(struct snapblock_file_hdr), SEEK_CUR);
+#define payload_type_of(mhdr) \
+	((enum snapblock_payload_type) ((mhdr)->payld_type & SNAPBLOCK_PAYLOAD_TYPE_MASK))
+
+// extended header of compressed payloads and zero blocks
+struct snapblock_rawsiz_exthdr {
+	uint64_t rawsiz;
+} __attribute__((__packed__));
+
+// extended header of references, ref_off is where the
+// header of the record with the very same content is
+struct snapblock_ref_exthdr {
+	uint64_t rawsiz;
+	uint64_t ref_off;
+} __attribute__((__packed__));
+
+#define SNAPBLOCK_AEAD_IV_SIZE 12
+#define SNAPBLOCK_AEAD_TAG_SIZE 16
+
+// after the extended header of the type, before the checksum
+struct snapblock_aead_exthdr {
+	uint8_t iv[SNAPBLOCK_AEAD_IV_SIZE];
+	uint8_t tag[SNAPBLOCK_AEAD_TAG_SIZE];
+	uint32_t reserved;
+} __attribute__((__packed__));
+
+// associated data of the ciphertext
+struct snapblock_aead_aad {
+	uint64_t blknr;
+	uint64_t payld_type;
+} __attribute__((__packed__));
+
+// CRC-32C (Castagnoli) of the payload as stored
+struct snapblock_csum_exthdr {
+	uint32_t crc32c;
+	uint32_t reserved;
+} __attribute__((__packed__));
+
+// v2 groups: 4K header page (page header + record headers), then
+// payloads, each one 4K aligned, payloads smaller than 4K are packed
+// after the aligned ones. Zeros in place of a header are padding
+#define SNAPBLOCKS_V2_MAGIC 0x5ade5aad5abe5af2
+#define SNAPBLOCKS_V2_ALIGN 4096
+
+struct snapblocks_v2_page_hdr {
+	uint64_t magic;
+	uint64_t nhdrs;
+} __attribute__((__packed__));
+
+#define round_up_v2(off) \
+	(((off) + SNAPBLOCKS_V2_ALIGN - 1) & ~((off_t) SNAPBLOCKS_V2_ALIGN - 1))
+
+// walks the records of snapblocks, whatever their format
+struct snapblocks_reader {
+	int fd;
+	bool failed;
+	off_t off;
+	uint8_t page[SNAPBLOCKS_V2_ALIGN];
+	off_t group_off;
+	off_t group_end;
+	size_t group_used;
+	uint64_t group_left;
+};
+
+static size_t snapblock_exthdr_size(const struct snapblock_file_hdr *mhdr) {
+	enum snapblock_payload_type type = payload_type_of(mhdr);
+	size_t size = 0;
+
+	if(type == SNAPBLOCK_PAYLOAD_TYPE_LZ4 || 
+			type == SNAPBLOCK_PAYLOAD_TYPE_ZSTD || 
+			type == SNAPBLOCK_PAYLOAD_TYPE_ZERO) {
+		size = sizeof(struct snapblock_rawsiz_exthdr);
+	} else if(type == SNAPBLOCK_PAYLOAD_TYPE_REF) {
+		size = sizeof(struct snapblock_ref_exthdr);
+	}
+
+	if(mhdr->payld_type & SNAPBLOCK_PAYLOAD_FLAG_AES_GCM) {
+		size += sizeof(struct snapblock_aead_exthdr);
+	}
+
+	if(mhdr->payld_type & SNAPBLOCK_PAYLOAD_FLAG_CRC32C) {
+		size += sizeof(struct snapblock_csum_exthdr);
+	}
+
+	return size;
+}
+
+/**
+ *
+ * crc32c, with the CPU instructions when there are
+ *
+ */
+
+#define CRC32C_POLY_REVERSED 0x82f63b78
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len) {
+	if(crc32c_table[1] == 0) {
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for(int k = 0; k < 8; k++) {
+				c = (c & 1) ? (c >> 1) ^ CRC32C_POLY_REVERSED : c >> 1;
+			}
+
+			crc32c_table[i] = c;
+		}
+	}
+
+	while(len-- > 0) {
+		crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len) {
+	uint64_t crc64 = crc;
+
+	for(; len >= sizeof(uint64_t); len -= sizeof(uint64_t), buf += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, buf, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+
+	crc = (uint32_t) crc64;
+
+	while(len-- > 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+
+	return crc;
+}
+
+static bool crc32c_hw_available(void) {
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len) {
+	for(; len >= sizeof(uint64_t); len -= sizeof(uint64_t), buf += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, buf, sizeof(word));
+		crc = __crc32cd(crc, word);
+	}
+
+	while(len-- > 0) {
+		crc = __crc32cb(crc, *buf++);
+	}
+
+	return crc;
+}
+
+static bool crc32c_hw_available(void) {
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#else
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len) {
+	return crc32c_sw(crc, buf, len);
+}
+
+static bool crc32c_hw_available(void) {
+	return false;
+}
+
+#endif
+
+static uint32_t crc32c(const uint8_t *buf, size_t len) {
+	static int hw = -1;
+	if(hw < 0) {
+		hw = crc32c_hw_available();
+	}
+
+	uint32_t crc = hw ? crc32c_hw(~0U, buf, len) : crc32c_sw(~0U, buf, len);
+
+	return ~crc;
+}
+
+static bool read_exactly(int fd, void *buf, size_t nbytes, off_t off) {
+	ssize_t rerr = pread(fd, buf, nbytes, off);
+	if(rerr < 0) {
+		perror("pread");
+	}
+
+	return rerr == (ssize_t) nbytes;
+}
+
+// next record header of the current v2 group
+static bool next_v2_snapblock(struct snapblocks_reader *r, struct snapblock_file_hdr *mhdr, off_t *hdr_off) {
+	if(r->group_used + sizeof(struct snapblock_file_hdr) > SNAPBLOCKS_V2_ALIGN) {
+		puts("snapblocks header page overflow");
+		r->failed = true;
+		return false;
+	}
+
+	memcpy(mhdr, r->page + r->group_used, sizeof(struct snapblock_file_hdr));
+	*hdr_off = r->group_off + r->group_used;
+
+	off_t end = round_up_v2(*hdr_off + mhdr->payld_off + mhdr->payldsiz);
+	if(end > r->group_end) {
+		r->group_end = end;
+	}
+
+	r->group_used += sizeof(struct snapblock_file_hdr) + snapblock_exthdr_size(mhdr);
+
+	if(--r->group_left == 0) {
+		r->off = r->group_end;
+	}
+
+	return true;
+}
+
+// false at the end of snapblocks, or on errors (r->failed is set)
+static bool next_snapblock(struct snapblocks_reader *r, struct snapblock_file_hdr *mhdr, off_t *hdr_off) {
+	r->failed = true;
+
+	while(r->group_left == 0) {
+		uint64_t magic;
+		ssize_t rerr = pread(r->fd, &magic, sizeof(uint64_t), r->off);
+		if(rerr < 0) {
+			perror("pread");
+		}
+
+		if(rerr != sizeof(uint64_t)) {
+			//torn tail otherwise
+			r->failed = rerr != 0;
+			return false;
+		}
+
+		if(magic == 0) {
+			//padding before a v2 group
+			r->off = round_up_v2(r->off + 1);
+			continue;
+		}
+
+		if(magic == SNAPBLOCK_MAGIC) {
+			if(!read_exactly(r->fd, mhdr, sizeof(struct snapblock_file_hdr), r->off)) {
+				return false;
+			}
+
+			*hdr_off = r->off;
+			r->off += mhdr->payld_off + mhdr->payldsiz;
+			r->failed = false;
+			return true;
+		}
+
+		if(magic != SNAPBLOCKS_V2_MAGIC) {
+			puts("invalid magic number for snapblock header");
+			puts("aborting");
+			return false;
+		}
+
+		if(!read_exactly(r->fd, r->page, SNAPBLOCKS_V2_ALIGN, r->off)) {
+			return false;
+		}
+
+		const struct snapblocks_v2_page_hdr *phdr = (const struct snapblocks_v2_page_hdr*) r->page;
+
+		r->group_off = r->off;
+		r->group_end = r->off + SNAPBLOCKS_V2_ALIGN;
+		r->group_used = sizeof(struct snapblocks_v2_page_hdr);
+		r->group_left = phdr->nhdrs;
+
+		if(r->group_left == 0) {
+			r->off = r->group_end;
+		}
+	}
+
+	if(!next_v2_snapblock(r, mhdr, hdr_off)) {
+		return false;
+	}
+
+	if(mhdr->magic != SNAPBLOCK_MAGIC) {
+		puts("invalid magic number for snapblock header");
+		puts("aborting");
+		return false;
+	}
+
+	r->failed = false;
+	return true;
+}
+
+// NULL on errors (already reported)
+static bool parse_aead_key(const char *hex) {
+	size_t hexlen = strlen(hex);
+	if(hexlen != 32 && hexlen != 48 && hexlen != 64) {
+		return false;
+	}
 
+	for(size_t i = 0; i < hexlen / 2; i++) {
+		unsigned int byte;
+		if(sscanf(&hex[i * 2], "%2x", &byte) != 1) {
+			return false;
+		}
+
+		aead_key[i] = byte;
+	}
+
+	aead_key_size = hexlen / 2;
+
+	return true;
+}
+
+// in place, false if the payload (or its header) is not authentic
+static bool decrypt_payload(int snaps_fd, uint8_t *buf, size_t nbytes, const struct snapblock_file_hdr *mhdr, off_t hdr_off) {
+	struct snapblock_aead_exthdr ehdr;
+	off_t ehdr_off = hdr_off + sizeof(struct snapblock_file_hdr) + snapblock_exthdr_size(mhdr) - 
+		sizeof(struct snapblock_aead_exthdr) - 
+		((mhdr->payld_type & SNAPBLOCK_PAYLOAD_FLAG_CRC32C) ? sizeof(struct snapblock_csum_exthdr) : 0);
+
+	//mhdr may stand for another block (references), the
+	//associated data is made of what the file says
+	struct snapblock_file_hdr stored;
+
+	if(!read_exactly(snaps_fd, &ehdr, sizeof(ehdr), ehdr_off) || 
+			!read_exactly(snaps_fd, &stored, sizeof(stored), hdr_off)) {
+		return false;
+	}
+
+	struct snapblock_aead_aad aad = {
+		.blknr = stored.blknr,
+		.payld_type = payload_type_of(&stored)
+	};
+
+	const EVP_CIPHER *cipher = 
+		aead_key_size == 16 ? EVP_aes_128_gcm() : 
+		aead_key_size == 24 ? EVP_aes_192_gcm() : 
+		EVP_aes_256_gcm();
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(ctx == NULL) {
+		return false;
+	}
+
+	int len = 0;
+	int finlen = 0;
+
+	bool ok = 
+		EVP_DecryptInit_ex(ctx, cipher, NULL, NULL, NULL) == 1 &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, SNAPBLOCK_AEAD_IV_SIZE, NULL) == 1 &&
+		EVP_DecryptInit_ex(ctx, NULL, NULL, aead_key, ehdr.iv) == 1 &&
+		EVP_DecryptUpdate(ctx, NULL, &len, (const unsigned char*) &aad, sizeof(aad)) == 1 &&
+		EVP_DecryptUpdate(ctx, buf, &len, buf, (int) nbytes) == 1 &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SNAPBLOCK_AEAD_TAG_SIZE, ehdr.tag) == 1 &&
+		EVP_DecryptFinal_ex(ctx, buf + len, &finlen) == 1;
+
+	EVP_CIPHER_CTX_free(ctx);
+
+	return ok;
+}
+
+// checksum verified and decrypted, NULL if anything is wrong
+static uint8_t* read_payload(int snaps_fd, const struct snapblock_file_hdr *mhdr, off_t hdr_off) {
 	size_t nbytes = sizeof(uint8_t) * mhdr->payldsiz;
 	uint8_t *buf = malloc(nbytes);
 
 	if(buf == NULL) {
-		lseek(snaps_fd, mhdr->payldsiz, SEEK_CUR);
-		return;
+		return NULL;
 	}
 
-	ssize_t rerr = read(snaps_fd, buf, nbytes);
+	ssize_t rerr = pread(snaps_fd, buf, nbytes, hdr_off + mhdr->payld_off);
 
 	if(rerr < 0) {
-		perror("read");
-		lseek(snaps_fd, mhdr->payldsiz, SEEK_CUR);
+		perror("pread");
 		free(buf);
-		return;
+		return NULL;
 	}
 
 	if(rerr != (ssize_t) nbytes) {
@@ -88,67 +495,415 @@ static void __do_restore_rawblocks(int snaps_fd, int device_fd, const struct sna
 		exit(EXIT_FAILURE);
 	}
 
-	lseek(device_fd, mhdr->blknr * nbytes, SEEK_SET);
+	if(mhdr->payld_type & SNAPBLOCK_PAYLOAD_FLAG_CRC32C) {
+		struct snapblock_csum_exthdr csum;
+		off_t csum_off = hdr_off + sizeof(struct snapblock_file_hdr) + 
+			snapblock_exthdr_size(mhdr) - sizeof(struct snapblock_csum_exthdr);
 
-	ssize_t werr = write(device_fd, buf, nbytes);
+		if(!read_exactly(snaps_fd, &csum, sizeof(csum), csum_off)) {
+			free(buf);
+			return NULL;
+		}
+
+		if(crc32c(buf, nbytes) != csum.crc32c) {
+			printf("checksum mismatch for block %ld (snapblock at %ld), skipping it\n", mhdr->blknr, hdr_off);
+			free(buf);
+			return NULL;
+		}
+	}
+
+	if(!(mhdr->payld_type & SNAPBLOCK_PAYLOAD_FLAG_AES_GCM)) {
+		return buf;
+	}
+
+	if(aead_key_size == 0) {
+		//still, the checksum says the ciphertext is intact
+		if(verify_only) {
+			return buf;
+		}
+
+		printf("block %ld is encrypted and no key was given (-k), skipping it\n", mhdr->blknr);
+		free(buf);
+		return NULL;
+	}
+
+	if(!decrypt_payload(snaps_fd, buf, nbytes, mhdr, hdr_off)) {
+		printf("authentication failed for block %ld (snapblock at %ld), skipping it\n", mhdr->blknr, hdr_off);
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void write_block(int device_fd, uint64_t blknr, const uint8_t *buf, size_t nbytes) {
+	ssize_t werr = pwrite(device_fd, buf, nbytes, blknr * nbytes);
 
 	if(werr < 0) {
-		perror("write");
+		perror("pwrite");
 	}
 
 	if(werr != (ssize_t) nbytes) {
 		printf("unexpected writing error: could not write %ld bytes\n", nbytes);
 		exit(EXIT_FAILURE);
 	}
+}
+
+static void __do_restore_rawblocks(int snaps_fd, int device_fd, const struct snapblock_file_hdr *mhdr, off_t hdr_off) {
+	uint8_t *buf = read_payload(snaps_fd, mhdr, hdr_off);
+	if(buf == NULL) {
+		return;
+	}
+
+	write_block(device_fd, mhdr->blknr, buf, mhdr->payldsiz);
 
 	free(buf);
 }
 
-#define seek_nexthdr(fd, hdr) \
-	lseek(fd, (hdr).payld_off + (hdr).payldsiz - sizeof(struct snapblock_file_hdr) , SEEK_CUR);
+static void __do_restore_compressed_blocks(int snaps_fd, int device_fd, const struct snapblock_file_hdr *mhdr, off_t hdr_off) {
+	struct snapblock_rawsiz_exthdr ehdr;
+	if(!read_exactly(snaps_fd, &ehdr, sizeof(ehdr), hdr_off + sizeof(struct snapblock_file_hdr))) {
+		return;
+	}
+
+	uint8_t *cbuf = read_payload(snaps_fd, mhdr, hdr_off);
+	if(cbuf == NULL) {
+		return;
+	}
+
+	uint8_t *buf = malloc(sizeof(uint8_t) * ehdr.rawsiz);
+	if(buf == NULL) {
+		free(cbuf);
+		return;
+	}
+
+	bool ok;
+	if(payload_type_of(mhdr) == SNAPBLOCK_PAYLOAD_TYPE_LZ4) {
+		int dlen = LZ4_decompress_safe((const char*) cbuf, (char*) buf, mhdr->payldsiz, ehdr.rawsiz);
+		ok = dlen >= 0 && (uint64_t) dlen == ehdr.rawsiz;
+	} else {
+		size_t dlen = ZSTD_decompress(buf, ehdr.rawsiz, cbuf, mhdr->payldsiz);
+		ok = !ZSTD_isError(dlen) && dlen == ehdr.rawsiz;
+	}
 
-static void restore_by_type(int snaps_fd, int device_fd, const struct snapblock_file_hdr* mhdr) {
-	if(mhdr->payld_type == SNAPBLOCK_PAYLOAD_TYPE_RAW) {
-		__do_restore_rawblocks(snaps_fd, device_fd, mhdr);
+	if(ok) {
+		write_block(device_fd, mhdr->blknr, buf, ehdr.rawsiz);
 	} else {
-		seek_nexthdr(snaps_fd, *mhdr);
+		printf("corrupted compressed payload for block %ld, skipping it\n", mhdr->blknr);
 	}
+
+	free(buf);
+	free(cbuf);
 }
 
-static void do_restore() {
-	int snaps_fd = open(snapblocks_path, O_RDONLY);
-	if(snaps_fd < 0) {
-		fprintf(stderr, "open(%s): %s\n", snapblocks_path, strerror(errno));
+static void __do_restore_zeroblocks(int snaps_fd, int device_fd, const struct snapblock_file_hdr *mhdr, off_t hdr_off) {
+	struct snapblock_rawsiz_exthdr ehdr;
+	if(!read_exactly(snaps_fd, &ehdr, sizeof(ehdr), hdr_off + sizeof(struct snapblock_file_hdr))) {
+		return;
+	}
+
+	uint8_t *buf = calloc(ehdr.rawsiz, sizeof(uint8_t));
+	if(buf == NULL) {
+		return;
+	}
+
+	write_block(device_fd, mhdr->blknr, buf, ehdr.rawsiz);
+
+	free(buf);
+}
+
+static void restore_by_type(int snaps_fd, int device_fd, const struct snapblock_file_hdr* mhdr, off_t hdr_off);
+
+// the referenced record is restored in place of this one
+static void __do_restore_refblocks(int snaps_fd, int device_fd, const struct snapblock_file_hdr *mhdr, off_t hdr_off) {
+	struct snapblock_ref_exthdr ehdr;
+	if(!read_exactly(snaps_fd, &ehdr, sizeof(ehdr), hdr_off + sizeof(struct snapblock_file_hdr))) {
+		return;
+	}
+
+	struct snapblock_file_hdr refhdr;
+	if(!read_exactly(snaps_fd, &refhdr, sizeof(refhdr), ehdr.ref_off)) {
+		return;
+	}
+
+	if(refhdr.magic != SNAPBLOCK_MAGIC || payload_type_of(&refhdr) == SNAPBLOCK_PAYLOAD_TYPE_REF) {
+		printf("broken reference for block %ld, skipping it\n", mhdr->blknr);
+		return;
+	}
+
+	refhdr.blknr = mhdr->blknr;
+	restore_by_type(snaps_fd, device_fd, &refhdr, ehdr.ref_off);
+}
+
+static void restore_by_type(int snaps_fd, int device_fd, const struct snapblock_file_hdr* mhdr, off_t hdr_off) {
+	enum snapblock_payload_type type = payload_type_of(mhdr);
+
+	if(type == SNAPBLOCK_PAYLOAD_TYPE_RAW) {
+		__do_restore_rawblocks(snaps_fd, device_fd, mhdr, hdr_off);
+	} else if(type == SNAPBLOCK_PAYLOAD_TYPE_LZ4 || type == SNAPBLOCK_PAYLOAD_TYPE_ZSTD) {
+		__do_restore_compressed_blocks(snaps_fd, device_fd, mhdr, hdr_off);
+	} else if(type == SNAPBLOCK_PAYLOAD_TYPE_ZERO) {
+		__do_restore_zeroblocks(snaps_fd, device_fd, mhdr, hdr_off);
+	} else if(type == SNAPBLOCK_PAYLOAD_TYPE_REF) {
+		__do_restore_refblocks(snaps_fd, device_fd, mhdr, hdr_off);
+	}
+}
+
+/**
+ *
+ * snapblocks segments
+ *
+ * an epoch written on more lanes has a snapblocks segment per lane
+ * ("snapblocks.<n>"), a block is in one segment only
+ *
+ */
+
+#define SNAPBLOCKS_FILE_NAME "snapblocks"
+
+static char **segments = NULL;
+static size_t nsegments = 0;
+
+// -1 unless name is "snapblocks" (0) or "snapblocks.<n>" (n + 1)
+static long segment_rank(const char *name) {
+	size_t baselen = strlen(SNAPBLOCKS_FILE_NAME);
+
+	if(strncmp(name, SNAPBLOCKS_FILE_NAME, baselen) != 0) {
+		return -1;
+	}
+
+	if(name[baselen] == 0) {
+		return 0;
+	}
+
+	if(name[baselen] != '.' || name[baselen + 1] == 0) {
+		return -1;
+	}
+
+	long n = 0;
+	for(const char *c = name + baselen + 1; *c != 0; c++) {
+		if(*c < '0' || *c > '9' || n > 100000) {
+			return -1;
+		}
+
+		n = n * 10 + (*c - '0');
+	}
+
+	return n + 1;
+}
+
+static int cmp_segments(const void *a, const void *b) {
+	const char *na = strrchr(*(char* const*) a, '/') + 1;
+	const char *nb = strrchr(*(char* const*) b, '/') + 1;
+
+	long ra = segment_rank(na);
+	long rb = segment_rank(nb);
+
+	return (ra > rb) - (ra < rb);
+}
+
+// snapblocks_path itself, or every segment in it if it is a directory
+static void collect_segments() {
+	struct stat st;
+	if(stat(snapblocks_path, &st) != 0) {
+		fprintf(stderr, "stat(%s): %s\n", snapblocks_path, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	int device_fd = open(device_path, O_WRONLY);
-	if(device_fd < 0) {
-		fprintf(stderr, "open(%s): %s\n", device_path, strerror(errno));
-		close(snaps_fd);
+	if(!S_ISDIR(st.st_mode)) {
+		segments = &snapblocks_path;
+		nsegments = 1;
+		return;
+	}
+
+	DIR *dir = opendir(snapblocks_path);
+	if(dir == NULL) {
+		fprintf(stderr, "opendir(%s): %s\n", snapblocks_path, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
-	
+
+	size_t cap = 0;
+	struct dirent *dent;
+
+	while((dent = readdir(dir)) != NULL) {
+		if(segment_rank(dent->d_name) < 0) {
+			continue;
+		}
+
+		if(nsegments == cap) {
+			cap = cap == 0 ? 8 : cap * 2;
+			segments = realloc(segments, cap * sizeof(char*));
+			if(segments == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		size_t len = strlen(snapblocks_path) + strlen(dent->d_name) + 2;
+		segments[nsegments] = malloc(len);
+		if(segments[nsegments] == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		snprintf(segments[nsegments++], len, "%s/%s", snapblocks_path, dent->d_name);
+	}
+
+	closedir(dir);
+
+	if(nsegments == 0) {
+		fprintf(stderr, "no snapblocks in %s\n", snapblocks_path);
+		exit(EXIT_FAILURE);
+	}
+
+	qsort(segments, nsegments, sizeof(char*), cmp_segments);
+}
+
+/**
+ *
+ * incomplete snapshots
+ *
+ * the module leaves an "incomplete" file in the snapshot directory of an
+ * epoch that misses blocks (captures refused or lost), holding how many:
+ * restoring it would leave those blocks as they are now
+ *
+ */
+
+#define INCOMPLETE_FILE_NAME "incomplete"
+
+// -1 if the snapshot is complete
+static long missing_blocks() {
+	char path[PATH_MAX];
+	struct stat st;
+
+	if(stat(snapblocks_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+		snprintf(path, sizeof(path), "%s/%s", snapblocks_path, INCOMPLETE_FILE_NAME);
+	} else {
+		const char *slash = strrchr(snapblocks_path, '/');
+		if(slash == NULL) {
+			snprintf(path, sizeof(path), "%s", INCOMPLETE_FILE_NAME);
+		} else {
+			snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - snapblocks_path), snapblocks_path, INCOMPLETE_FILE_NAME);
+		}
+	}
+
+	FILE *f = fopen(path, "r");
+	if(f == NULL) {
+		return -1;
+	}
+
+	long n;
+	if(fscanf(f, "%ld", &n) != 1) {
+		n = 0;
+	}
+
+	fclose(f);
+	return n;
+}
+
+// checks every payload checksum and every reference, one sequential pass
+static void verify_segment(const char *path, uint64_t *nrecs, uint64_t *nchecked, uint64_t *nbad, bool *failed) {
+	int snaps_fd = open(path, O_RDONLY);
+	if(snaps_fd < 0) {
+		fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	posix_fadvise(snaps_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	static struct snapblocks_reader reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = snaps_fd;
+
 	struct snapblock_file_hdr hdrbuf;
-	ssize_t hdrbufsize = sizeof(struct snapblock_file_hdr);
-	ssize_t readerr;
+	off_t hdr_off;
 
-	while((readerr = read(snaps_fd, &hdrbuf, hdrbufsize)) == hdrbufsize) {
-		if(hdrbuf.magic != SNAPBLOCK_MAGIC) {
-			puts("invalid magic number for snapblock header");
-			puts("aborting");
-			break;
+	while(next_snapblock(&reader, &hdrbuf, &hdr_off)) {
+		(*nrecs)++;
+
+		if(payload_type_of(&hdrbuf) == SNAPBLOCK_PAYLOAD_TYPE_REF) {
+			struct snapblock_ref_exthdr ehdr;
+			struct snapblock_file_hdr refhdr;
+
+			if(!read_exactly(snaps_fd, &ehdr, sizeof(ehdr), hdr_off + sizeof(struct snapblock_file_hdr)) ||
+					!read_exactly(snaps_fd, &refhdr, sizeof(refhdr), ehdr.ref_off) ||
+					refhdr.magic != SNAPBLOCK_MAGIC) {
+				printf("broken reference for block %ld (snapblock at %ld of %s)\n", hdrbuf.blknr, hdr_off, path);
+				(*nbad)++;
+			}
+
+			continue;
+		}
+
+		bool authenticated = (hdrbuf.payld_type & SNAPBLOCK_PAYLOAD_FLAG_AES_GCM) && aead_key_size > 0;
+
+		if(!(hdrbuf.payld_type & SNAPBLOCK_PAYLOAD_FLAG_CRC32C) && !authenticated) {
+			continue;
+		}
+
+		uint8_t *buf = read_payload(snaps_fd, &hdrbuf, hdr_off);
+		if(buf == NULL) {
+			(*nbad)++;
+			continue;
 		}
 
+		(*nchecked)++;
+		free(buf);
+	}
+
+	close(snaps_fd);
+
+	if(reader.failed) {
+		printf("%s is truncated or corrupted past the last snapblock reported\n", path);
+		*failed = true;
+	}
+}
+
+static void do_verify() {
+	uint64_t nrecs = 0;
+	uint64_t nchecked = 0;
+	uint64_t nbad = 0;
+	bool failed = false;
+
+	for(size_t i = 0; i < nsegments; i++) {
+		verify_segment(segments[i], &nrecs, &nchecked, &nbad, &failed);
+	}
+
+	printf("%ld snapblocks, %ld payloads verified, %ld bad\n", nrecs, nchecked, nbad);
+
+	if(nbad > 0 || failed) {
+		exit(EXIT_FAILURE);
+	}
+}
+
+// true once the only block to restore is restored
+static bool restore_segment(const char *path, int device_fd) {
+	bool done = false;
+
+	int snaps_fd = open(path, O_RDONLY);
+	if(snaps_fd < 0) {
+		fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+		close(device_fd);
+		exit(EXIT_FAILURE);
+	}
+
+	static struct snapblocks_reader reader;
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = snaps_fd;
+	
+	struct snapblock_file_hdr hdrbuf;
+	off_t hdr_off;
+
+	while(next_snapblock(&reader, &hdrbuf, &hdr_off)) {
 		if(!restore_all && restore_only_blknum != hdrbuf.blknr) {
-			seek_nexthdr(snaps_fd, hdrbuf); 
 			continue;
 		}
 
 		puts("+--------snapblock header-----------+");
 		printf(" * block number: %ld\n", hdrbuf.blknr);
 		printf(" * payload size: %ld\n", hdrbuf.payldsiz);
-		printf(" * payload type: %s\n", payload_type_to_str(hdrbuf.payld_type));
+		printf(" * payload type: %s\n", payload_type_to_str(payload_type_of(&hdrbuf)));
+		printf(" * checksum: %s\n", (hdrbuf.payld_type & SNAPBLOCK_PAYLOAD_FLAG_CRC32C) ? "crc32c" : "none");
+		printf(" * encryption: %s\n", (hdrbuf.payld_type & SNAPBLOCK_PAYLOAD_FLAG_AES_GCM) ? "aes-gcm" : "none");
 		printf(" * payload offset at: %ld\n", hdrbuf.payld_off);
 		puts("+-----------------------------------+");
 
@@ -161,31 +916,64 @@ static void do_restore() {
 
 			if(strcmp(ans, "yes\n")) {
 				puts(" --- skipping\n");
-				seek_nexthdr(snaps_fd, hdrbuf);
 				continue;
 			}
 		}
 
 		puts(" !!! restoring...\n");
-		restore_by_type(snaps_fd, device_fd, &hdrbuf);
+		restore_by_type(snaps_fd, device_fd, &hdrbuf, hdr_off);
 
 		if(!restore_all && restore_only_blknum == hdrbuf.blknr) {
+			done = true;
 			break;
 		}
 	}
 
-	if(readerr < 0) {
-		perror("read");
+	close(snaps_fd);
+	return done;
+}
+
+static void do_restore() {
+	int device_fd = open(device_path, O_WRONLY);
+	if(device_fd < 0) {
+		fprintf(stderr, "open(%s): %s\n", device_path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for(size_t i = 0; i < nsegments; i++) {
+		if(restore_segment(segments[i], device_fd)) {
+			break;
+		}
 	}
 
-	close(snaps_fd);
 	close(device_fd);
 }
 
 int main(int argc, char** argv) {
+	static const struct option long_opts[] = {
+		{ "verify-only", no_argument, NULL, 'V' },
+		{ "allow-incomplete", no_argument, NULL, 'I' },
+		{ NULL, 0, NULL, 0 }
+	};
+
 	int ch;
-	while((ch = getopt(argc, argv, "hs:f:n:oapc")) != -1) {
+	while((ch = getopt_long(argc, argv, "hs:f:n:oapck:", long_opts, NULL)) != -1) {
 		switch(ch) {
+			case 'V':
+				verify_only = true;
+				break;
+			case 'I':
+				allow_incomplete = true;
+				break;
+			case 'k':
+				if(!parse_aead_key(optarg)) {
+					print_help(argv[0], "the key is made of 32, 48 or 64 hex digits");
+					exit(EXIT_FAILURE);
+				}
+
+				//not visible in /proc/<pid>/cmdline from now on
+				memset(optarg, 0, strlen(optarg));
+				break;
 			case 'h':
 				print_help(argv[0], NULL);
 				exit(EXIT_SUCCESS);
@@ -215,11 +1003,28 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if(snapblocks_path == NULL || device_path == NULL) {
+	if(snapblocks_path == NULL || (device_path == NULL && !verify_only)) {
 		print_help(argv[0], "either snapblocks or device path not specified");
 		exit(EXIT_FAILURE);
 	}
 
+	collect_segments();
+
+	long nmissing = missing_blocks();
+	if(nmissing >= 0) {
+		printf("the snapshot is incomplete: %ld blocks were not captured, they can't be restored\n", nmissing);
+
+		if(!verify_only && !allow_incomplete) {
+			fputs("refusing to restore it, --allow-incomplete restores the blocks it has\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(verify_only) {
+		do_verify();
+		exit(EXIT_SUCCESS);
+	}
+
 	do_restore();
 
 	exit(EXIT_SUCCESS);